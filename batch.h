@@ -0,0 +1,204 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+
+#include "mp4.h"
+#include "probe.h"
+#include "thread_pool.h"
+
+namespace mov {
+
+/**
+ * Append s to out as a JSON string, quotes included
+ */
+inline void appendJsonString(std::string &out, const std::string &s) {
+    out += '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20 || c == 0x7f) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+struct BatchStats {
+    uint64_t files_ = 0;
+    uint64_t failed_ = 0;
+    double seconds_ = 0;
+};
+
+/**
+ * Probe many files on a work stealing pool, writing one JSON line per file
+ *
+ * Files are queued as they are found, so the workers start while
+ * directories are still being listed. A file that fails gets a record with
+ * an "error" field and the run goes on. Records come out in the order the
+ * files finish, not the order they were given.
+ */
+class BatchScanner {
+public:
+    BatchScanner(size_t threads, FILE *out)
+        : out_(out),
+          start_(Clock::now()),
+          stats_(StatsScope::active()),
+          pool_(threads) {}
+
+    // Queue a file, or every regular file below a directory
+    void addPath(const std::string &path) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        if (!fs::is_directory(path, ec)) {
+            addFile(path);
+            return;
+        }
+        auto options = fs::directory_options::skip_permission_denied;
+        fs::recursive_directory_iterator it(path, options, ec), end;
+        if (ec) {
+            writeError(path, ec.message());
+            return;
+        }
+        for (; it != end; it.increment(ec)) {
+            if (ec) {
+                writeError(path, ec.message());
+                return;
+            }
+            if (it->is_regular_file(ec)) {
+                addFile(it->path().string());
+            }
+        }
+    }
+
+    // Queue the paths listed one per line in list, "-" for stdin
+    bool addList(const std::string &list) {
+        std::ifstream file;
+        if (list != "-") {
+            file.open(list);
+            if (!file) {
+                return false;
+            }
+        }
+        std::istream &in = list == "-" ? std::cin : file;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty()) {
+                addPath(line);
+            }
+        }
+        return true;
+    }
+
+    // Wait for every queued file
+    BatchStats finish() {
+        pool_.wait();
+        fflush(out_);
+        BatchStats stats;
+        stats.files_ = files_;
+        stats.failed_ = failed_;
+        stats.seconds_ =
+            std::chrono::duration<double>(Clock::now() - start_).count();
+        return stats;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void addFile(std::string path) {
+        pool_.submit([this, path = std::move(path)] { scan(path); });
+    }
+
+    void scan(const std::string &path) {
+        // Collected per file and added to the StatsScope of the creator
+        ParseStats stats;
+        std::optional<StatsScope> scope;
+        if (stats_ != nullptr) {
+            scope.emplace(stats);
+        }
+        try {
+            FileOp file(path);
+            ProbeInfo info;
+            if (!file.open("r")) {
+                writeError(path, "open failed");
+            } else if (!probe(file, kProbeAll, info)) {
+                writeError(path, "no moov");
+            } else {
+                write(formatRecord(path, file.size(), info), false);
+            }
+        } catch (const std::exception &e) {
+            writeError(path, e.what());
+        }
+        if (stats_ != nullptr) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stats_->merge(stats);
+        }
+    }
+
+    static std::string formatRecord(const std::string &path, uint64_t size,
+                                    const ProbeInfo &info) {
+        std::string out = "{\"path\":";
+        appendJsonString(out, path);
+        out += ",\"size\":" + std::to_string(size);
+        out += ",\"timescale\":" + std::to_string(info.timescale_);
+        out += ",\"duration\":" + std::to_string(info.duration_);
+        out += ",\"tracks\":[";
+        for (size_t i = 0; i < info.tracks_.size(); i++) {
+            const auto &track = info.tracks_[i];
+            out += i == 0 ? "{" : ",{";
+            out += "\"id\":" + std::to_string(track.track_id_);
+            out += ",\"handler\":";
+            appendJsonString(out, Box::boxType2Str(track.handler_type_));
+            out += ",\"codec\":";
+            appendJsonString(out, Box::boxType2Str(track.codec_));
+            out += ",\"timescale\":" + std::to_string(track.timescale_);
+            out += ",\"duration\":" + std::to_string(track.duration_);
+            out += ",\"language\":";
+            appendJsonString(out, track.language_);
+            if (track.width_ != 0) {
+                out += ",\"width\":" + std::to_string(track.width_);
+                out += ",\"height\":" + std::to_string(track.height_);
+            }
+            out += '}';
+        }
+        out += "]}\n";
+        return out;
+    }
+
+    void writeError(const std::string &path, const std::string &error) {
+        std::string out = "{\"path\":";
+        appendJsonString(out, path);
+        out += ",\"error\":";
+        appendJsonString(out, error);
+        out += "}\n";
+        write(out, true);
+    }
+
+    void write(const std::string &record, bool failed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fwrite(record.data(), 1, record.size(), out_);
+        files_++;
+        if (failed) {
+            failed_++;
+        }
+    }
+
+    FILE *out_;
+    Clock::time_point start_;
+    std::mutex mutex_;
+    ParseStats *stats_;
+    uint64_t files_ = 0;
+    uint64_t failed_ = 0;
+    // Last, so the workers are joined before anything they use goes away
+    WorkStealingPool pool_;
+};
+
+}  // namespace mov
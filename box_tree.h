@@ -0,0 +1,220 @@
+#pragma once
+
+#include <memory_resource>
+#include <unordered_map>
+
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Box tree of one file in flat storage
+ *
+ * Headers live in one contiguous array, and the children of a node are the
+ * range [first_child_, first_child_ + child_count_) of that array. Detail
+ * boxes are constructed in place in an arena owned by the tree and hold only
+ * their own fields; their children() lists stay empty. Everything is freed
+ * at once by clear() or the destructor.
+ */
+class BoxTree {
+public:
+    using Index = uint32_t;
+    static constexpr Index npos = UINT32_MAX;
+
+    struct Node {
+        uint64_t offset_ = 0;
+        uint64_t size_ = 0;
+        uint32_t type_{};
+        Index parent_ = npos;
+        Index first_child_ = 0;
+        Index child_count_ = 0;
+        Box *box_ = nullptr;
+    };
+
+    BoxTree() = default;
+
+    BoxTree(const BoxTree &) = delete;
+
+    BoxTree &operator=(const BoxTree &) = delete;
+
+    ~BoxTree() { clear(); }
+
+    bool parse(const char *path) {
+        FileOp file(path);
+        if (!file.open("r")) return false;
+        parse(file);
+        return true;
+    }
+
+    void parse(FileOp &file) {
+        clear();
+        auto roots = parseLevel(file, file.tell(), UINT64_MAX, nullptr);
+        first_root_ = roots.first;
+        root_count_ = roots.second;
+        for (Index i = 0; i < nodes_.size(); i++) {
+            auto &node = nodes_[i];
+            for (Index c = 0; c < node.child_count_; c++) {
+                nodes_[node.first_child_ + c].parent_ = i;
+            }
+            by_type_[node.type_].push_back(i);
+        }
+        for (auto &item : by_type_) {
+            std::sort(item.second.begin(), item.second.end(),
+                      [this](Index a, Index b) {
+                          return nodes_[a].offset_ < nodes_[b].offset_;
+                      });
+        }
+    }
+
+    void clear() {
+        for (auto &node : nodes_) {
+            node.box_->~Box();
+        }
+        nodes_.clear();
+        by_type_.clear();
+        arena_.release();
+        first_root_ = 0;
+        root_count_ = 0;
+    }
+
+    size_t size() const { return nodes_.size(); }
+
+    const Node &node(Index i) const { return nodes_[i]; }
+
+    Box *box(Index i) const { return nodes_[i].box_; }
+
+    std::pair<Index, Index> roots() const { return {first_root_, root_count_}; }
+
+    std::pair<Index, Index> children(Index i) const {
+        return {nodes_[i].first_child_, nodes_[i].child_count_};
+    }
+
+    /**
+     * Every box of type in file order, which is by offset since a box comes
+     * before its children. Boxes of one type within a box are then a range,
+     * see within().
+     */
+    const std::vector<Index> &boxes(uint32_t type) const {
+        static const std::vector<Index> none;
+        auto it = by_type_.find(type);
+        return it != by_type_.end() ? it->second : none;
+    }
+
+    // The range of boxes(type) that lies inside box i
+    std::pair<const Index *, const Index *> within(Index i,
+                                                   uint32_t type) const {
+        const auto &all = boxes(type);
+        auto begin = nodes_[i].offset_;
+        auto end = begin + nodes_[i].size_;
+        auto first = std::upper_bound(
+            all.data(), all.data() + all.size(), begin,
+            [this](uint64_t o, Index b) { return o < nodes_[b].offset_; });
+        auto last = std::lower_bound(
+            first, all.data() + all.size(), end,
+            [this](Index b, uint64_t o) { return nodes_[b].offset_ < o; });
+        return {first, last};
+    }
+
+    Index getAncestor(Index i, uint32_t type) const {
+        for (auto p = nodes_[i].parent_; p != npos; p = nodes_[p].parent_) {
+            if (nodes_[p].type_ == type) return p;
+        }
+        return npos;
+    }
+
+    Index findChild(Index i, uint32_t type) const {
+        auto &node = nodes_[i];
+        for (Index c = 0; c < node.child_count_; c++) {
+            if (nodes_[node.first_child_ + c].type_ == type) {
+                return node.first_child_ + c;
+            }
+        }
+        return npos;
+    }
+
+private:
+    using BoxBuilder = Box::BoxBuilder;
+
+    struct ArenaMaker {
+        std::pmr::memory_resource &arena_;
+        const Box &base_;
+
+        template <typename T>
+        Box *make() {
+            void *p = arena_.allocate(sizeof(T), alignof(T));
+            return new (p) T(base_);
+        }
+    };
+
+    /**
+     * Parse the boxes in [pos, end). Siblings are collected on pending_ and
+     * appended to nodes_ together once their own subtrees are done, which
+     * keeps every child list contiguous. Return the range they were stored
+     * at.
+     */
+    std::pair<Index, Index> parseLevel(FileOp &file, uint64_t pos,
+                                       uint64_t end, Box *parent) {
+        auto level = pending_.size();
+        while (pos < end) {
+            BoxBuilder header;
+            if (!Box::readHeaderAt(*file.source(), pos, header, file.limit()) ||
+                header.size_ < header.header_size_ || header.end() <= pos) {
+                break;
+            }
+            auto box = makeBox(header, file, parent);
+            pending_.push_back(Node{header.offset_, header.size_, header.type_,
+                                    npos, 0, 0, box});
+            auto self = pending_.size() - 1;
+            auto children = Box::childrenOffset(header.type_);
+            if (children >= 0) {
+                auto range =
+                    parseLevel(file, header.payloadOffset() + children,
+                               std::min(header.end(), end), box);
+                auto &node = pending_[self];
+                node.first_child_ = range.first;
+                node.child_count_ = range.second;
+            }
+            pos = header.end();
+        }
+        Index first = nodes_.size();
+        nodes_.insert(nodes_.end(), pending_.begin() + level, pending_.end());
+        pending_.resize(level);
+        return {first, static_cast<Index>(nodes_.size() - first)};
+    }
+
+    Box *makeBox(const BoxBuilder &header, FileOp &file, Box *parent) {
+        Box base(header.size_, header.offset_, header.type_,
+                 header.extended_type_, header.header_size_);
+        Box *box;
+        if (parent != nullptr && parent->baseType() == Stsd::tag_) {
+            box = static_cast<Stsd *>(parent)->visitEntryType(
+                ArenaMaker{arena_, base});
+        } else {
+            box = visitDetailType(header.type_, ArenaMaker{arena_, base});
+        }
+        box->setParent(parent);
+
+        FileOp cursor(file.source(), header.payloadOffset());
+        auto children = Box::childrenOffset(header.type_);
+        cursor.setLimit(children >= 0 ? header.payloadOffset() + children
+                                      : header.end());
+        box->parse(cursor);
+
+        if (parent != nullptr && parent->baseType() == Mdia::tag_) {
+            static_cast<Mdia *>(parent)->link(
+                header.type_ == Mdhd::tag_ ? static_cast<Mdhd *>(box) : nullptr,
+                header.type_ == Hdlr::tag_ ? static_cast<Hdlr *>(box)
+                                           : nullptr);
+        }
+        return box;
+    }
+
+    std::pmr::monotonic_buffer_resource arena_{64 * 1024};
+    std::vector<Node> nodes_;
+    std::vector<Node> pending_;
+    std::unordered_map<uint32_t, std::vector<Index>> by_type_;
+    Index first_root_ = 0;
+    Index root_count_ = 0;
+};
+
+}  // namespace mov
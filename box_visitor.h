@@ -0,0 +1,110 @@
+#pragma once
+
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Callbacks for a depth first walk over the boxes of a file
+ *
+ * The walk builds no tree: each callback sees the header of the current box
+ * and a cursor into the input, and anything the visitor wants to keep it
+ * has to keep itself.
+ */
+class BoxVisitor {
+public:
+    enum class Action {
+        Continue,  // descend into a container, or deliver the payload
+        Skip,      // go on with the next sibling
+        Stop,      // end the walk
+    };
+
+    virtual ~BoxVisitor() = default;
+
+    /**
+     * A box starts. file is positioned at the payload and may be read from;
+     * the walker repositions it afterwards.
+     */
+    virtual Action enter(const BoxHeader &, FileOp &) {
+        return Action::Continue;
+    }
+
+    /**
+     * Payload of a box without children, called after enter() returned
+     * Continue. file is positioned at the payload.
+     */
+    virtual Action payload(const BoxHeader &, FileOp &) {
+        return Action::Continue;
+    }
+
+    /**
+     * A box ends. Called for every box whose enter() didn't return Stop.
+     */
+    virtual void leave(const BoxHeader &) {}
+};
+
+/**
+ * Walk the boxes from the cursor up to end. Return false if the visitor
+ * stopped the walk.
+ */
+inline bool walkBoxes(FileOp &file, BoxVisitor &visitor,
+                      uint64_t end = UINT64_MAX) {
+    using Action = BoxVisitor::Action;
+    auto pos = file.tell();
+    while (pos < end) {
+        BoxHeader header;
+        if (!Box::readHeaderAt(*file.source(), pos, header, file.limit()) ||
+            header.size_ < header.header_size_ || header.end() <= pos) {
+            return true;
+        }
+        file.seek(header.payloadOffset(), SEEK_SET);
+        auto action = visitor.enter(header, file);
+        if (action == Action::Stop) {
+            return false;
+        }
+        if (action == Action::Continue) {
+            auto children = Box::childrenOffset(header.type_);
+            if (children >= 0) {
+                file.seek(header.payloadOffset() + children, SEEK_SET);
+                if (!walkBoxes(file, visitor, std::min(header.end(), end))) {
+                    return false;
+                }
+            } else {
+                file.seek(header.payloadOffset(), SEEK_SET);
+                if (visitor.payload(header, file) == Action::Stop) {
+                    return false;
+                }
+            }
+        }
+        visitor.leave(header);
+        pos = header.end();
+    }
+    return true;
+}
+
+/**
+ * Build the detail box for header and parse its own fields, without its
+ * children. parent, if given, is what getAncestor() lookups walk up to;
+ * sample entries need their stsd there to get their type.
+ */
+inline std::shared_ptr<Box> parseDetail(const BoxHeader &header,
+                                        const FileOp &file,
+                                        Box *parent = nullptr) {
+    auto base = Box::BoxBuilder(header).build();
+    std::shared_ptr<Box> box;
+    if (parent != nullptr && parent->baseType() == Stsd::tag_) {
+        box = static_cast<Stsd *>(parent)->makeEntry(std::move(base));
+    } else {
+        box = toDetailType(std::move(base));
+    }
+    box->setParent(parent);
+
+    FileOp cursor(file.source(), header.payloadOffset());
+    auto children = Box::childrenOffset(header.type_);
+    cursor.setLimit(children >= 0 ? header.payloadOffset() + children
+                                  : header.end());
+    box->parse(cursor);
+    return box;
+}
+
+}  // namespace mov
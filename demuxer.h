@@ -0,0 +1,360 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+
+#include "fragment_index.h"
+#include "index_cache.h"
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Recycles read buffers
+ *
+ * A buffer goes back to the pool when its last reference is dropped, from
+ * whatever thread that happens on, so a consumer holding on to samples only
+ * delays the reuse of the buffers they point into.
+ */
+class BufferPool {
+public:
+    using Buffer = std::shared_ptr<std::vector<uint8_t>>;
+
+    // A buffer of size bytes, contents undefined
+    Buffer acquire(size_t size) {
+        std::unique_ptr<std::vector<uint8_t>> buffer;
+        {
+            std::lock_guard<std::mutex> lock(state_->mutex_);
+            if (!state_->free_.empty()) {
+                buffer = std::move(state_->free_.back());
+                state_->free_.pop_back();
+            } else {
+                state_->allocated_++;
+            }
+        }
+        if (buffer == nullptr) {
+            buffer = std::make_unique<std::vector<uint8_t>>();
+        }
+        buffer->resize(size);
+        auto state = state_;
+        return Buffer(buffer.release(), [state](std::vector<uint8_t> *p) {
+            std::lock_guard<std::mutex> lock(state->mutex_);
+            if (state->free_.size() < kMaxFree) {
+                state->free_.emplace_back(p);
+            } else {
+                state->allocated_--;
+                delete p;
+            }
+        });
+    }
+
+    // Buffers alive, in use or waiting for reuse
+    size_t allocated() const {
+        std::lock_guard<std::mutex> lock(state_->mutex_);
+        return state_->allocated_;
+    }
+
+private:
+    static const size_t kMaxFree = 16;
+
+    // Outlives the pool while buffers are out
+    struct State {
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<std::vector<uint8_t>>> free_;
+        size_t allocated_ = 0;
+    };
+
+    std::shared_ptr<State> state_ = std::make_shared<State>();
+};
+
+/**
+ * One sample as handed out by Demuxer, times in the track timescale
+ */
+struct Sample {
+    // Index of the track in the Demuxer, below trackCount()
+    size_t track_ = 0;
+    uint32_t track_id_ = 0;
+    // Counted from 0 within the track
+    uint64_t number_ = 0;
+    uint64_t dts_ = 0;
+    int64_t cts_ = 0;
+    uint64_t duration_ = 0;
+    uint32_t timescale_ = 1;
+    bool sync_ = false;
+    uint64_t offset_ = 0;
+    const uint8_t *data_ = nullptr;
+    uint32_t size_ = 0;
+    // Keeps data_ valid, nullptr when it points into a mapping
+    std::shared_ptr<const void> hold_;
+};
+
+struct DemuxStats {
+    uint64_t samples_ = 0;
+    uint64_t reads_ = 0;
+    uint64_t bytes_read_ = 0;
+};
+
+/**
+ * Samples of every track merged into one stream in decoding time order
+ *
+ * The next sample comes off a min-heap keyed by the decoding time of each
+ * track's next sample. Sample data is read ahead in batches: the samples
+ * that come next, up to max_read bytes of them, are sorted by offset and
+ * read with one I/O per run of samples that sit together on disk, whatever
+ * track they belong to. With the usual interleaved chunk layout a batch is
+ * one large sequential read rather than one read per sample, and tracks
+ * stored apart cost one read each, without reading anything twice.
+ * Buffers come from a BufferPool and samples point into them without a
+ * copy. A mapped input needs no reads at all.
+ *
+ * Fragmented files are read through their fragment index, so their samples
+ * come out the same way.
+ */
+class Demuxer {
+public:
+    /**
+     * max_read caps a batch and a single read. Samples less than max_gap
+     * bytes apart share a read, the bytes between them are read and
+     * dropped, as long as those are no more than 1/kMaxWaste of the read.
+     */
+    explicit Demuxer(size_t max_read = 4 << 20, size_t max_gap = 64 << 10)
+        : max_read_(max_read), max_gap_(max_gap) {}
+
+    bool open(const char *path) {
+        auto source = std::make_shared<PreadSource>();
+        if (!source->open(path)) {
+            return false;
+        }
+        return open(std::move(source));
+    }
+
+    bool open(std::shared_ptr<ByteSource> source) {
+        FragmentedFile file;
+        if (!file.open(source)) {
+            return false;
+        }
+        tracks_.clear();
+        for (const auto &item : file.moov()->children()) {
+            auto trak = item->as<Trak>();
+            auto tkhd = trak ? trak->child<Tkhd>() : nullptr;
+            if (tkhd == nullptr) continue;
+            Track track;
+            track.id_ = tkhd->trackId();
+            if (file.buildTrackIndex(track.id_, track.index_)) {
+                addTrack(std::move(track));
+            }
+        }
+        start(std::move(source));
+        return true;
+    }
+
+    // Take the sample tables from cache instead of parsing them
+    bool open(const char *path, IndexCache &cache) {
+        IndexedFile file;
+        auto source = std::make_shared<PreadSource>();
+        if (!cache.open(path, file) || !source->open(path)) {
+            return false;
+        }
+        tracks_.clear();
+        for (auto &indexed : file.tracks_) {
+            Track track;
+            track.id_ = indexed.track_id_;
+            track.index_ = std::move(indexed.index_);
+            addTrack(std::move(track));
+        }
+        start(std::move(source));
+        return true;
+    }
+
+    size_t trackCount() const { return tracks_.size(); }
+
+    uint32_t trackId(size_t track) const { return tracks_[track].id_; }
+
+    const TrackIndex &trackIndex(size_t track) const {
+        return tracks_[track].index_;
+    }
+
+    /**
+     * The next sample in decoding time order. Return false at the end, or
+     * if its data can't be read.
+     */
+    bool next(Sample &sample) {
+        if (ready_.empty() && !readBatch()) {
+            return false;
+        }
+        sample = std::move(ready_.front());
+        ready_.pop_front();
+        stats_.samples_++;
+        return true;
+    }
+
+    const DemuxStats &stats() const { return stats_; }
+
+    const BufferPool &pool() const { return pool_; }
+
+private:
+    static const uint64_t kMaxWaste = 8;
+
+    struct Track {
+        uint32_t id_ = 0;
+        TrackIndex index_;
+        uint64_t next_ = 0;
+    };
+
+    // Heap order: the track whose next sample decodes later sinks
+    struct Later {
+        const Demuxer *demuxer_;
+
+        bool operator()(size_t a, size_t b) const {
+            const auto &x = demuxer_->tracks_[a];
+            const auto &y = demuxer_->tracks_[b];
+            auto dx = x.index_.dts(x.next_);
+            auto dy = y.index_.dts(y.next_);
+            uint64_t tx = x.index_.timescale();
+            uint64_t ty = y.index_.timescale();
+            uint64_t lx, ly;
+            if (__builtin_mul_overflow(dx, ty, &lx) ||
+                __builtin_mul_overflow(dy, tx, &ly)) {
+                auto sx = static_cast<long double>(dx) / tx;
+                auto sy = static_cast<long double>(dy) / ty;
+                if (sx != sy) return sx > sy;
+            } else if (lx != ly) {
+                return lx > ly;
+            }
+            auto ox = x.index_.offset(x.next_);
+            auto oy = y.index_.offset(y.next_);
+            return ox != oy ? ox > oy : a > b;
+        }
+    };
+
+    void addTrack(Track track) {
+        if (track.index_.sampleCount() > 0) {
+            tracks_.push_back(std::move(track));
+        }
+    }
+
+    void start(std::shared_ptr<ByteSource> source) {
+        source_ = std::move(source);
+        base_ = source_->data();
+        origin_ = source_->origin();
+        heap_.clear();
+        ready_.clear();
+        for (size_t i = 0; i < tracks_.size(); i++) {
+            pushTrack(i);
+        }
+    }
+
+    void pushTrack(size_t t) {
+        if (tracks_[t].next_ < tracks_[t].index_.sampleCount()) {
+            heap_.push_back(t);
+            std::push_heap(heap_.begin(), heap_.end(), Later{this});
+        }
+    }
+
+    // Take the next sample off the heap, without its data
+    void popSample(Sample &sample) {
+        std::pop_heap(heap_.begin(), heap_.end(), Later{this});
+        auto t = heap_.back();
+        heap_.pop_back();
+        auto &track = tracks_[t];
+        auto n = track.next_++;
+        pushTrack(t);
+
+        const auto &index = track.index_;
+        sample.track_ = t;
+        sample.track_id_ = track.id_;
+        sample.number_ = n;
+        sample.dts_ = index.dts(n);
+        sample.cts_ = index.cts(n);
+        sample.duration_ = index.duration(n);
+        sample.timescale_ = index.timescale();
+        sample.sync_ = index.isSync(n);
+        sample.offset_ = index.offset(n);
+        sample.size_ = index.size(n);
+    }
+
+    /**
+     * Queue the next samples on ready_, up to max_read_ bytes of them but
+     * at least one, and read their data. Return false if there are none or
+     * a read fails.
+     */
+    bool readBatch() {
+        uint64_t bytes = 0;
+        while (!heap_.empty() && (ready_.empty() || bytes < max_read_)) {
+            ready_.emplace_back();
+            popSample(ready_.back());
+            bytes += ready_.back().size_;
+        }
+        if (ready_.empty()) {
+            return false;
+        }
+        if (base_ != nullptr) {
+            for (auto &sample : ready_) {
+                if (sample.offset_ < origin_ ||
+                    sample.offset_ + sample.size_ > source_->size()) {
+                    return fail(sample);
+                }
+                sample.data_ = base_ + (sample.offset_ - origin_);
+            }
+            return true;
+        }
+
+        std::vector<Sample *> order;
+        for (auto &sample : ready_) {
+            order.push_back(&sample);
+        }
+        std::sort(order.begin(), order.end(), [](Sample *a, Sample *b) {
+            return a->offset_ < b->offset_;
+        });
+        for (size_t first = 0, last; first < order.size(); first = last) {
+            auto begin = order[first]->offset_;
+            auto end = begin + order[first]->size_;
+            uint64_t skipped = 0;
+            for (last = first + 1; last < order.size(); last++) {
+                auto sample = order[last];
+                auto sample_end = sample->offset_ + sample->size_;
+                auto gap = sample->offset_ > end ? sample->offset_ - end : 0;
+                if (gap > max_gap_ || sample_end - begin > max_read_ ||
+                    (skipped + gap) * kMaxWaste > sample_end - begin) {
+                    break;
+                }
+                skipped += gap;
+                end = std::max(end, sample_end);
+            }
+            auto buffer = pool_.acquire(end - begin);
+            if (source_->readAt(begin, buffer->data(), end - begin) !=
+                end - begin) {
+                return fail(*order[first]);
+            }
+            stats_.reads_++;
+            stats_.bytes_read_ += end - begin;
+            countSourceRead(*source_, end - begin);
+            for (auto i = first; i < last; i++) {
+                order[i]->data_ = buffer->data() + (order[i]->offset_ - begin);
+                order[i]->hold_ = buffer;
+            }
+        }
+        return true;
+    }
+
+    bool fail(const Sample &sample) {
+        std::cerr << "read sample " << sample.number_ << " of track "
+                  << sample.track_id_ << " failed\n";
+        ready_.clear();
+        heap_.clear();
+        return false;
+    }
+
+    size_t max_read_;
+    size_t max_gap_;
+    std::shared_ptr<ByteSource> source_;
+    const uint8_t *base_ = nullptr;
+    uint64_t origin_ = 0;
+    std::vector<Track> tracks_;
+    std::vector<size_t> heap_;
+    std::deque<Sample> ready_;
+    BufferPool pool_;
+    DemuxStats stats_;
+};
+
+}  // namespace mov
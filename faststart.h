@@ -0,0 +1,348 @@
+#pragma once
+
+#include <sys/sendfile.h>
+
+#include <chrono>
+
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Copy n bytes from in to out at the given offsets without passing them
+ * through user space where the kernel allows it: copy_file_range() first,
+ * then sendfile(), then pread()/pwrite() as the last resort.
+ */
+inline bool copyRange(int in, uint64_t in_offset, int out, uint64_t out_offset,
+                      uint64_t n) {
+    const uint64_t step = 1 << 30;
+    loff_t src = in_offset;
+    loff_t dst = out_offset;
+    while (n > 0) {
+        auto ret = copy_file_range(in, &src, out, &dst, std::min(n, step), 0);
+        if (ret > 0) {
+            n -= ret;
+        } else if (ret == 0) {
+            return false;
+        } else if (errno != EINTR) {
+            if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+                errno != EOPNOTSUPP) {
+                return false;
+            }
+            break;
+        }
+    }
+
+    // sendfile() writes at the file position of out
+    if (n > 0 && lseek(out, dst, SEEK_SET) == dst) {
+        while (n > 0) {
+            off_t offset = src;
+            auto ret = sendfile(out, in, &offset, std::min(n, step));
+            if (ret > 0) {
+                src = offset;
+                dst += ret;
+                n -= ret;
+            } else if (ret == 0) {
+                return false;
+            } else if (errno != EINTR) {
+                break;
+            }
+        }
+    }
+
+    std::vector<uint8_t> buf(n > 0 ? 1 << 20 : 0);
+    while (n > 0) {
+        auto ret = pread(in, buf.data(), std::min<uint64_t>(n, buf.size()),
+                         src);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        for (ssize_t done = 0; done < ret;) {
+            auto w = pwrite(out, buf.data() + done, ret - done, dst + done);
+            if (w < 0 && errno == EINTR) {
+                continue;
+            }
+            if (w <= 0) {
+                return false;
+            }
+            done += w;
+        }
+        src += ret;
+        dst += ret;
+        n -= ret;
+    }
+    return true;
+}
+
+inline bool writeAll(int fd, const std::vector<uint8_t> &data,
+                     uint64_t offset) {
+    for (size_t done = 0; done < data.size();) {
+        auto ret = pwrite(fd, data.data() + done, data.size() - done,
+                          offset + done);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return false;
+        done += ret;
+    }
+    return true;
+}
+
+/**
+ * Create a temporary file next to out_path for writing a new version of the
+ * file open as in. mkstemp() picks a name nothing else has, so no existing
+ * file, the input included, is truncated or later removed. The input is
+ * still read while the output is written, so out_path must not be the input
+ * itself. Return -1 after saying why when it can't be created.
+ */
+inline int openOutput(int in, const char *out_path, std::string &tmp) {
+    struct stat in_st {};
+    struct stat out_st {};
+    if (fstat(in, &in_st) == 0 && stat(out_path, &out_st) == 0 &&
+        in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+        std::cerr << out_path << " is the input file\n";
+        return -1;
+    }
+    tmp = std::string(out_path) + ".XXXXXX";
+    int fd = mkostemp(tmp.data(), O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "create " << tmp << " failed\n";
+        return -1;
+    }
+    // mkstemp() makes it private to the owner
+    fchmod(fd, 0644);
+    return fd;
+}
+
+/**
+ * Close the output opened by openOutput() and rename it to out_path if it
+ * was written in full, remove it otherwise, so a failed run leaves nothing
+ * behind.
+ */
+inline bool finishOutput(int fd, const std::string &tmp, const char *out_path,
+                         bool ok) {
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp.c_str(), out_path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Store offsets in the chunk offset box box, an stco or a co64. An stco that
+ * can't hold them is replaced in its parent by a co64, box then points at the
+ * new box and promoted is counted up.
+ */
+inline bool storeChunkOffsets(Box *&box, std::vector<uint64_t> offsets,
+                              uint32_t &promoted) {
+    auto stco = box->as<Stco>();
+    if (stco != nullptr &&
+        std::all_of(offsets.begin(), offsets.end(),
+                    [](uint64_t offset) { return offset <= UINT32_MAX; })) {
+        stco->setChunkOffsets(
+            std::vector<uint32_t>(offsets.begin(), offsets.end()));
+        return true;
+    }
+    if (stco != nullptr) {
+        auto co64 = std::make_shared<Co64>(Box(0, 0, Co64::tag_, {}));
+        if (stco->parent() == nullptr ||
+            !stco->parent()->replaceChild(stco, co64)) {
+            return false;
+        }
+        box = co64.get();
+        promoted++;
+    }
+    static_cast<Co64 *>(box)->setChunkOffsets(std::move(offsets));
+    return true;
+}
+
+struct FaststartStats {
+    // moov was already in front of mdat, the file was copied as is
+    bool already_ = false;
+    uint64_t moov_size_ = 0;
+    // stco boxes that had to become co64
+    uint32_t promoted_ = 0;
+    uint64_t bytes_copied_ = 0;
+    double seconds_ = 0;
+};
+
+/**
+ * Move moov in front of the first mdat, so playback can start before the
+ * whole file has arrived
+ *
+ * Only moov passes through memory: it is parsed, its chunk offsets are moved
+ * by the size of the moov now in front of them, an stco whose offsets no
+ * longer fit in 32 bits is replaced by a co64, and the tree is serialized
+ * again. Everything else is copied file to file by the kernel.
+ */
+class Faststart {
+public:
+    static bool run(const char *in_path, const char *out_path,
+                    FaststartStats &stats) {
+        auto start = std::chrono::steady_clock::now();
+        stats = FaststartStats();
+        PreadSource in;
+        if (!in.open(in_path)) {
+            std::cerr << "open " << in_path << " failed\n";
+            return false;
+        }
+        std::vector<Span> boxes;
+        size_t moov = SIZE_MAX;
+        size_t mdat = SIZE_MAX;
+        for (uint64_t pos = 0; pos < in.size();) {
+            BoxHeader header;
+            if (!Box::readHeaderAt(in, pos, header) ||
+                header.size_ < header.header_size_ || header.end() <= pos ||
+                header.end() > in.size()) {
+                std::cerr << "bad box at offset " << pos << '\n';
+                return false;
+            }
+            if (header.type_ == Moov::tag_ && moov == SIZE_MAX) {
+                moov = boxes.size();
+            } else if (header.type_ == Mdat::tag_ && mdat == SIZE_MAX) {
+                mdat = boxes.size();
+            }
+            boxes.push_back(Span{header.offset_, header.size_, 0});
+            pos = header.end();
+        }
+        if (moov == SIZE_MAX) {
+            std::cerr << "no moov in " << in_path << '\n';
+            return false;
+        }
+
+        std::vector<uint8_t> moov_data(boxes[moov].size_);
+        if (in.readAt(boxes[moov].old_offset_, moov_data.data(),
+                      moov_data.size()) < moov_data.size()) {
+            std::cerr << "read moov failed\n";
+            return false;
+        }
+        auto moov_source = std::make_shared<MemorySource>(std::move(moov_data));
+        FileOp moov_file(moov_source);
+        auto moov_box = Box::parseBasic(moov_file, 0);
+        if (moov_box == nullptr) {
+            std::cerr << "parse moov failed\n";
+            return false;
+        }
+        auto tree = toDetailType(std::move(moov_box));
+        tree->parse(moov_file);
+        std::vector<ChunkTable> tables;
+        findChunkTables(*tree, tables);
+
+        // New order: what came before the first mdat, moov, the rest
+        std::vector<size_t> order;
+        bool already = mdat == SIZE_MAX || moov < mdat;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            if (i == mdat && !already) order.push_back(moov);
+            if (i != moov || already) order.push_back(i);
+        }
+
+        // Promoting stco grows moov, which moves the data further, which
+        // can promote more boxes. Sizes only grow, so this settles quickly.
+        uint64_t moov_size = tree->updateSize();
+        while (true) {
+            uint64_t pos = 0;
+            for (auto i : order) {
+                boxes[i].new_offset_ = pos;
+                pos += i == moov ? moov_size : boxes[i].size_;
+            }
+            for (auto &table : tables) {
+                if (!remapTable(table, boxes, stats.promoted_)) {
+                    std::cerr << "rewrite moov failed\n";
+                    return false;
+                }
+            }
+            auto size = tree->updateSize();
+            if (size == moov_size) break;
+            moov_size = size;
+        }
+        std::vector<uint8_t> new_moov;
+        if (!Box::serialize({tree}, moov_source.get(), new_moov)) {
+            return false;
+        }
+
+        std::string tmp;
+        int out = openOutput(in.fd(), out_path, tmp);
+        if (out < 0) {
+            return false;
+        }
+        bool ok = true;
+        for (auto i : order) {
+            const auto &box = boxes[i];
+            if (i == moov) {
+                ok = writeAll(out, new_moov, box.new_offset_);
+            } else {
+                ok = copyRange(in.fd(), box.old_offset_, out, box.new_offset_,
+                               box.size_);
+                stats.bytes_copied_ += box.size_;
+            }
+            if (!ok) {
+                std::cerr << "write " << out_path << " failed\n";
+                break;
+            }
+        }
+        ok = finishOutput(out, tmp, out_path, ok);
+        stats.already_ = already;
+        stats.moov_size_ = new_moov.size();
+        stats.seconds_ = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        return ok;
+    }
+
+private:
+    // Top level box, before and after the move
+    struct Span {
+        uint64_t old_offset_;
+        uint64_t size_;
+        uint64_t new_offset_;
+    };
+
+    // boxes are in file order
+    static uint64_t remap(const std::vector<Span> &boxes, uint64_t offset) {
+        auto it = std::upper_bound(
+            boxes.begin(), boxes.end(), offset,
+            [](uint64_t o, const Span &box) { return o < box.old_offset_; });
+        if (it == boxes.begin()) {
+            return offset;
+        }
+        --it;
+        if (offset - it->old_offset_ >= it->size_) {
+            // Points outside every box, leave it be
+            return offset;
+        }
+        return offset - it->old_offset_ + it->new_offset_;
+    }
+
+    // A chunk offset box of moov and its offsets in the input
+    struct ChunkTable {
+        Box *box_;
+        std::vector<uint64_t> offsets_;
+    };
+
+    static void findChunkTables(Box &box, std::vector<ChunkTable> &tables) {
+        if (auto stco = box.as<Stco>()) {
+            const auto &offsets = stco->chunkOffsets();
+            tables.push_back(ChunkTable{
+                stco, std::vector<uint64_t>(offsets.begin(), offsets.end())});
+        } else if (auto co64 = box.as<Co64>()) {
+            tables.push_back(ChunkTable{co64, co64->chunkOffsets()});
+        }
+        for (const auto &item : box.children()) {
+            findChunkTables(*item, tables);
+        }
+    }
+
+    // Point the table at the moved boxes
+    static bool remapTable(ChunkTable &table, const std::vector<Span> &boxes,
+                           uint32_t &promoted) {
+        std::vector<uint64_t> offsets(table.offsets_.size());
+        for (size_t i = 0; i < offsets.size(); i++) {
+            offsets[i] = remap(boxes, table.offsets_[i]);
+        }
+        return storeChunkOffsets(table.box_, std::move(offsets), promoted);
+    }
+};
+
+}  // namespace mov
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Output buffer that goes to a FILE in large writes
+ *
+ * Writers append to buffer(), and poll() between boxes passes it on once
+ * it holds limit bytes, so memory stays bounded however big the dump is.
+ */
+class OutputSink {
+public:
+    explicit OutputSink(FILE *file, size_t limit = 1 << 16)
+        : file_(file), limit_(limit) {
+        buffer_.reserve(limit + limit / 4);
+    }
+
+    ~OutputSink() { flush(); }
+
+    std::string &buffer() { return buffer_; }
+
+    bool poll() { return buffer_.size() < limit_ || flush(); }
+
+    bool flush() {
+        bool ok = fwrite(buffer_.data(), 1, buffer_.size(), file_) ==
+                  buffer_.size();
+        buffer_.clear();
+        return fflush(file_) == 0 && ok;
+    }
+
+private:
+    FILE *file_;
+    size_t limit_;
+    std::string buffer_;
+};
+
+/**
+ * One JSON array of boxes, each an object with type, offset, size, its
+ * fields under their names with spaces turned to underscores, "entries"
+ * for a table, "more" for the entries left out, "detail" for boxes without
+ * fields of their own and "children"
+ */
+class JsonDetailWriter : public DetailWriter {
+public:
+    explicit JsonDetailWriter(std::string &out,
+                              uint64_t max_entries = UINT64_MAX)
+        : DetailWriter(max_entries), out_(out) {}
+
+    void beginBox(Box &box, int) override {
+        if (open_.empty()) {
+            out_ += first_ ? '[' : ',';
+            first_ = false;
+        } else {
+            auto &parent = open_.back();
+            closeTable(parent);
+            out_ += parent.children_ ? "," : ",\"children\":[";
+            parent.children_ = true;
+        }
+        out_ += "{\"type\":";
+        appendString(box.boxTypeStr());
+        out_ += ",\"offset\":";
+        appendNumber(out_, box.offset());
+        out_ += ",\"size\":";
+        appendNumber(out_, box.size());
+        first_field_ = false;
+        open_.emplace_back();
+    }
+
+    void endBox() override {
+        auto &box = open_.back();
+        closeTable(box);
+        if (box.children_) out_ += ']';
+        out_ += '}';
+        open_.pop_back();
+    }
+
+    void finish() override { out_ += first_ ? "[]\n" : "]\n"; }
+
+protected:
+    void putUnsigned(const char *name, uint64_t value) override {
+        appendKey(name);
+        appendNumber(out_, value);
+    }
+
+    void putSigned(const char *name, int64_t value) override {
+        appendKey(name);
+        appendNumber(out_, value);
+    }
+
+    void putHex(const char *name, uint64_t value) override {
+        putUnsigned(name, value);
+    }
+
+    void putString(const char *name, const std::string &value) override {
+        appendKey(name);
+        appendString(value);
+    }
+
+    void putText(const std::string &text) override {
+        appendKey("detail");
+        appendString(text);
+    }
+
+    void putEntry(const char *, uint64_t) override {
+        auto &box = open_.back();
+        if (!box.table_) {
+            out_ += ",\"entries\":[{";
+            box.table_ = true;
+        } else {
+            out_ += "},{";
+        }
+        first_field_ = true;
+    }
+
+    void putMore(const char *, uint64_t count) override {
+        closeTable(open_.back());
+        out_ += ",\"more\":";
+        appendNumber(out_, count);
+    }
+
+private:
+    struct Open {
+        bool table_ = false;
+        bool children_ = false;
+    };
+
+    void closeTable(Open &box) {
+        if (box.table_) out_ += "}]";
+        box.table_ = false;
+        first_field_ = false;
+    }
+
+    void appendKey(const char *name) {
+        if (!first_field_) out_ += ',';
+        first_field_ = false;
+        out_ += '"';
+        for (auto p = name; *p; p++) {
+            out_ += *p == ' ' ? '_' : *p;
+        }
+        out_ += "\":";
+    }
+
+    // Bytes outside printable ASCII are escaped as the code point of that
+    // byte, so names in odd encodings still give valid JSON
+    void appendString(const std::string &value) {
+        static const char hex[] = "0123456789abcdef";
+        out_ += '"';
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                out_ += '\\';
+                out_ += c;
+            } else if (c < 0x20 || c >= 0x7f) {
+                out_ += "\\u00";
+                out_ += hex[c >> 4];
+                out_ += hex[c & 15];
+            } else {
+                out_ += c;
+            }
+        }
+        out_ += '"';
+    }
+
+    std::string &out_;
+    std::vector<Open> open_;
+    bool first_ = true;
+    bool first_field_ = false;
+};
+
+/**
+ * Compact binary dump, "MP4D" and a version byte followed by records of
+ * one tag byte and LEB128 varints:
+ *
+ *   'N' id length bytes      name id, sent before its first use
+ *   'B' type(4) offset size  box begins, its children nest until 'E'
+ *   'E'                      box ends
+ *   'U'/'X' name value       unsigned field, 'X' for flags
+ *   'S' name zigzag          signed field
+ *   's' name length bytes    string field
+ *   'T' length bytes         free form detail
+ *   'R' name index           table entry begins, its fields follow
+ *   'M' name count           entries left out
+ */
+class BinaryDetailWriter : public DetailWriter {
+public:
+    static const uint8_t kVersion = 1;
+
+    explicit BinaryDetailWriter(std::string &out,
+                                uint64_t max_entries = UINT64_MAX)
+        : DetailWriter(max_entries), out_(out) {
+        out_ += "MP4D";
+        out_ += static_cast<char>(kVersion);
+    }
+
+    void beginBox(Box &box, int) override {
+        out_ += 'B';
+        auto type = box.baseType();
+        out_.append(reinterpret_cast<const char *>(&type), 4);
+        appendVarint(box.offset());
+        appendVarint(box.size());
+    }
+
+    void endBox() override { out_ += 'E'; }
+
+protected:
+    void putUnsigned(const char *name, uint64_t value) override {
+        appendTagged('U', name, value);
+    }
+
+    void putSigned(const char *name, int64_t value) override {
+        appendTagged('S', name,
+                     (static_cast<uint64_t>(value) << 1) ^
+                         static_cast<uint64_t>(value >> 63));
+    }
+
+    void putHex(const char *name, uint64_t value) override {
+        appendTagged('X', name, value);
+    }
+
+    void putString(const char *name, const std::string &value) override {
+        appendTagged('s', name, value.size());
+        out_ += value;
+    }
+
+    void putText(const std::string &text) override {
+        out_ += 'T';
+        appendVarint(text.size());
+        out_ += text;
+    }
+
+    void putEntry(const char *table, uint64_t index) override {
+        appendTagged('R', table, index);
+    }
+
+    void putMore(const char *table, uint64_t count) override {
+        appendTagged('M', table, count);
+    }
+
+private:
+    void appendVarint(uint64_t value) {
+        while (value >= 0x80) {
+            out_ += static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        out_ += static_cast<char>(value);
+    }
+
+    // Names are string literals, so their address identifies them
+    void appendTagged(char tag, const char *name, uint64_t value) {
+        auto it = names_.find(name);
+        if (it == names_.end()) {
+            it = names_.emplace(name, names_.size()).first;
+            auto length = strlen(name);
+            out_ += 'N';
+            appendVarint(it->second);
+            appendVarint(length);
+            out_.append(name, length);
+        }
+        out_ += tag;
+        appendVarint(it->second);
+        appendVarint(value);
+    }
+
+    std::string &out_;
+    std::unordered_map<const char *, uint64_t> names_;
+};
+
+/**
+ * Write boxes and everything below them to out, passing the output on to
+ * sink after every box
+ */
+inline void formatBoxes(const Box::Boxes &boxes, DetailWriter &out,
+                        OutputSink &sink, int depth = 0) {
+    for (const auto &box : boxes) {
+        out.beginBox(*box, depth);
+        box->format(out);
+        if (box->hasChild()) {
+            formatBoxes(box->children(), out, sink, depth + 1);
+        }
+        out.endBox();
+        sink.poll();
+    }
+}
+
+}  // namespace mov
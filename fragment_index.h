@@ -0,0 +1,358 @@
+#pragma once
+
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Random access into a fragmented file
+ *
+ * Opening reads only the boxes in front of the first moof (ftyp, moov and
+ * any sidx), plus mfra when the file ends with mfro. A timestamp is mapped
+ * to its fragment through tfra, or through sidx, and only the moof found
+ * there is parsed. Files with neither index fall back to a binary search
+ * over the moof offsets, which are found by stepping over the top level
+ * headers once.
+ */
+class FragmentedFile {
+public:
+    static constexpr uint64_t npos = UINT64_MAX;
+
+    // One subsegment out of sidx, times in the sidx timescale
+    struct Segment {
+        uint64_t time_;
+        uint64_t duration_;
+        uint64_t offset_;
+        uint64_t size_;
+    };
+
+    // The subsegments of one sidx, hierarchical indexes flattened
+    struct SegmentIndex {
+        uint32_t reference_id_ = 0;
+        uint32_t timescale_ = 1;
+        std::vector<Segment> segments_;
+    };
+
+    bool open(const char *path) {
+        FileOp file(path);
+        if (!file.open("r")) return false;
+        return open(file.source());
+    }
+
+    bool open(std::shared_ptr<ByteSource> source) {
+        source_ = std::move(source);
+        FileOp file(source_);
+        auto end = file.size();
+        for (uint64_t pos = 0; pos < end;) {
+            BoxHeader header;
+            if (!Box::readHeaderAt(*source_, pos, header) ||
+                header.size_ < header.header_size_ || header.end() <= pos) {
+                break;
+            }
+            if (header.type_ == Moof::tag_) {
+                first_moof_ = pos;
+                break;
+            }
+            if (header.type_ == Moov::tag_) {
+                moov_ = parseBox(file, pos);
+            } else if (header.type_ == Sidx::tag_) {
+                addSidx(file, pos);
+            }
+            pos = header.end();
+        }
+        readMfra(file);
+        return moov_ != nullptr;
+    }
+
+    Box *moov() const { return moov_.get(); }
+
+    const std::vector<SegmentIndex> &segmentIndexes() const {
+        return sidx_;
+    }
+
+    Trak *trak(uint32_t track_id) const {
+        if (moov_ == nullptr) return nullptr;
+        for (const auto &item : moov_->children()) {
+            auto trak = item->as<Trak>();
+            auto tkhd = trak ? trak->child<Tkhd>() : nullptr;
+            if (tkhd != nullptr && tkhd->trackId() == track_id) {
+                return trak;
+            }
+        }
+        return nullptr;
+    }
+
+    Trex *trex(uint32_t track_id) const {
+        auto mvex = moov_ ? moov_->child<Mvex>() : nullptr;
+        if (mvex == nullptr) return nullptr;
+        for (const auto &item : mvex->children()) {
+            auto trex = item->as<Trex>();
+            if (trex != nullptr && trex->trackId() == track_id) {
+                return trex;
+            }
+        }
+        return nullptr;
+    }
+
+    uint32_t timescale(uint32_t track_id) const {
+        auto trak = this->trak(track_id);
+        auto mdia = trak ? trak->child<Mdia>() : nullptr;
+        return mdia ? mdia->getTimeScale() : 1;
+    }
+
+    /**
+     * Offset of the moof holding the sample of track at time, in the media
+     * timescale. Return npos if the file has no fragments.
+     */
+    uint64_t fragmentAtTime(uint32_t track_id, uint64_t time) {
+        auto tfra = findTfra(track_id);
+        if (tfra != nullptr && !tfra->entries().empty()) {
+            const auto &entries = tfra->entries();
+            auto it = std::upper_bound(
+                entries.begin(), entries.end(), time,
+                [](uint64_t t, const Tfra::Entry &e) { return t < e.time_; });
+            return it == entries.begin() ? entries.front().moof_offset_
+                                         : std::prev(it)->moof_offset_;
+        }
+
+        auto index = findSegmentIndex(track_id);
+        if (index != nullptr && !index->segments_.empty()) {
+            // Convert to the sidx timescale, rounding down
+            uint64_t from = std::max<uint32_t>(timescale(track_id), 1);
+            uint64_t to = index->timescale_;
+            auto t = time / from * to + time % from * to / from;
+            const auto &segments = index->segments_;
+            auto it = std::upper_bound(
+                segments.begin(), segments.end(), t,
+                [](uint64_t t, const Segment &s) { return t < s.time_; });
+            const auto &segment =
+                it == segments.begin() ? segments.front() : *std::prev(it);
+            return searchMoofs(
+                moofOffsets(segment.offset_, segment.offset_ + segment.size_),
+                track_id, time);
+        }
+
+        if (!scanned_) {
+            moofs_ = moofOffsets(first_moof_, UINT64_MAX);
+            scanned_ = true;
+        }
+        return searchMoofs(moofs_, track_id, time);
+    }
+
+    // Parse the moof at offset, nullptr if there is none
+    std::shared_ptr<Box> parseFragment(uint64_t offset) const {
+        FileOp file(source_);
+        BoxHeader header;
+        if (offset == npos ||
+            !Box::readHeaderAt(*source_, offset, header) ||
+            header.type_ != Moof::tag_) {
+            return nullptr;
+        }
+        return parseBox(file, offset);
+    }
+
+    /**
+     * Append the samples of track in the moof at offset to index. Return
+     * false if there is no moof there.
+     */
+    bool appendFragment(uint64_t offset, uint32_t track_id,
+                        TrackIndex &index) const {
+        auto moof = parseFragment(offset);
+        if (moof == nullptr) {
+            return false;
+        }
+        // Trafs of other tracks still move where the next one's data starts
+        uint64_t data_end = offset;
+        for (const auto &item : moof->children()) {
+            auto traf = item->as<Traf>();
+            auto tfhd = traf ? traf->child<Tfhd>() : nullptr;
+            if (tfhd == nullptr) continue;
+            auto trex = this->trex(tfhd->trackId());
+            if (tfhd->trackId() == track_id) {
+                index.appendFragment(*traf, trex, offset, data_end);
+            } else {
+                TrackIndex::skipFragment(*traf, trex, offset, data_end);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Every sample of track: the ones in moov, then those of every fragment
+     * in file order.
+     */
+    bool buildTrackIndex(uint32_t track_id, TrackIndex &index) {
+        auto trak = this->trak(track_id);
+        if (trak == nullptr) {
+            return false;
+        }
+        index = TrackIndex();
+        auto mdia = trak->child<Mdia>();
+        auto minf = mdia ? mdia->child<Minf>() : nullptr;
+        auto stbl = minf ? minf->child<Stbl>() : nullptr;
+        if (stbl == nullptr || !index.build(*stbl, timescale(track_id))) {
+            index.setTimescale(timescale(track_id));
+        }
+        if (!scanned_) {
+            moofs_ = moofOffsets(first_moof_, UINT64_MAX);
+            scanned_ = true;
+        }
+        for (auto offset : moofs_) {
+            appendFragment(offset, track_id, index);
+        }
+        return true;
+    }
+
+private:
+    static std::shared_ptr<Box> parseBox(FileOp &file, uint64_t offset) {
+        auto base = Box::parseBasic(file, offset);
+        if (base == nullptr) {
+            return nullptr;
+        }
+        auto box = toDetailType(std::move(base));
+        box->parse(file);
+        return box;
+    }
+
+    // Flatten the sidx at offset into a new index, following nested ones
+    void addSidx(FileOp &file, uint64_t offset) {
+        auto box = parseBox(file, offset);
+        auto sidx = box ? box->as<Sidx>() : nullptr;
+        if (sidx == nullptr) return;
+        SegmentIndex index;
+        index.reference_id_ = sidx->referenceId();
+        index.timescale_ = std::max<uint32_t>(sidx->timescale(), 1);
+        flattenSidx(file, *sidx, index, 0);
+        sidx_.push_back(std::move(index));
+    }
+
+    void flattenSidx(FileOp &file, Sidx &sidx, SegmentIndex &index,
+                     int depth) {
+        auto time = sidx.earliestPresentationTime();
+        auto offset = sidx.firstOffset();
+        for (const auto &ref : sidx.references()) {
+            if (!ref.isIndex()) {
+                index.segments_.push_back(
+                    Segment{time, ref.subsegment_duration_, offset,
+                            ref.size()});
+            } else if (depth < kMaxSidxDepth) {
+                auto box = parseBox(file, offset);
+                auto child = box ? box->as<Sidx>() : nullptr;
+                if (child != nullptr) {
+                    flattenSidx(file, *child, index, depth + 1);
+                }
+            }
+            time += ref.subsegment_duration_;
+            offset += ref.size();
+        }
+    }
+
+    // mfra is found through the mfro that ends the file
+    void readMfra(FileOp &file) {
+        auto size = file.size();
+        if (size == UINT64_MAX || size < 16) return;
+        BoxHeader header;
+        if (!Box::readHeaderAt(*source_, size - 16, header) ||
+            header.type_ != Mfro::tag_) {
+            return;
+        }
+        auto box = parseBox(file, size - 16);
+        if (box == nullptr) return;
+        auto mfra_size = static_cast<Mfro &>(*box).mfraSize();
+        if (mfra_size < 8 || mfra_size > size) return;
+        auto offset = size - mfra_size;
+        if (!Box::readHeaderAt(*source_, offset, header) ||
+            header.type_ != Mfra::tag_) {
+            return;
+        }
+        mfra_ = parseBox(file, offset);
+    }
+
+    Tfra *findTfra(uint32_t track_id) const {
+        if (mfra_ == nullptr) return nullptr;
+        for (const auto &item : mfra_->children()) {
+            auto tfra = item->as<Tfra>();
+            if (tfra != nullptr && tfra->trackId() == track_id) {
+                return tfra;
+            }
+        }
+        return nullptr;
+    }
+
+    // The index of the track itself, else the first one
+    const SegmentIndex *findSegmentIndex(uint32_t track_id) const {
+        for (const auto &index : sidx_) {
+            if (index.reference_id_ == track_id) return &index;
+        }
+        return sidx_.empty() ? nullptr : &sidx_.front();
+    }
+
+    // Offsets of the moof boxes in [begin, end), by their headers alone
+    std::vector<uint64_t> moofOffsets(uint64_t begin, uint64_t end) const {
+        std::vector<uint64_t> offsets;
+        end = std::min(end, source_->size());
+        for (auto pos = begin; pos < end;) {
+            BoxHeader header;
+            if (!Box::readHeaderAt(*source_, pos, header) ||
+                header.size_ < header.header_size_ || header.end() <= pos) {
+                break;
+            }
+            if (header.type_ == Moof::tag_) {
+                offsets.push_back(pos);
+            }
+            pos = header.end();
+        }
+        return offsets;
+    }
+
+    // Decoding time of the first sample of track in the moof at offset
+    std::optional<uint64_t> fragmentTime(uint64_t offset,
+                                         uint32_t track_id) const {
+        auto moof = parseFragment(offset);
+        if (moof == nullptr) return std::nullopt;
+        for (const auto &item : moof->children()) {
+            auto traf = item->as<Traf>();
+            auto tfhd = traf ? traf->child<Tfhd>() : nullptr;
+            auto tfdt = traf ? traf->child<Tfdt>() : nullptr;
+            if (tfhd != nullptr && tfdt != nullptr &&
+                tfhd->trackId() == track_id) {
+                return tfdt->baseMediaDecodeTime();
+            }
+        }
+        return std::nullopt;
+    }
+
+    /**
+     * Binary search the moofs for the last one whose fragment of track
+     * starts at or before time. Moofs without a tfdt for the track are taken
+     * to start before time.
+     */
+    uint64_t searchMoofs(const std::vector<uint64_t> &moofs,
+                         uint32_t track_id, uint64_t time) const {
+        if (moofs.empty()) return npos;
+        size_t lo = 0;
+        size_t hi = moofs.size();
+        while (hi - lo > 1) {
+            auto mid = lo + (hi - lo) / 2;
+            auto start = fragmentTime(moofs[mid], track_id);
+            if (!start.has_value() || start.value() <= time) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        return moofs[lo];
+    }
+
+    static const int kMaxSidxDepth = 8;
+
+    std::shared_ptr<ByteSource> source_;
+    std::shared_ptr<Box> moov_;
+    std::shared_ptr<Box> mfra_;
+    std::vector<SegmentIndex> sidx_;
+    uint64_t first_moof_ = UINT64_MAX;
+    bool scanned_ = false;
+    std::vector<uint64_t> moofs_;
+};
+
+}  // namespace mov
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <limits.h>
+
+#include "faststart.h"
+#include "fragment_index.h"
+#include "mp4.h"
+
+namespace mov {
+
+struct IndexedTrack {
+    uint32_t track_id_ = 0;
+    uint32_t handler_type_ = 0;
+    TrackIndex index_;
+};
+
+/**
+ * What IndexCache keeps of a file: movie summary and the expanded sample
+ * tables of every track
+ */
+struct IndexedFile {
+    uint32_t timescale_ = 0;
+    uint64_t duration_ = 0;
+    std::vector<IndexedTrack> tracks_;
+    // Mapped from the cache rather than parsed
+    bool cached_ = false;
+};
+
+/**
+ * Expanded sample tables saved next to the media, or in a cache directory,
+ * so opening the file again maps them instead of parsing moov
+ *
+ * The index is tied to the size, modification time and a hash of the first
+ * kHashBytes of the file, and is rebuilt when any of them changes. It holds
+ * the TrackIndex arrays as they are in memory, 8 byte aligned, so loading is
+ * a mapping plus checks on the per track entries, however many samples
+ * there are, and the arrays are paged in as they are used. The layout is
+ * that of the host, a cache written elsewhere is rejected and rebuilt.
+ */
+class IndexCache {
+public:
+    static constexpr uint32_t kVersion = 1;
+    static constexpr size_t kHashBytes = 64 << 10;
+
+    // What ties an index to the file it was built from
+    struct Key {
+        uint64_t size_ = 0;
+        int64_t mtime_ns_ = 0;
+        uint64_t hash_ = 0;
+    };
+
+    // Without a directory the index goes next to the file, as file.idx
+    explicit IndexCache(std::string dir = std::string())
+        : dir_(std::move(dir)) {}
+
+    std::string indexPath(const char *path) const {
+        if (dir_.empty()) {
+            return std::string(path) + ".idx";
+        }
+        char real[PATH_MAX];
+        const char *name = realpath(path, real) ? real : path;
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx",
+                 static_cast<unsigned long long>(
+                     fnv1a(name, strlen(name), kFnvBasis)));
+        return dir_ + "/" + hex + ".idx";
+    }
+
+    static bool readKey(const char *path, Key &key) {
+        PreadSource source;
+        if (!source.open(path)) {
+            return false;
+        }
+        struct stat st {};
+        if (fstat(source.fd(), &st) != 0) {
+            return false;
+        }
+        key.size_ = st.st_size;
+        key.mtime_ns_ = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                        st.st_mtim.tv_nsec;
+        std::vector<uint8_t> head(std::min<uint64_t>(kHashBytes, key.size_));
+        if (source.readAt(0, head.data(), head.size()) != head.size()) {
+            return false;
+        }
+        key.hash_ = fnv1a(head.data(), head.size(), kFnvBasis);
+        return true;
+    }
+
+    /**
+     * Index of path, mapped from the cache when it is still valid, built and
+     * saved otherwise. Failing to save is not an error, the index is only
+     * built again next time.
+     */
+    bool open(const char *path, IndexedFile &file) {
+        Key key;
+        if (!readKey(path, key)) {
+            std::cerr << "open " << path << " failed\n";
+            return false;
+        }
+        auto index_path = indexPath(path);
+        if (load(index_path.c_str(), key, file)) {
+            return true;
+        }
+        if (!build(path, file)) {
+            return false;
+        }
+        store(index_path.c_str(), key, file);
+        return true;
+    }
+
+    // Parse path and expand the sample tables of every track
+    static bool build(const char *path, IndexedFile &file) {
+        file = IndexedFile();
+        FragmentedFile fragmented;
+        if (!fragmented.open(path)) {
+            std::cerr << "no moov in " << path << '\n';
+            return false;
+        }
+        auto moov = fragmented.moov();
+        if (auto mvhd = moov->child<Mvhd>()) {
+            file.timescale_ = mvhd->timescale();
+            file.duration_ = mvhd->duration();
+        }
+        for (const auto &item : moov->children()) {
+            auto trak = item->as<Trak>();
+            auto tkhd = trak ? trak->child<Tkhd>() : nullptr;
+            if (tkhd == nullptr) continue;
+            IndexedTrack track;
+            track.track_id_ = tkhd->trackId();
+            auto mdia = trak->child<Mdia>();
+            auto hdlr = mdia ? mdia->child<Hdlr>() : nullptr;
+            if (hdlr != nullptr) {
+                track.handler_type_ = hdlr->handleType();
+            }
+            if (fragmented.buildTrackIndex(track.track_id_, track.index_)) {
+                file.tracks_.push_back(std::move(track));
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Map the index at index_path. Return false if there is none, or it
+     * doesn't belong to key or to this version and host.
+     */
+    static bool load(const char *index_path, const Key &key,
+                     IndexedFile &file) {
+        auto source = std::make_shared<MmapSource>();
+        if (!source->open(index_path)) {
+            return false;
+        }
+        auto data = source->data();
+        auto size = source->size();
+        FileHeader header;
+        if (size < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        if (memcmp(header.magic_, kMagic, sizeof(header.magic_)) != 0 ||
+            header.version_ != kVersion || header.byte_order_ != kByteOrder ||
+            header.file_size_ != key.size_ ||
+            header.mtime_ns_ != key.mtime_ns_ ||
+            header.hash_ != key.hash_ || header.index_size_ != size ||
+            header.track_count_ > (size - sizeof(header)) / sizeof(Entry)) {
+            return false;
+        }
+
+        IndexedFile loaded;
+        loaded.timescale_ = header.timescale_;
+        loaded.duration_ = header.duration_;
+        loaded.cached_ = true;
+        auto entries = data + sizeof(header);
+        for (uint32_t i = 0; i < header.track_count_; i++) {
+            Entry entry;
+            memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+            auto count = entry.sample_count_;
+            TrackIndex::Tables tables;
+            if (!view(data, size, entry.offsets_, count, tables.offsets_) ||
+                !view(data, size, entry.sizes_, count, tables.sizes_) ||
+                !view(data, size, entry.dts_, count, tables.dts_) ||
+                !view(data, size, entry.cts_delta_, count,
+                      tables.cts_delta_) ||
+                !view(data, size, entry.sync_, (count + 63) / 64,
+                      tables.sync_)) {
+                return false;
+            }
+            IndexedTrack track;
+            track.track_id_ = entry.track_id_;
+            track.handler_type_ = entry.handler_type_;
+            if (!track.index_.assign(entry.timescale_, entry.next_dts_,
+                                     tables, source)) {
+                return false;
+            }
+            loaded.tracks_.push_back(std::move(track));
+        }
+        file = std::move(loaded);
+        return true;
+    }
+
+    /**
+     * Write the index of a file with key to index_path. It is written to a
+     * temporary file first and renamed, so readers never see half of it.
+     */
+    static bool store(const char *index_path, const Key &key,
+                      const IndexedFile &file) {
+        FileHeader header{};
+        memcpy(header.magic_, kMagic, sizeof(header.magic_));
+        header.version_ = kVersion;
+        header.byte_order_ = kByteOrder;
+        header.file_size_ = key.size_;
+        header.mtime_ns_ = key.mtime_ns_;
+        header.hash_ = key.hash_;
+        header.timescale_ = file.timescale_;
+        header.track_count_ = file.tracks_.size();
+        header.duration_ = file.duration_;
+
+        std::vector<Entry> entries(file.tracks_.size());
+        uint64_t pos = sizeof(header) + entries.size() * sizeof(Entry);
+        auto place = [&pos](uint64_t bytes) {
+            auto at = pos;
+            pos = (pos + bytes + 7) / 8 * 8;
+            return at;
+        };
+        for (size_t i = 0; i < entries.size(); i++) {
+            const auto &track = file.tracks_[i];
+            const auto &tables = track.index_.tables();
+            auto count = track.index_.sampleCount();
+            auto &entry = entries[i];
+            entry.track_id_ = track.track_id_;
+            entry.handler_type_ = track.handler_type_;
+            entry.timescale_ = track.index_.timescale();
+            entry.next_dts_ = track.index_.nextDts();
+            entry.sample_count_ = count;
+            entry.offsets_ = place(count * sizeof(uint64_t));
+            entry.sizes_ = place(count * sizeof(uint32_t));
+            entry.dts_ = place(count * sizeof(uint64_t));
+            entry.cts_delta_ = place(count * sizeof(int32_t));
+            entry.sync_ = place(tables.sync_.size() * sizeof(uint64_t));
+        }
+        header.index_size_ = pos;
+
+        std::vector<uint8_t> out(pos);
+        memcpy(out.data(), &header, sizeof(header));
+        memcpy(out.data() + sizeof(header), entries.data(),
+               entries.size() * sizeof(Entry));
+        for (size_t i = 0; i < entries.size(); i++) {
+            const auto &tables = file.tracks_[i].index_.tables();
+            const auto &entry = entries[i];
+            copyArray(out, entry.offsets_, tables.offsets_);
+            copyArray(out, entry.sizes_, tables.sizes_);
+            copyArray(out, entry.dts_, tables.dts_);
+            copyArray(out, entry.cts_delta_, tables.cts_delta_);
+            copyArray(out, entry.sync_, tables.sync_);
+        }
+
+        auto tmp = std::string(index_path) + "." + std::to_string(getpid());
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0644);
+        if (fd < 0) {
+            return false;
+        }
+        bool ok = writeAll(fd, out, 0);
+        ok = close(fd) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), index_path) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr char kMagic[8] = {'M', 'O', 'V', 'I', 'D', 'X', 0, 0};
+    // Reads back differently on a host of the other byte order
+    static constexpr uint32_t kByteOrder = 0x01020304;
+    static constexpr uint64_t kFnvBasis = 0xcbf29ce484222325ULL;
+
+    struct FileHeader {
+        char magic_[8];
+        uint32_t version_;
+        uint32_t byte_order_;
+        uint64_t file_size_;
+        int64_t mtime_ns_;
+        uint64_t hash_;
+        // Size of the whole index file
+        uint64_t index_size_;
+        uint32_t timescale_;
+        uint32_t track_count_;
+        uint64_t duration_;
+    };
+
+    // One per track, right after the header. Arrays are at file offsets.
+    struct Entry {
+        uint32_t track_id_;
+        uint32_t handler_type_;
+        uint32_t timescale_;
+        uint32_t reserved_;
+        uint64_t next_dts_;
+        uint64_t sample_count_;
+        uint64_t offsets_;
+        uint64_t sizes_;
+        uint64_t dts_;
+        uint64_t cts_delta_;
+        uint64_t sync_;
+    };
+
+    static_assert(sizeof(FileHeader) == 64, "index header layout");
+    static_assert(sizeof(Entry) == 72, "index entry layout");
+
+    static uint64_t fnv1a(const void *data, size_t n, uint64_t hash) {
+        auto p = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < n; i++) {
+            hash = (hash ^ p[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    // count items of T at offset, if they are aligned and inside the file
+    template <typename T>
+    static bool view(const uint8_t *data, uint64_t size, uint64_t offset,
+                     uint64_t count, ArrayView<T> &array) {
+        if (offset % alignof(T) != 0 || offset > size ||
+            count > (size - offset) / sizeof(T)) {
+            return false;
+        }
+        array = ArrayView<T>(reinterpret_cast<const T *>(data + offset),
+                             count);
+        return true;
+    }
+
+    template <typename T>
+    static void copyArray(std::vector<uint8_t> &out, uint64_t offset,
+                          const ArrayView<T> &array) {
+        if (!array.empty()) {
+            memcpy(out.data() + offset, array.data(),
+                   array.size() * sizeof(T));
+        }
+    }
+
+    std::string dir_;
+};
+
+}  // namespace mov
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * Where moov is, and what it cost to find it
+ */
+struct MoovLocation {
+    bool found_ = false;
+    uint64_t offset_ = 0;
+    uint64_t size_ = 0;
+    uint64_t bytes_read_ = 0;
+    uint32_t reads_ = 0;
+    // Set when the whole moov came in with the tail read, parse it from here
+    // instead of going back to the input
+    std::shared_ptr<ByteSource> tail_;
+};
+
+/**
+ * Find moov reading as little as possible
+ *
+ * Top level boxes are stepped over by their headers alone, so a huge mdat in
+ * front of moov costs one small read. Optionally the tail of the file is read
+ * first in one large read, which finds moov in a single round trip for files
+ * written without faststart.
+ */
+class MoovLocator {
+public:
+    explicit MoovLocator(uint64_t tail_size = 0) : tail_size_(tail_size) {}
+
+    bool locate(ByteSource &source, MoovLocation &loc) {
+        loc = MoovLocation();
+        auto file_size = source.size();
+        if (tail_size_ > 0 && file_size != UINT64_MAX &&
+            locateInTail(source, file_size, loc)) {
+            return true;
+        }
+        return locateByHeaders(source, file_size, loc);
+    }
+
+private:
+    bool locateInTail(ByteSource &source, uint64_t file_size,
+                      MoovLocation &loc) {
+        auto len = std::min(tail_size_, file_size);
+        auto origin = file_size - len;
+        std::vector<uint8_t> tail(len);
+        auto ret = read(source, origin, tail.data(), len, loc);
+        if (ret < len) {
+            return false;
+        }
+        const uint32_t moov = Box::str2BoxType("moov");
+        for (uint64_t p = 0; p + 8 <= len; p++) {
+            uint32_t type;
+            memcpy(&type, tail.data() + p + 4, sizeof(type));
+            if (type != moov) continue;
+            uint64_t size = buf2UInt32(tail.data() + p);
+            if (size < 8 || p + size > len || !chainsToEnd(tail, p + size)) {
+                continue;
+            }
+            loc.found_ = true;
+            loc.offset_ = origin + p;
+            loc.size_ = size;
+            loc.tail_ = std::make_shared<MemorySource>(std::move(tail), origin);
+            return true;
+        }
+        return false;
+    }
+
+    // Whether the boxes from pos on end exactly at the end of the buffer,
+    // which rules out "moov" bytes that happen to sit inside other data
+    static bool chainsToEnd(const std::vector<uint8_t> &buf, uint64_t pos) {
+        while (pos + 8 <= buf.size()) {
+            uint64_t size = buf2UInt32(buf.data() + pos);
+            if (size == 1 && pos + 16 <= buf.size()) {
+                size = buf2UInt64(buf.data() + pos + 8);
+            }
+            if (size < 8 || size > buf.size() - pos) return false;
+            pos += size;
+        }
+        return pos == buf.size();
+    }
+
+    bool locateByHeaders(ByteSource &source, uint64_t file_size,
+                         MoovLocation &loc) {
+        uint64_t pos = 0;
+        uint8_t buf[16];
+        while (pos < file_size) {
+            auto ret = read(source, pos, buf, sizeof(buf), loc);
+            if (ret < 8) return false;
+            uint64_t size = buf2UInt32(buf);
+            uint32_t type;
+            memcpy(&type, buf + 4, sizeof(type));
+            if (size == 1) {
+                if (ret < 16) return false;
+                size = buf2UInt64(buf + 8);
+            } else if (size == 0 && file_size != UINT64_MAX) {
+                size = file_size - pos;
+            }
+            if (size < 8) return false;
+            if (type == Box::str2BoxType("moov")) {
+                loc.found_ = true;
+                loc.offset_ = pos;
+                loc.size_ = size;
+                return true;
+            }
+            if (size > file_size - pos) return false;
+            pos += size;
+        }
+        return false;
+    }
+
+    static size_t read(ByteSource &source, uint64_t offset, void *buf,
+                       size_t n, MoovLocation &loc) {
+        auto ret = source.readAt(offset, buf, n);
+        loc.bytes_read_ += ret;
+        loc.reads_++;
+        return ret;
+    }
+
+    uint64_t tail_size_;
+};
+
+/**
+ * Parse the moov found by MoovLocator, or return nullptr if there was none
+ */
+inline std::shared_ptr<Box> parseMoov(
+    const std::shared_ptr<ByteSource> &source, const MoovLocation &loc) {
+    if (!loc.found_) {
+        return nullptr;
+    }
+    FileOp file(loc.tail_ ? loc.tail_ : source, loc.offset_);
+    auto box = Box::parseBasic(file);
+    if (box == nullptr) {
+        return nullptr;
+    }
+    auto moov = toDetailType(std::move(box));
+    moov->parse(file);
+    return moov;
+}
+
+}  // namespace mov
@@ -1,34 +1,378 @@
 #include "mp4.h"
 
+#include "batch.h"
+#include "box_visitor.h"
+#include "demuxer.h"
+#include "faststart.h"
+#include "formatter.h"
+#include "moov_locator.h"
+#include "parallel_parser.h"
+#include "probe.h"
+#include "query.h"
+#include "trim.h"
+
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <chrono>
 #include <iostream>
+#include <new>
 
-void dumpBox(const mov::Box::Boxes &boxes, bool verbose, int depth = 0) {
-    for (const auto &box : boxes) {
-        std::cout << std::string(depth * 4, ' ') << "type " << box->boxTypeStr()
-                  << ", offset " << box->offset() << ", size " << box->size();
-        auto detail = box->detail();
-        if (verbose) {
-            std::cout << ", " << box->detail() << '\n';
-        } else {
-            auto second_newline = detail.find('\n', detail.find('\n') + 1);
-            if (second_newline != std::string::npos) {
-                std::cout << ", " << detail.substr(0, second_newline)
-                          << " ...\n";
-            } else {
-                std::cout << ", " << detail << '\n';
+void dumpBox(const mov::Box::Boxes &boxes, mov::DetailWriter &out,
+             mov::OutputSink &sink) {
+    mov::formatBoxes(boxes, out, sink);
+}
+
+/**
+ * Write boxes as the walk reaches them, keeping only the boxes on the
+ * current path. mdhd and hdlr stay attached to their mdia while inside it,
+ * since the boxes below look up the timescale and handler type there.
+ */
+class DumpVisitor : public mov::BoxVisitor {
+public:
+    DumpVisitor(mov::DetailWriter &out, mov::OutputSink &sink)
+        : out_(out), sink_(sink) {}
+
+    Action enter(const mov::BoxHeader &header, mov::FileOp &file) override {
+        auto parent = path_.empty() ? nullptr : path_.back().get();
+        auto box = mov::parseDetail(header, file, parent);
+        if (parent != nullptr && parent->baseType() == mov::Mdia::tag_ &&
+            (box->baseType() == mov::Mdhd::tag_ ||
+             box->baseType() == mov::Hdlr::tag_)) {
+            parent->appendChild(box);
+        }
+        out_.beginBox(*box, path_.size());
+        box->format(out_);
+        path_.push_back(std::move(box));
+        return Action::Continue;
+    }
+
+    Action payload(const mov::BoxHeader &, mov::FileOp &) override {
+        return Action::Skip;
+    }
+
+    void leave(const mov::BoxHeader &) override {
+        out_.endBox();
+        path_.pop_back();
+        sink_.poll();
+    }
+
+private:
+    mov::DetailWriter &out_;
+    mov::OutputSink &sink_;
+    std::vector<std::shared_ptr<mov::Box>> path_;
+};
+
+// Parse from a pipe, writing each top level box as soon as it is complete
+static bool dumpStream(FILE *in, mov::DetailWriter &out,
+                       mov::OutputSink &sink) {
+    mov::StreamParser parser(
+        [&out, &sink](const std::shared_ptr<mov::Box> &box) {
+            dumpBox(mov::Box::Boxes{box}, out, sink);
+        });
+    std::vector<uint8_t> buf(1 << 16);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        if (!parser.push(buf.data(), n)) {
+            std::cerr << "malformed box at offset " << parser.offset() << '\n';
+            return false;
+        }
+    }
+    if (!parser.finish()) {
+        std::cerr << "truncated box at offset " << parser.offset() << '\n';
+        return false;
+    }
+    return true;
+}
+
+static bool printProbe(const char *path) {
+    mov::ProbeInfo info;
+    if (!mov::probe(path, mov::kProbeAll, info)) {
+        std::cerr << "no moov in " << path << '\n';
+        return false;
+    }
+    std::cout << "timescale: " << info.timescale_
+              << ", duration: " << info.duration_
+              << ", tracks: " << info.track_count_ << '\n';
+    for (const auto &track : info.tracks_) {
+        std::cout << "track id: " << track.track_id_ << ", handler type: "
+                  << mov::Box::boxType2Str(track.handler_type_)
+                  << ", codec: " << mov::Box::boxType2Str(track.codec_)
+                  << ", timescale: " << track.timescale_
+                  << ", duration: " << track.duration_
+                  << ", lang: " << track.language_;
+        if (track.width_ != 0) {
+            std::cout << ", width x height: " << track.width_ << " "
+                      << track.height_;
+        }
+        std::cout << '\n';
+    }
+    return true;
+}
+
+/**
+ * Jump straight to moov, trying the last 1 MiB of the file first. Where
+ * moov was found goes to info.
+ */
+static bool dumpMoov(const char *path, mov::DetailWriter &out,
+                     mov::OutputSink &sink, std::ostream &info) {
+    mov::FileOp file(path);
+    if (!file.open("r")) {
+        std::cerr << "open " << path << " failed\n";
+        return false;
+    }
+    mov::MoovLocation loc;
+    mov::MoovLocator locator(1 << 20);
+    if (!locator.locate(*file.source(), loc)) {
+        std::cerr << "no moov in " << path << '\n';
+        return false;
+    }
+    info << "moov offset " << loc.offset_ << ", size " << loc.size_
+         << ", found with " << loc.reads_ << " reads, " << loc.bytes_read_
+         << " bytes" << (loc.tail_ ? " (tail)" : "") << '\n';
+    auto moov = mov::parseMoov(file.source(), loc);
+    if (moov == nullptr) {
+        return false;
+    }
+    dumpBox(mov::Box::Boxes{moov}, out, sink);
+    return true;
+}
+
+// Parse the whole file first, with the tracks spread over threads
+static bool dumpParallel(const char *path, mov::DetailWriter &out,
+                         mov::OutputSink &sink, size_t threads) {
+    mov::FileOp file(path);
+    if (!file.open("r")) {
+        std::cerr << "open " << path << " failed\n";
+        return false;
+    }
+    mov::ThreadPool pool(threads);
+    mov::ParallelParser parser(pool);
+    dumpBox(parser.parse(file), out, sink);
+    return true;
+}
+
+// Probe every file given, directly, in a directory or in an @list file
+static bool scanBatch(char *paths[], int count, size_t threads) {
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    mov::BatchScanner scanner(threads, stdout);
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        if (paths[i][0] == '@') {
+            if (!scanner.addList(paths[i] + 1)) {
+                std::cerr << "open " << paths[i] + 1 << " failed\n";
+                ok = false;
             }
+        } else {
+            scanner.addPath(paths[i]);
         }
-        if (box->hasChild()) {
-            dumpBox(box->children(), verbose, depth + 1);
+    }
+    auto stats = scanner.finish();
+    std::cerr << stats.files_ << " files, " << stats.failed_ << " failed, "
+              << stats.seconds_ << " s, "
+              << (stats.seconds_ > 0 ? stats.files_ / stats.seconds_ : 0)
+              << " files/sec\n";
+    return ok;
+}
+
+// Write every box path matches, without the boxes below it
+static bool query(const char *path, const char *file, mov::DetailWriter &out,
+                  mov::OutputSink &sink) {
+    mov::BoxQuery query;
+    std::string error;
+    if (!query.compile(path, error)) {
+        std::cerr << "bad path " << path << ": " << error << '\n';
+        return false;
+    }
+    mov::BoxTree tree;
+    if (!tree.parse(file)) {
+        std::cerr << "open " << file << " failed\n";
+        return false;
+    }
+    for (auto i : query.run(tree)) {
+        out.beginBox(*tree.box(i), 0);
+        tree.box(i)->format(out);
+        out.endBox();
+        sink.poll();
+    }
+    return true;
+}
+
+static bool faststart(const char *in, const char *out) {
+    mov::FaststartStats stats;
+    if (!mov::Faststart::run(in, out, stats)) {
+        return false;
+    }
+    if (stats.already_) {
+        std::cout << "moov already in front of mdat, copied as is\n";
+    }
+    std::cout << "moov " << stats.moov_size_ << " bytes, "
+              << stats.promoted_ << " stco promoted to co64, "
+              << stats.bytes_copied_ << " bytes copied in " << stats.seconds_
+              << " s\n";
+    return true;
+}
+
+// range is start,end in seconds
+static bool trim(const char *range, const char *in, const char *out) {
+    char *end = nullptr;
+    double start = strtod(range, &end);
+    if (end == range || *end != ',') {
+        std::cerr << "bad time range " << range << '\n';
+        return false;
+    }
+    double stop = strtod(end + 1, nullptr);
+    mov::TrimStats stats;
+    if (!mov::Trim::run(in, out, start, stop, stats)) {
+        return false;
+    }
+    std::cout << "clip " << stats.start_ << " - " << stats.end_ << " s, "
+              << stats.samples_ << " samples, " << stats.bytes_copied_
+              << " bytes copied in " << stats.ranges_ << " ranges, "
+              << stats.seconds_ << " s\n";
+    return true;
+}
+
+/**
+ * Print every sample in decoding order, read statistics go to stderr. With
+ * a cache directory the sample tables come from the index cache there.
+ */
+static bool demux(const char *path, const char *cache_dir) {
+    auto start = std::chrono::steady_clock::now();
+    mov::Demuxer demuxer;
+    if (cache_dir != nullptr) {
+        mov::IndexCache cache(cache_dir);
+        if (!demuxer.open(path, cache)) {
+            return false;
         }
+    } else if (!demuxer.open(path)) {
+        std::cerr << "open " << path << " failed\n";
+        return false;
+    }
+    auto opened = std::chrono::steady_clock::now();
+    mov::Sample sample;
+    while (demuxer.next(sample)) {
+        std::cout << "track " << sample.track_id_ << ", sample "
+                  << sample.number_ << ", dts " << sample.dts_ << ", cts "
+                  << sample.cts_ << ", size " << sample.size_
+                  << (sample.sync_ ? ", sync\n" : "\n");
+    }
+    const auto &stats = demuxer.stats();
+    auto seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+    std::cerr << stats.samples_ << " samples, " << stats.reads_ << " reads, "
+              << stats.bytes_read_ << " bytes read, opened in "
+              << std::chrono::duration<double>(opened - start).count()
+              << " s, " << seconds << " s\n";
+    return true;
+}
+
+// text, json or binary
+static std::unique_ptr<mov::DetailWriter> makeWriter(const char *format,
+                                                     std::string &out,
+                                                     uint64_t max_entries) {
+    if (strcmp(format, "text") == 0) {
+        return std::make_unique<mov::TextDetailWriter>(out, max_entries);
+    }
+    if (strcmp(format, "json") == 0) {
+        return std::make_unique<mov::JsonDetailWriter>(out, max_entries);
     }
+    if (strcmp(format, "binary") == 0) {
+        return std::make_unique<mov::BinaryDetailWriter>(out, max_entries);
+    }
+    return nullptr;
+}
+
+#ifdef MOV_STATS
+// Every allocation is counted, for the per box numbers of --stats. Kept out
+// of line, GCC takes the free() of inlined deletes for a mismatch.
+__attribute__((noinline)) void *operator new(size_t size) {
+    mov::countAllocation(size);
+    if (void *p = malloc(size != 0 ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept { free(p); }
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    free(p);
 }
+#endif
+
+/**
+ * Collects what parsing costs for the whole run, with --stats, and prints
+ * it on std::cerr when main returns: I/O, then box types by the time spent
+ * parsing them and decoding their tables
+ */
+class StatsReport {
+public:
+    StatsReport() : scope_(stats_), start_(std::chrono::steady_clock::now()) {}
+
+    ~StatsReport() {
+        auto ms = std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count();
+        const auto &io = stats_.io_;
+        std::cerr << "reads: " << io.reads_ << ", seeks: " << io.seeks_
+                  << ", bytes read: " << io.bytes_read_
+                  << ", bytes skipped: " << io.bytes_skipped_
+                  << ", source reads: " << io.source_reads_ << ", in " << ms
+                  << " ms\n";
+        std::vector<std::pair<uint32_t, mov::BoxStats>> boxes(
+            stats_.boxes_.begin(), stats_.boxes_.end());
+        auto cost = [](const mov::BoxStats &box) {
+            return box.self_ns_ + box.decode_ns_;
+        };
+        std::sort(boxes.begin(), boxes.end(),
+                  [&](const auto &a, const auto &b) {
+                      return cost(a.second) > cost(b.second);
+                  });
+        std::cerr << "type      count     total ms      self ms    decodes"
+                     "    decode ms     allocs  alloc bytes\n";
+        for (const auto &item : boxes) {
+            const auto &box = item.second;
+            char line[160];
+            snprintf(line, sizeof(line),
+                     "%-4s %10llu %12.3f %12.3f %10llu %12.3f %10llu %12llu\n",
+                     mov::Box::boxType2Str(item.first).c_str(),
+                     static_cast<unsigned long long>(box.count_),
+                     box.total_ns_ / 1e6, box.self_ns_ / 1e6,
+                     static_cast<unsigned long long>(box.decodes_),
+                     box.decode_ns_ / 1e6,
+                     static_cast<unsigned long long>(box.allocations_),
+                     static_cast<unsigned long long>(box.bytes_allocated_));
+            std::cerr << line;
+        }
+    }
+
+private:
+    mov::ParseStats stats_;
+    mov::StatsScope scope_;
+    std::chrono::steady_clock::time_point start_;
+};
 
 static void usage(const char *arg0) {
-    std::cout << "usage: " << arg0 << " -v file.mp4\n";
+    std::cout << "usage: " << arg0
+              << " [-v] [-n entries] [-o text|json|binary] file.mp4\n"
+              << "       " << arg0 << " -q path [-v] [-n entries] [-o ...] "
+              << "file.mp4\n"
+              << "       " << arg0 << " -v - < file.mp4\n"
+              << "       " << arg0 << " -p file.mp4\n"
+              << "       " << arg0 << " -m file.mp4\n"
+              << "       " << arg0 << " -j threads file.mp4\n"
+              << "       " << arg0
+              << " -b [-j threads] file|dir|@list ...\n"
+              << "       " << arg0 << " -d [-c cachedir] file.mp4\n"
+              << "       " << arg0 << " -f in.mp4 out.mp4\n"
+              << "       " << arg0 << " -t start,end in.mp4 out.mp4\n"
+              << "--stats before any of these prints what parsing cost on "
+              << "stderr\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -39,12 +383,63 @@ int main(int argc, char *argv[]) {
 
     int ch = 0;
     bool verbose = false;
+    const char *format = "text";
+    uint64_t max_entries = 0;
+    bool probe = false;
+    bool moov = false;
+    size_t threads = 0;
+    bool batch = false;
+    bool fast = false;
+    bool samples = false;
+    const char *range = nullptr;
+    const char *cache_dir = nullptr;
+    const char *path = nullptr;
+    bool stats = false;
 
-    while ((ch = getopt(argc, argv, "v")) != -1) {
+    static const option long_options[] = {{"stats", no_argument, nullptr, 'S'},
+                                          {nullptr, 0, nullptr, 0}};
+    while ((ch = getopt_long(argc, argv, "vpmbdfc:j:n:o:q:t:", long_options,
+                             nullptr)) != -1) {
         switch (ch) {
             case 'v':
                 verbose = true;
                 break;
+            case 'p':
+                probe = true;
+                break;
+            case 'm':
+                moov = true;
+                break;
+            case 'b':
+                batch = true;
+                break;
+            case 'd':
+                samples = true;
+                break;
+            case 'f':
+                fast = true;
+                break;
+            case 't':
+                range = optarg;
+                break;
+            case 'c':
+                cache_dir = optarg;
+                break;
+            case 'j':
+                threads = strtoul(optarg, nullptr, 10);
+                break;
+            case 'n':
+                max_entries = strtoull(optarg, nullptr, 10);
+                break;
+            case 'o':
+                format = optarg;
+                break;
+            case 'q':
+                path = optarg;
+                break;
+            case 'S':
+                stats = true;
+                break;
             case '?':
             default:
                 usage(argv[0]);
@@ -54,8 +449,72 @@ int main(int argc, char *argv[]) {
 
     argc -= optind;
     argv += optind;
-    auto boxes = mov::Mp4Paser::parse(*argv);
-    dumpBox(boxes, verbose);
+    if (argc < 1) {
+        usage(argv[-optind]);
+        return EXIT_FAILURE;
+    }
+    if (stats && !mov::kStatsEnabled) {
+        std::cerr << "--stats needs a build with -DMP4_STATS=ON\n";
+        return EXIT_FAILURE;
+    }
+    std::optional<StatsReport> report;
+    if (stats) {
+        report.emplace();
+    }
+    if (range != nullptr) {
+        if (argc < 2) {
+            usage(argv[-optind]);
+            return EXIT_FAILURE;
+        }
+        return trim(range, argv[0], argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (fast) {
+        if (argc < 2) {
+            usage(argv[-optind]);
+            return EXIT_FAILURE;
+        }
+        return faststart(argv[0], argv[1]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (samples) {
+        return demux(*argv, cache_dir) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (batch) {
+        return scanBatch(argv, argc, threads) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (probe) {
+        return printProbe(*argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    return EXIT_SUCCESS;
+    // Table entries: all of them with -v, otherwise the first one
+    if (max_entries == 0) {
+        max_entries = verbose ? UINT64_MAX : 1;
+    }
+    mov::OutputSink sink(stdout);
+    auto out = makeWriter(format, sink.buffer(), max_entries);
+    if (out == nullptr) {
+        usage(argv[-optind]);
+        return EXIT_FAILURE;
+    }
+    bool ok = true;
+    if (path != nullptr) {
+        ok = query(path, *argv, *out, sink);
+    } else if (moov) {
+        bool text = strcmp(format, "text") == 0;
+        ok = dumpMoov(*argv, *out, sink, text ? std::cout : std::cerr);
+    } else if (threads > 0) {
+        ok = dumpParallel(*argv, *out, sink, threads);
+    } else if (strcmp(*argv, "-") == 0) {
+        ok = dumpStream(stdin, *out, sink);
+    } else {
+        mov::FileOp file(*argv);
+        if (!file.open("r")) {
+            std::cerr << "open " << *argv << " failed\n";
+            return EXIT_FAILURE;
+        }
+        DumpVisitor visitor(*out, sink);
+        mov::walkBoxes(file, visitor);
+    }
+    out->finish();
+    ok = sink.flush() && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -1,36 +1,149 @@
 #pragma once
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <array>
+#include <charconv>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MOV_X86_SIMD 1
+#endif
+
 namespace mov {
 
-static constexpr uint16_t buf2UInt16(uint8_t *buf) {
+static constexpr uint16_t buf2UInt16(const uint8_t *buf) {
     return (uint16_t)buf[0] << 8U | buf[1];
 }
 
-static constexpr uint32_t buf2UInt32(uint8_t *buf) {
+static constexpr uint32_t buf2UInt32(const uint8_t *buf) {
     return (uint32_t)buf[0] << 24U | (uint32_t)buf[1] << 16U |
            (uint32_t)buf[2] << 8U | buf[3];
 }
 
-static constexpr uint64_t buf2UInt64(uint8_t *buf) {
+static constexpr uint64_t buf2UInt64(const uint8_t *buf) {
     uint64_t high = buf2UInt32(buf);
-    int64_t low = buf2UInt32(buf + 4);
-    return high + low;
+    uint64_t low = buf2UInt32(buf + 4);
+    return high << 32U | low;
+}
+
+static constexpr void putBigU16(uint8_t *buf, uint16_t v) {
+    buf[0] = static_cast<uint8_t>(v >> 8U);
+    buf[1] = static_cast<uint8_t>(v);
+}
+
+static constexpr void putBigU32(uint8_t *buf, uint32_t v) {
+    putBigU16(buf, static_cast<uint16_t>(v >> 16U));
+    putBigU16(buf + 2, static_cast<uint16_t>(v));
+}
+
+static constexpr void putBigU64(uint8_t *buf, uint64_t v) {
+    putBigU32(buf, static_cast<uint32_t>(v >> 32U));
+    putBigU32(buf + 4, static_cast<uint32_t>(v));
+}
+
+#ifdef MOV_X86_SIMD
+static int simdLevel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return 2;
+    if (__builtin_cpu_supports("ssse3")) return 1;
+    return 0;
+}
+
+__attribute__((target("avx2"))) static size_t bswapAVX2(const uint8_t *src,
+                                                        uint8_t *dst,
+                                                        size_t bytes,
+                                                        const int8_t *order) {
+    auto mask = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(order));
+    size_t i = 0;
+    for (; i + 32 <= bytes; i += 32) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+                            _mm256_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+__attribute__((target("ssse3"))) static size_t bswapSSSE3(const uint8_t *src,
+                                                          uint8_t *dst,
+                                                          size_t bytes,
+                                                          const int8_t *order) {
+    auto mask = _mm_loadu_si128(reinterpret_cast<const __m128i *>(order));
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_shuffle_epi8(v, mask));
+    }
+    return i;
+}
+
+// Byte swap whole vectors, return how many bytes were done. The caller
+// finishes the tail with the scalar helpers.
+template <size_t W>
+static size_t bswapVector(const uint8_t *src, uint8_t *dst, size_t bytes) {
+    static const int level = simdLevel();
+    // pshufb indexes within each 128 bit lane, so the pattern repeats
+    int8_t order[32];
+    for (int i = 0; i < 32; i++) {
+        order[i] = static_cast<int8_t>(i % 16 / W * W + W - 1 - i % W);
+    }
+    if (level >= 2) {
+        return bswapAVX2(src, dst, bytes, order);
+    }
+    if (level >= 1) {
+        return bswapSSSE3(src, dst, bytes, order);
+    }
+    return 0;
+}
+#endif
+
+/**
+ * Decode n big endian values from src into dst
+ *
+ * src may alias dst, so a table can be read into its final storage and
+ * converted in place.
+ */
+static void bigU32Array(const uint8_t *src, uint32_t *dst, size_t n) {
+    size_t i = 0;
+#ifdef MOV_X86_SIMD
+    i = bswapVector<4>(src, reinterpret_cast<uint8_t *>(dst), n * 4) / 4;
+#endif
+    for (; i < n; i++) {
+        dst[i] = buf2UInt32(src + i * 4);
+    }
+}
+
+static void bigU64Array(const uint8_t *src, uint64_t *dst, size_t n) {
+    size_t i = 0;
+#ifdef MOV_X86_SIMD
+    i = bswapVector<8>(src, reinterpret_cast<uint8_t *>(dst), n * 8) / 8;
+#endif
+    for (; i < n; i++) {
+        dst[i] = buf2UInt64(src + i * 8);
+    }
 }
 
 static std::string sec2Str(int64_t sec) {
@@ -45,1026 +158,4084 @@ static std::string sec2Str(int64_t sec) {
     return ss.str();
 }
 
-class FileOp {
+/**
+ * Read only view of a byte range
+ *
+ * Accessors are bounds checked and throw std::out_of_range, the same way
+ * std::optional::value() throws when a field is missing.
+ */
+class ByteSpan {
 public:
-    FileOp(const std::string &path) : path_(path) {}
+    ByteSpan() = default;
 
-    ~FileOp() {
-        if (file_) {
-            fclose(file_);
-        }
+    ByteSpan(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+    const uint8_t *data() const { return data_; }
+
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    ByteSpan subspan(size_t pos, size_t n) const {
+        check(pos, n);
+        return ByteSpan(data_ + pos, n);
     }
 
-    bool open(const std::string &mode) {
-        file_ = fopen(path_.c_str(), mode.c_str());
-        return file_ != nullptr;
+    uint8_t u8(size_t pos) const {
+        check(pos, 1);
+        return data_[pos];
     }
 
-    size_t read(void *ptr, size_t size, size_t nitems) {
-        return fread(ptr, size, nitems, file_);
+    uint16_t bigU16(size_t pos) const {
+        check(pos, 2);
+        return buf2UInt16(data_ + pos);
+    }
+
+    uint32_t bigU32(size_t pos) const {
+        check(pos, 4);
+        return buf2UInt32(data_ + pos);
+    }
+
+    uint64_t bigU64(size_t pos) const {
+        check(pos, 8);
+        return buf2UInt64(data_ + pos);
     }
 
-    size_t tell() {
-        auto ret = ftello(file_);
-        if (ret == -1) {
-            throw std::ios_base::failure(strerror(errno));
+private:
+    void check(size_t pos, size_t n) const {
+        if (pos > size_ || n > size_ - pos) {
+            throw std::out_of_range("ByteSpan: read past end");
         }
-        return ret;
     }
 
-    int seek(off_t offset, int whence) { return fseeko(file_, offset, whence); }
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+};
 
-    std::optional<uint16_t> readAsBigU16() {
-        uint8_t buf[2];
-        if (!read(buf, sizeof(buf), 1)) {
-            return std::optional<uint16_t>();
+/**
+ * Random access input that box parsers read from
+ *
+ * readAt() has no implicit position, so one source can be shared by several
+ * FileOp cursors. Sources that hold the whole input in memory return it from
+ * data(), which lets FileOp hand out spans without copying.
+ *
+ * A source may cover only part of the input: it holds the bytes from origin()
+ * up to size(), and data() points at the byte at origin().
+ */
+class ByteSource {
+public:
+    virtual ~ByteSource() = default;
+
+    virtual uint64_t size() const = 0;
+
+    virtual size_t readAt(uint64_t offset, void *ptr, size_t n) = 0;
+
+    virtual const uint8_t *data() const { return nullptr; }
+
+    virtual uint64_t origin() const { return 0; }
+
+    // Whether readAt() may be called from several threads at once
+    virtual bool concurrentReads() const { return data() != nullptr; }
+};
+
+/**
+ * stdio backed source, the fallback for pipes and writable files
+ */
+class StdioSource : public ByteSource {
+public:
+    ~StdioSource() override {
+        if (file_) {
+            fclose(file_);
         }
-        return std::optional<uint16_t>(buf2UInt16(buf));
     }
 
-    std::optional<uint32_t> readAsBigU32() {
-        uint8_t buf[4];
-        if (!read(buf, sizeof(buf), 1)) {
-            return std::optional<uint32_t>();
+    bool open(const std::string &path, const std::string &mode) {
+        file_ = fopen(path.c_str(), mode.c_str());
+        if (file_ == nullptr) {
+            return false;
         }
-        return std::optional<uint32_t>(buf2UInt32(buf));
+        struct stat st {};
+        if (fstat(fileno(file_), &st) == 0 && S_ISREG(st.st_mode)) {
+            size_ = st.st_size;
+        }
+        return true;
     }
 
-    std::optional<uint64_t> readAsBigU64() {
-        uint8_t buf[8];
-        if (!read(buf, sizeof(buf), 1)) {
-            return std::optional<uint64_t>();
+    uint64_t size() const override { return size_; }
+
+    size_t readAt(uint64_t offset, void *ptr, size_t n) override {
+        if (offset != pos_) {
+            if (fseeko(file_, offset, SEEK_SET) != 0) {
+                return 0;
+            }
+            pos_ = offset;
         }
-        return std::optional<uint64_t>(buf2UInt64(buf));
+        auto ret = fread(ptr, 1, n, file_);
+        pos_ += ret;
+        return ret;
     }
 
 private:
-    std::string path_;
-    FILE *file_;
+    FILE *file_ = nullptr;
+    uint64_t size_ = UINT64_MAX;
+    uint64_t pos_ = 0;
 };
 
-class Box;
-
-std::shared_ptr<Box> toDetailType(std::unique_ptr<Box> base);
-
-class Box {
+/**
+ * File read with pread(), for files which can't be mapped
+ *
+ * No file position is involved, so one descriptor serves any number of
+ * threads and a read costs a single syscall.
+ */
+class PreadSource : public ByteSource {
 public:
-    using ExtendedType = std::array<char, 16>;
-    using Boxes = std::vector<std::shared_ptr<Box>>;
-
-    class BoxBuilder {
-    public:
-        uint64_t size_ = 0;
-        uint64_t offset_ = 0;
-        uint32_t type_{};
-        ExtendedType extended_type_{};
-
-        std::unique_ptr<Box> build() {
-            return std::make_unique<Box>(size_, offset_, type_, extended_type_);
+    ~PreadSource() override {
+        if (fd_ >= 0) {
+            close(fd_);
         }
-    };
+    }
 
-    Box(uint64_t size, uint64_t offset, uint32_t type,
-        ExtendedType extended_type)
-        : size_(size),
-          offset_(offset),
-          type_(type),
-          extended_type_(extended_type) {}
+    bool open(const std::string &path) {
+        fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_ < 0) {
+            return false;
+        }
+        struct stat st {};
+        if (fstat(fd_, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(fd_);
+            fd_ = -1;
+            return false;
+        }
+        size_ = st.st_size;
+        return true;
+    }
 
-    virtual ~Box() = default;
+    uint64_t size() const override { return size_; }
 
-    static constexpr uint32_t str2BoxType(const char (&buf)[5]) {
-        return (uint32_t)buf[3] << 24U | (uint32_t)buf[2] << 16U |
-               (uint32_t)buf[1] << 8U | buf[0];
+    size_t readAt(uint64_t offset, void *ptr, size_t n) override {
+        size_t done = 0;
+        while (done < n) {
+            auto ret = pread(fd_, static_cast<uint8_t *>(ptr) + done,
+                             n - done, offset + done);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            if (ret <= 0) {
+                break;
+            }
+            done += ret;
+        }
+        return done;
     }
 
-    static std::string boxType2Str(uint32_t baseType) {
-        char *p = reinterpret_cast<char *>(&baseType);
-        return std::string(p, 4);
-    }
+    bool concurrentReads() const override { return true; }
 
-    std::string boxTypeStr() { return boxType2Str(type_); }
+    int fd() const { return fd_; }
 
-    static std::unique_ptr<Box> parseBasic(FileOp &in) {
-        BoxBuilder builder;
-        builder.offset_ = in.tell();
+private:
+    int fd_ = -1;
+    uint64_t size_ = 0;
+};
 
-        auto size = in.readAsBigU32();
-        if (size.has_value()) {
-            builder.size_ = size.value();
-        } else {
-            return nullptr;
+/**
+ * Read only memory mapping of a regular file
+ */
+class MmapSource : public ByteSource {
+public:
+    ~MmapSource() override {
+        if (data_) {
+            munmap(data_, size_);
         }
+    }
 
-        if (!in.read(&builder.type_, sizeof(builder.type_), 1)) {
-            return nullptr;
+    bool open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
         }
-        if (builder.size_ == 1) {
-            auto large_size = in.readAsBigU64();
-            if (large_size.has_value()) {
-                builder.size_ = large_size.value();
-            } else {
-                return nullptr;
-            }
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            return false;
         }
-        if (builder.type_ == str2BoxType("uuid")) {
-            if (!in.read(builder.extended_type_.data(), 16, 1)) {
-                return nullptr;
-            }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return false;
         }
-        return builder.build();
+        data_ = static_cast<uint8_t *>(p);
+        size_ = st.st_size;
+        return true;
     }
 
-    bool parseFullBox(FileOp &file) {
-        auto data = file.readAsBigU32();
-        if (data.has_value()) {
-            fullbox_version_ = data.value() >> 24U;
-            fullbox_flag_ = data.value() & 0xFFFFFFU;
-            return true;
-        } else {
-            return false;
+    uint64_t size() const override { return size_; }
+
+    size_t readAt(uint64_t offset, void *ptr, size_t n) override {
+        if (offset >= size_) {
+            return 0;
         }
+        n = std::min<uint64_t>(n, size_ - offset);
+        memcpy(ptr, data_ + offset, n);
+        return n;
     }
 
-    virtual void parseInternal(FileOp &) {}
+    const uint8_t *data() const override { return data_; }
 
-    void parseChild(FileOp &file) {
-        auto end = offset_ + size_;
-        while (file.tell() < end) {
-            auto box = parseBasic(file);
-            if (box == nullptr) {
-                return;
-            }
-            box->parent_ = this;
-            auto detailBox = toDetailType(std::move(box));
-            detailBox->parseInternal(file);
-            children_.push_back(detailBox);
-            file.seek(detailBox->offset() + detailBox->size(), SEEK_SET);
+private:
+    uint8_t *data_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+/**
+ * In memory source, for data that was read or generated up front
+ *
+ * origin is the input offset of the first byte, so a buffer holding a single
+ * box still parses with the box's real offsets.
+ */
+class MemorySource : public ByteSource {
+public:
+    explicit MemorySource(std::vector<uint8_t> data, uint64_t origin = 0)
+        : data_(std::move(data)), origin_(origin) {}
+
+    uint64_t size() const override { return origin_ + data_.size(); }
+
+    size_t readAt(uint64_t offset, void *ptr, size_t n) override {
+        if (offset < origin_ || offset - origin_ >= data_.size()) {
+            return 0;
         }
+        offset -= origin_;
+        n = std::min<uint64_t>(n, data_.size() - offset);
+        memcpy(ptr, data_.data() + offset, n);
+        return n;
     }
 
-    virtual std::string detail() { return std::string(); }
+    const uint8_t *data() const override { return data_.data(); }
 
-    uint64_t size() const { return size_; }
+    uint64_t origin() const override { return origin_; }
 
-    uint64_t offset() const { return offset_; }
+private:
+    std::vector<uint8_t> data_;
+    uint64_t origin_ = 0;
+};
 
-    uint32_t baseType() const { return type_; }
+// I/O through FileOp cursors, and the sample reads of Demuxer
+struct IoStats {
+    // read(), span() and table reads
+    uint64_t reads_ = 0;
+    // seek() calls that moved a cursor which had read before, placing a new
+    // one isn't counted
+    uint64_t seeks_ = 0;
+    uint64_t bytes_read_ = 0;
+    // What those jumped over forwards, payloads nobody read
+    uint64_t bytes_skipped_ = 0;
+    // Reads that went to a source not held in memory, a pread() or fread()
+    uint64_t source_reads_ = 0;
+};
 
-    ExtendedType extendedType() const { return extended_type_; }
+// parse() of the boxes of one type, and the decoding of their tables
+struct BoxStats {
+    uint64_t count_ = 0;
+    // With and without the time spent on the boxes below
+    uint64_t total_ns_ = 0;
+    uint64_t self_ns_ = 0;
+    // Tables decoded when first used, after parse()
+    uint64_t decodes_ = 0;
+    uint64_t decode_ns_ = 0;
+    // Allocations made by the boxes themselves, see countAllocation()
+    uint64_t allocations_ = 0;
+    uint64_t bytes_allocated_ = 0;
+};
 
-    const Boxes &children() const { return children_; }
+/**
+ * What parsing cost: the I/O of every FileOp and the parse() time of every
+ * box type. Collected by a StatsScope when built with MOV_STATS, all zero
+ * otherwise.
+ */
+struct ParseStats {
+    IoStats io_;
+    std::map<uint32_t, BoxStats> boxes_;
+
+    // Add what another scope collected, as one on a worker thread
+    void merge(const ParseStats &other) {
+        io_.reads_ += other.io_.reads_;
+        io_.seeks_ += other.io_.seeks_;
+        io_.bytes_read_ += other.io_.bytes_read_;
+        io_.bytes_skipped_ += other.io_.bytes_skipped_;
+        io_.source_reads_ += other.io_.source_reads_;
+        for (const auto &item : other.boxes_) {
+            auto &box = boxes_[item.first];
+            box.count_ += item.second.count_;
+            box.total_ns_ += item.second.total_ns_;
+            box.self_ns_ += item.second.self_ns_;
+            box.decodes_ += item.second.decodes_;
+            box.decode_ns_ += item.second.decode_ns_;
+            box.allocations_ += item.second.allocations_;
+            box.bytes_allocated_ += item.second.bytes_allocated_;
+        }
+    }
+};
 
-    bool hasChild() { return !children_.empty(); }
+#ifdef MOV_STATS
+static constexpr bool kStatsEnabled = true;
+#else
+static constexpr bool kStatsEnabled = false;
+#endif
 
-    Box *getAncestor(uint32_t type) {
-        auto p = parent_;
-        while (p) {
-            if (p->type_ == type) return p;
-            p = p->parent_;
-        }
+/**
+ * Collects into stats what is parsed on this thread while it lives. Scopes
+ * nest, the innermost one collects. Work handed to other threads needs a
+ * scope of its own there, merged back by whoever waits for it, as
+ * ParallelParser does. Does nothing without MOV_STATS.
+ */
+class StatsScope {
+public:
+    explicit StatsScope(ParseStats &stats) {
+#ifdef MOV_STATS
+        previous_ = current();
+        current() = &stats;
+#else
+        (void)stats;
+#endif
+    }
+
+    ~StatsScope() {
+#ifdef MOV_STATS
+        current() = previous_;
+#endif
+    }
+
+    StatsScope(const StatsScope &) = delete;
+    StatsScope &operator=(const StatsScope &) = delete;
+
+    // Where this thread collects, nullptr if nowhere or without MOV_STATS
+    static ParseStats *active() {
+#ifdef MOV_STATS
+        return current();
+#else
         return nullptr;
+#endif
     }
 
-protected:
-    uint64_t size_ = 0;
-    uint64_t offset_ = 0;
-    uint32_t type_{};
-    ExtendedType extended_type_{};
+#ifdef MOV_STATS
+    static ParseStats *&current() {
+        static thread_local ParseStats *stats = nullptr;
+        return stats;
+    }
 
-    uint8_t fullbox_version_ = 0;
-    uint32_t fullbox_flag_ = 0;
+private:
+    ParseStats *previous_ = nullptr;
+#endif
+};
 
-    Boxes children_;
-    Box *parent_ = nullptr;
-    friend class Stsd;
+/**
+ * Count a read made from source outside any FileOp, as Demuxer reads its
+ * samples, into the current StatsScope
+ */
+inline void countSourceRead(const ByteSource &source, uint64_t bytes) {
+    if (auto stats = StatsScope::active()) {
+        stats->io_.reads_++;
+        stats->io_.bytes_read_ += bytes;
+        stats->io_.source_reads_ += source.data() == nullptr;
+    }
+}
+
+#ifdef MOV_STATS
+// Allocations made on this thread, as reported to countAllocation()
+struct AllocationCount {
+    uint64_t count_ = 0;
+    uint64_t bytes_ = 0;
+
+    static AllocationCount &current() {
+        static thread_local AllocationCount count;
+        return count;
+    }
 };
 
-template <typename T>
-static std::shared_ptr<Box> toDetail(Box base) {
-    return std::static_pointer_cast<Box>(std::make_shared<T>(std::move(base)));
+/**
+ * Report an allocation of bytes. The library can't see allocations by
+ * itself: a program wanting them in BoxStats replaces operator new with
+ * one that calls this, as mp4 does.
+ */
+inline void countAllocation(size_t bytes) {
+    auto &count = AllocationCount::current();
+    count.count_++;
+    count.bytes_ += bytes;
 }
 
-class Ftyp : public Box {
+/**
+ * Times one parse(), or one table decode, into the current StatsScope.
+ * Timers nest like the boxes, so a box's self time is its time less that of
+ * its children and of tables decoded meanwhile.
+ */
+class BoxTimer {
 public:
-    static const uint32_t tag_ = str2BoxType("ftyp");
-
-    Ftyp(const Box &box) : Box(box) {}
+    explicit BoxTimer(uint32_t type, bool decode = false)
+        : stats_(StatsScope::current()) {
+        if (stats_ == nullptr) {
+            return;
+        }
+        type_ = type;
+        decode_ = decode;
+        parent_ = current();
+        current() = this;
+        allocations_ = AllocationCount::current();
+        start_ = std::chrono::steady_clock::now();
+    }
 
-    void parseInternal(FileOp &file) override {
-        auto remain = size_ - (file.tell() - offset_);
-        if (remain >= 4) {
-            file.read(&major_brand_, 4, 1);
-            remain -= 4;
+    ~BoxTimer() {
+        if (stats_ == nullptr) {
+            return;
         }
-        if (remain >= 4) {
-            minor_version = file.readAsBigU32().value();
-            remain -= 4;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start_)
+                          .count();
+        const auto &now = AllocationCount::current();
+        uint64_t count = now.count_ - allocations_.count_;
+        uint64_t bytes = now.bytes_ - allocations_.bytes_;
+        auto &box = stats_->boxes_[type_];
+        if (decode_) {
+            box.decodes_++;
+            box.decode_ns_ += ns;
+        } else {
+            box.count_++;
+            box.total_ns_ += ns;
+            box.self_ns_ += ns - child_ns_;
         }
-        remain /= 4;
-        if (remain > 0) {
-            compatible_brands_.resize(remain);
-            file.read(compatible_brands_.data(), 4 * remain, 1);
+        box.allocations_ += count - child_allocations_.count_;
+        box.bytes_allocated_ += bytes - child_allocations_.bytes_;
+        current() = parent_;
+        if (parent_ != nullptr) {
+            parent_->child_ns_ += ns;
+            parent_->child_allocations_.count_ += count;
+            parent_->child_allocations_.bytes_ += bytes;
         }
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "major brand: " << boxType2Str(major_brand_)
-           << ", minor version: " << minor_version << ", compatible_brands_: ";
-        for (const auto n : compatible_brands_) {
-            ss << boxType2Str(n) << " ";
-        }
-        return ss.str();
-    }
+    BoxTimer(const BoxTimer &) = delete;
+    BoxTimer &operator=(const BoxTimer &) = delete;
 
 private:
-    uint32_t major_brand_;
-    uint32_t minor_version = 0;
-    std::vector<uint32_t> compatible_brands_{};
+    static BoxTimer *&current() {
+        static thread_local BoxTimer *timer = nullptr;
+        return timer;
+    }
+
+    ParseStats *stats_;
+    uint32_t type_ = 0;
+    bool decode_ = false;
+    BoxTimer *parent_ = nullptr;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t child_ns_ = 0;
+    AllocationCount allocations_;
+    AllocationCount child_allocations_;
 };
+#endif
 
-class Mvhd : public Box {
+/**
+ * Read cursor over a ByteSource
+ *
+ * The position lives here rather than in the source, so tell() and seek()
+ * never reach the kernel. When the source is mapped, span() and the
+ * readAsBig*() helpers read straight from memory.
+ */
+class FileOp {
+public:
+    FileOp(const std::string &path) : path_(path) {}
+
+    explicit FileOp(std::shared_ptr<ByteSource> source, uint64_t pos = 0)
+        : pos_(pos) {
+        attach(std::move(source));
+    }
+
+    bool open(const std::string &mode) {
+        if (mode.find_first_of("wa+") == std::string::npos) {
+            auto mapped = std::make_shared<MmapSource>();
+            if (mapped->open(path_)) {
+                attach(std::move(mapped));
+                return true;
+            }
+            auto file = std::make_shared<PreadSource>();
+            if (file->open(path_)) {
+                attach(std::move(file));
+                return true;
+            }
+        }
+        auto file = std::make_shared<StdioSource>();
+        if (!file->open(path_, mode)) {
+            return false;
+        }
+        attach(std::move(file));
+        return true;
+    }
+
+    const std::shared_ptr<ByteSource> &source() const { return source_; }
+
+    // Size of the input, UINT64_MAX if unknown
+    uint64_t size() const { return size_; }
+
+    /**
+     * Stop reads at offset end, as if the input ended there. Lets a parser
+     * be confined to one box.
+     */
+    void setLimit(uint64_t end) { end_ = std::min(end, size_); }
+
+    uint64_t limit() const { return end_; }
+
+    size_t read(void *ptr, size_t size, size_t nitems) {
+        if (size == 0) {
+            return 0;
+        }
+        auto ret = source_->readAt(pos_, ptr, clamp(size * nitems));
+        pos_ += ret;
+        countRead(ret, base_ == nullptr);
+        return ret / size;
+    }
+
+    size_t tell() { return pos_; }
+
+    int seek(off_t offset, int whence) {
+        int64_t base = 0;
+        switch (whence) {
+            case SEEK_SET:
+                break;
+            case SEEK_CUR:
+                base = pos_;
+                break;
+            case SEEK_END:
+                if (size_ == UINT64_MAX) {
+                    return -1;
+                }
+                base = size_;
+                break;
+            default:
+                return -1;
+        }
+        if (base + offset < 0) {
+            return -1;
+        }
+        countSeek(base + offset);
+        pos_ = base + offset;
+        return 0;
+    }
+
+    /**
+     * Return a view of the next n bytes and advance past them
+     *
+     * The span is shorter than n at end of input. Without a mapping, the
+     * bytes are copied into a buffer that is reused by the next call.
+     */
+    ByteSpan span(size_t n) {
+        n = clamp(n);
+        if (base_ != nullptr) {
+            if (pos_ < origin_) {
+                return ByteSpan();
+            }
+            ByteSpan ret(base_ + (pos_ - origin_), n);
+            pos_ += n;
+            countRead(n, false);
+            return ret;
+        }
+        scratch_.resize(n);
+        auto ret = source_->readAt(pos_, scratch_.data(), n);
+        pos_ += ret;
+        countRead(ret, true);
+        return ByteSpan(scratch_.data(), ret);
+    }
+
+    std::optional<uint16_t> readAsBigU16() {
+        auto buf = span(2);
+        if (buf.size() < 2) {
+            return std::optional<uint16_t>();
+        }
+        return std::optional<uint16_t>(buf2UInt16(buf.data()));
+    }
+
+    std::optional<uint32_t> readAsBigU32() {
+        auto buf = span(4);
+        if (buf.size() < 4) {
+            return std::optional<uint32_t>();
+        }
+        return std::optional<uint32_t>(buf2UInt32(buf.data()));
+    }
+
+    std::optional<uint64_t> readAsBigU64() {
+        auto buf = span(8);
+        if (buf.size() < 8) {
+            return std::optional<uint64_t>();
+        }
+        return std::optional<uint64_t>(buf2UInt64(buf.data()));
+    }
+
+    /**
+     * Read a table of n big endian values with one read and convert it in
+     * bulk. Return false if the input ends first.
+     */
+    bool readBigU32Array(uint32_t *dst, size_t n) {
+        return readBigArray(dst, n, bigU32Array);
+    }
+
+    bool readBigU64Array(uint64_t *dst, size_t n) {
+        return readBigArray(dst, n, bigU64Array);
+    }
+
+    // I/O through this cursor, all zero without MOV_STATS
+    IoStats stats() const {
+#ifdef MOV_STATS
+        return io_;
+#else
+        return IoStats();
+#endif
+    }
+
+private:
+    // Count a read of bytes, from the source itself when source
+    void countRead(uint64_t bytes, bool source) {
+#ifdef MOV_STATS
+        for (auto io : {&io_, current()}) {
+            if (io == nullptr) continue;
+            io->reads_++;
+            io->bytes_read_ += bytes;
+            io->source_reads_ += source;
+        }
+#else
+        (void)bytes;
+        (void)source;
+#endif
+    }
+
+    void countSeek(uint64_t pos) {
+#ifdef MOV_STATS
+        if (pos == pos_ || io_.reads_ == 0) {
+            return;
+        }
+        for (auto io : {&io_, current()}) {
+            if (io == nullptr) continue;
+            io->seeks_++;
+            io->bytes_skipped_ += pos > pos_ ? pos - pos_ : 0;
+        }
+#else
+        (void)pos;
+#endif
+    }
+
+#ifdef MOV_STATS
+    static IoStats *current() {
+        auto stats = StatsScope::current();
+        return stats != nullptr ? &stats->io_ : nullptr;
+    }
+#endif
+
+    template <typename T>
+    bool readBigArray(T *dst, size_t n,
+                      void (*decode)(const uint8_t *, T *, size_t)) {
+        auto bytes = n * sizeof(T);
+        if (base_ != nullptr) {
+            auto buf = span(bytes);
+            if (buf.size() < bytes) {
+                return false;
+            }
+            decode(buf.data(), dst, n);
+            return true;
+        }
+        auto ret = source_->readAt(pos_, dst, clamp(bytes));
+        pos_ += ret;
+        countRead(ret, true);
+        if (ret < bytes) {
+            return false;
+        }
+        decode(reinterpret_cast<const uint8_t *>(dst), dst, n);
+        return true;
+    }
+
+    size_t clamp(size_t n) const {
+        return pos_ < end_ ? std::min<uint64_t>(n, end_ - pos_) : 0;
+    }
+
+    void attach(std::shared_ptr<ByteSource> source) {
+        source_ = std::move(source);
+        base_ = source_->data();
+        origin_ = source_->origin();
+        size_ = source_->size();
+        end_ = size_;
+    }
+
+    std::string path_;
+    std::shared_ptr<ByteSource> source_;
+    const uint8_t *base_ = nullptr;
+    uint64_t origin_ = 0;
+    uint64_t size_ = 0;
+    uint64_t end_ = 0;
+    uint64_t pos_ = 0;
+    std::vector<uint8_t> scratch_;
+#ifdef MOV_STATS
+    IoStats io_;
+#endif
+};
+
+/**
+ * Write cursor over a preallocated buffer, what Box::write() emits into
+ *
+ * Box::updateSize() says how big the buffer has to be, so writing is only
+ * bounds checked: a box that writes more than it said throws
+ * std::out_of_range. Payload bytes a box didn't decode are copied from
+ * source, the input the boxes were parsed from.
+ */
+class BoxWriter {
+public:
+    BoxWriter(uint8_t *data, size_t size, ByteSource *source = nullptr)
+        : data_(data), size_(size), source_(source) {}
+
+    size_t tell() const { return pos_; }
+
+    // Advance past n bytes and return where they go
+    uint8_t *reserve(size_t n) {
+        if (n > size_ - pos_) {
+            throw std::out_of_range("BoxWriter: write past end");
+        }
+        auto ret = data_ + pos_;
+        pos_ += n;
+        return ret;
+    }
+
+    void writeU8(uint8_t v) { *reserve(1) = v; }
+
+    void writeBigU16(uint16_t v) { putBigU16(reserve(2), v); }
+
+    void writeBigU32(uint32_t v) { putBigU32(reserve(4), v); }
+
+    void writeBigU64(uint64_t v) { putBigU64(reserve(8), v); }
+
+    void writeBytes(const void *ptr, size_t n) {
+        if (n > 0) {
+            memcpy(reserve(n), ptr, n);
+        }
+    }
+
+    // Encode a table in bulk, the reverse of FileOp::readBigU32Array()
+    void writeBigU32Array(const uint32_t *src, size_t n) {
+        writeBigArray(src, n, putBigU32);
+    }
+
+    void writeBigU64Array(const uint64_t *src, size_t n) {
+        writeBigArray(src, n, putBigU64);
+    }
+
+    // Copy n bytes at offset of the source
+    void copyFrom(uint64_t offset, uint64_t n) {
+        if (n == 0) {
+            return;
+        }
+        if (source_ == nullptr) {
+            throw std::runtime_error("BoxWriter: no source to copy from");
+        }
+        if (source_->readAt(offset, reserve(n), n) != n) {
+            throw std::runtime_error("BoxWriter: source read failed");
+        }
+    }
+
+private:
+    template <typename T>
+    void writeBigArray(const T *src, size_t n,
+                       void (*encode)(uint8_t *, T)) {
+        auto dst = reserve(n * sizeof(T));
+        size_t i = 0;
+#ifdef MOV_X86_SIMD
+        // A byte swap is its own inverse
+        i = bswapVector<sizeof(T)>(reinterpret_cast<const uint8_t *>(src), dst,
+                                   n * sizeof(T)) /
+            sizeof(T);
+#endif
+        for (; i < n; i++) {
+            encode(dst + i * sizeof(T), src[i]);
+        }
+    }
+
+    uint8_t *data_;
+    size_t size_;
+    size_t pos_ = 0;
+    ByteSource *source_;
+};
+
+class Box;
+
+std::shared_ptr<Box> toDetailType(std::unique_ptr<Box> base);
+
+/**
+ * Box header fields, as read from the input
+ */
+struct BoxHeader {
+    uint64_t size_ = 0;
+    uint64_t offset_ = 0;
+    uint32_t type_{};
+    uint32_t header_size_ = 0;
+    std::array<char, 16> extended_type_{};
+
+    uint64_t payloadOffset() const { return offset_ + header_size_; }
+
+    uint64_t end() const { return offset_ + size_; }
+};
+
+/**
+ * Where Box::format() sends the fields of a box
+ *
+ * Table entries are asked for one at a time with entry(), which says no
+ * once max_entries of a table have been written. The box stops there, so a
+ * limited dump costs what it prints rather than what the tables hold.
+ */
+class DetailWriter {
+public:
+    explicit DetailWriter(uint64_t max_entries = UINT64_MAX)
+        : max_entries_(max_entries) {}
+
+    virtual ~DetailWriter() = default;
+
+    uint64_t maxEntries() const { return max_entries_; }
+
+    /**
+     * Whether this writes the dump text. The tables whose text predates the
+     * writers keep their own lines by handing them over through text(),
+     * which stops after maxEntries() entry lines.
+     */
+    virtual bool plainText() const { return false; }
+
+    // Nested boxes are begun before their parent ends
+    virtual void beginBox(Box &box, int depth) = 0;
+
+    virtual void endBox() {}
+
+    // After the last box
+    virtual void finish() {}
+
+    template <typename T>
+    void field(const char *name, T value) {
+        static_assert(std::is_integral<T>::value, "integer field");
+        if (std::is_signed<T>::value) {
+            putSigned(name, value);
+        } else {
+            putUnsigned(name, value);
+        }
+    }
+
+    void field(const char *name, const std::string &value) {
+        putString(name, value);
+    }
+
+    // Flags and the like, shown in hex where that means anything
+    void hexField(const char *name, uint64_t value) { putHex(name, value); }
+
+    // Free form detail of a box without fields of its own
+    void text(const std::string &text) {
+        if (!text.empty()) putText(text);
+    }
+
+    /**
+     * Start entry index of the table named table. Return false when the
+     * entry is over the limit, the caller should stop and call more().
+     */
+    bool entry(const char *table, uint64_t index) {
+        if (index >= max_entries_) return false;
+        putEntry(table, index);
+        return true;
+    }
+
+    // count entries of table were left out
+    void more(const char *table, uint64_t count) {
+        if (count > 0) putMore(table, count);
+    }
+
+protected:
+    virtual void putUnsigned(const char *name, uint64_t value) = 0;
+    virtual void putSigned(const char *name, int64_t value) = 0;
+    virtual void putHex(const char *name, uint64_t value) = 0;
+    virtual void putString(const char *name, const std::string &value) = 0;
+    virtual void putText(const std::string &text) = 0;
+    virtual void putEntry(const char *table, uint64_t index) = 0;
+    virtual void putMore(const char *table, uint64_t count) = 0;
+
+    static void appendNumber(std::string &out, uint64_t value, int base = 10) {
+        char buf[24];
+        auto end = std::to_chars(buf, buf + sizeof(buf), value, base).ptr;
+        out.append(buf, end);
+    }
+
+    static void appendNumber(std::string &out, int64_t value) {
+        char buf[24];
+        auto end = std::to_chars(buf, buf + sizeof(buf), value).ptr;
+        out.append(buf, end);
+    }
+
+private:
+    uint64_t max_entries_;
+};
+
+class Box {
+public:
+    using ExtendedType = std::array<char, 16>;
+    using Boxes = std::vector<std::shared_ptr<Box>>;
+
+    class BoxBuilder : public BoxHeader {
+    public:
+        BoxBuilder() = default;
+
+        explicit BoxBuilder(const BoxHeader &header) : BoxHeader(header) {}
+
+        std::unique_ptr<Box> build() {
+            return std::make_unique<Box>(size_, offset_, type_, extended_type_,
+                                         header_size_);
+        }
+    };
+
+    /**
+     * header_size is what the header took in the input, 0 for a box made in
+     * memory, which has no input bytes to fall back on when written.
+     */
+    Box(uint64_t size, uint64_t offset, uint32_t type,
+        ExtendedType extended_type, uint32_t header_size = 0)
+        : size_(size),
+          offset_(offset),
+          type_(type),
+          extended_type_(extended_type),
+          header_size_(header_size) {}
+
+    virtual ~Box() = default;
+
+    static constexpr uint32_t str2BoxType(const char (&buf)[5]) {
+        return (uint32_t)buf[3] << 24U | (uint32_t)buf[2] << 16U |
+               (uint32_t)buf[1] << 8U | buf[0];
+    }
+
+    static std::string boxType2Str(uint32_t baseType) {
+        char *p = reinterpret_cast<char *>(&baseType);
+        return std::string(p, 4);
+    }
+
+    std::string boxTypeStr() { return boxType2Str(type_); }
+
+    /**
+     * Read the header of the box at offset with one positional read. No
+     * cursor is involved, so several threads can read headers from the same
+     * source. Bytes from end on are treated as missing. A box that would
+     * run past the end of the 64-bit offset range, or past the end of a
+     * source of known size, is rejected.
+     */
+    static bool readHeaderAt(ByteSource &source, uint64_t offset,
+                             BoxHeader &header, uint64_t end = UINT64_MAX) {
+        uint8_t buf[32];
+        size_t len = offset < end ? std::min<uint64_t>(sizeof(buf),
+                                                       end - offset)
+                                  : 0;
+        len = source.readAt(offset, buf, len);
+        if (len < 8) {
+            return false;
+        }
+        header.offset_ = offset;
+        header.size_ = buf2UInt32(buf);
+        memcpy(&header.type_, buf + 4, sizeof(header.type_));
+        header.header_size_ = 8;
+
+        if (header.size_ == 1) {
+            if (len < 16) {
+                return false;
+            }
+            header.size_ = buf2UInt64(buf + 8);
+            header.header_size_ += 8;
+        } else if (header.size_ == 0 && source.size() != UINT64_MAX) {
+            header.size_ = source.size() - offset;
+        }
+        if (header.size_ > UINT64_MAX - offset ||
+            (source.size() != UINT64_MAX && header.end() > source.size())) {
+            return false;
+        }
+        if (header.type_ == str2BoxType("uuid")) {
+            if (len < header.header_size_ + 16) {
+                return false;
+            }
+            memcpy(header.extended_type_.data(), buf + header.header_size_,
+                   16);
+            header.header_size_ += 16;
+        }
+        return true;
+    }
+
+    // Read the header at the cursor and leave the cursor at the payload
+    static bool readHeader(FileOp &in, BoxHeader &header) {
+        if (!readHeaderAt(*in.source(), in.tell(), header, in.limit())) {
+            return false;
+        }
+        in.seek(header.payloadOffset(), SEEK_SET);
+        return true;
+    }
+
+    static std::unique_ptr<Box> parseBasic(FileOp &in) {
+        BoxBuilder builder;
+        if (!readHeader(in, builder)) {
+            return nullptr;
+        }
+        return builder.build();
+    }
+
+    // Parse the header of the box at offset, leaving in at its payload
+    static std::unique_ptr<Box> parseBasic(FileOp &in, uint64_t offset) {
+        BoxBuilder builder;
+        if (!readHeaderAt(*in.source(), offset, builder, in.limit())) {
+            return nullptr;
+        }
+        in.seek(builder.payloadOffset(), SEEK_SET);
+        return builder.build();
+    }
+
+    /**
+     * Where the children of a container box start, counted from its payload.
+     * Return -1 for boxes without children. Each detail type states its own
+     * in children_offset_.
+     */
+    static int childrenOffset(uint32_t type);
+
+    static constexpr int children_offset_ = -1;
+
+    bool parseFullBox(FileOp &file) {
+        auto data = file.readAsBigU32();
+        if (data.has_value()) {
+            fullbox_version_ = data.value() >> 24U;
+            fullbox_flag_ = data.value() & 0xFFFFFFU;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    virtual void parseInternal(FileOp &) {}
+
+    /**
+     * Parse the payload with parseInternal(), timed into the current
+     * StatsScope when built with MOV_STATS. Callers use this rather than
+     * parseInternal(), so no box goes uncounted.
+     */
+    void parse(FileOp &file) {
+#ifdef MOV_STATS
+        BoxTimer timer(type_);
+#endif
+        parseInternal(file);
+    }
+
+    void parseChild(FileOp &file) {
+        auto end = offset_ + size_;
+        for (uint64_t pos = file.tell(); pos < end;) {
+            auto box = parseBasic(file, pos);
+            if (box == nullptr) {
+                return;
+            }
+            box->parent_ = this;
+            auto detailBox = toDetailType(std::move(box));
+            detailBox->parse(file);
+            children_.push_back(detailBox);
+            if (detailBox->size() == 0) {
+                return;
+            }
+            pos = detailBox->offset() + detailBox->size();
+        }
+    }
+
+    virtual std::string detail() { return std::string(); }
+
+    /**
+     * Write the fields of this box. Boxes with large tables override this
+     * to stop at the writer's entry limit, the others hand over detail().
+     */
+    virtual void format(DetailWriter &out) { out.text(detail()); }
+
+    /**
+     * Size pass of serialization: work out the size of this box as written,
+     * children included, and keep it for write(). A box keeps largesize if
+     * it had it, and gets it once it no longer fits in 32 bits.
+     */
+    uint64_t updateSize() {
+        auto payload = payloadSize();
+        uint64_t header = type_ == str2BoxType("uuid") ? 24 : 8;
+        write_large_ = header_size_ == header + 8 ||
+                       header + payload > UINT32_MAX;
+        write_size_ = header + (write_large_ ? 8 : 0) + payload;
+        return write_size_;
+    }
+
+    /**
+     * Write pass: emit the box as sized by the last updateSize(). size() and
+     * offset() keep describing the input.
+     */
+    void write(BoxWriter &out) {
+        auto start = out.tell();
+        out.writeBigU32(write_large_ ? 1 : static_cast<uint32_t>(write_size_));
+        out.writeBytes(&type_, sizeof(type_));
+        if (write_large_) {
+            out.writeBigU64(write_size_);
+        }
+        if (type_ == str2BoxType("uuid")) {
+            out.writeBytes(extended_type_.data(), extended_type_.size());
+        }
+        writePayload(out);
+        if (out.tell() - start != write_size_) {
+            throw std::logic_error("box " + boxType2Str(type_) +
+                                   " changed size while being written");
+        }
+    }
+
+    /**
+     * Serialize boxes into out: one pass to size every box, then one write
+     * into a buffer allocated once. source is the input the boxes were
+     * parsed from, which payloads that weren't decoded are copied from.
+     */
+    static bool serialize(const Boxes &boxes, ByteSource *source,
+                          std::vector<uint8_t> &out) {
+        uint64_t size = 0;
+        for (const auto &box : boxes) {
+            size += box->updateSize();
+        }
+        try {
+            out.resize(size);
+            BoxWriter writer(out.data(), out.size(), source);
+            for (const auto &box : boxes) {
+                box->write(writer);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << "serialize failed: " << e.what() << '\n';
+            out.clear();
+            return false;
+        }
+        return true;
+    }
+
+    uint64_t size() const { return size_; }
+
+    uint64_t offset() const { return offset_; }
+
+    uint32_t baseType() const { return type_; }
+
+    ExtendedType extendedType() const { return extended_type_; }
+
+    const Boxes &children() const { return children_; }
+
+    bool hasChild() { return !children_.empty(); }
+
+    Box *findChild(uint32_t type) const {
+        for (const auto &item : children_) {
+            if (item->type_ == type) return item.get();
+        }
+        return nullptr;
+    }
+
+    /**
+     * First child of detail type T. Boxes with T's tag are always built as
+     * T, so the tag check stands in for a dynamic_cast.
+     */
+    template <typename T>
+    T *child() const {
+        return static_cast<T *>(findChild(T::tag_));
+    }
+
+    // This box as detail type T, or nullptr if it has another type
+    template <typename T>
+    T *as() {
+        return type_ == T::tag_ ? static_cast<T *>(this) : nullptr;
+    }
+
+    Box *parent() const { return parent_; }
+
+    void setParent(Box *parent) { parent_ = parent; }
+
+    void appendChild(std::shared_ptr<Box> child) {
+        child->parent_ = this;
+        children_.push_back(std::move(child));
+    }
+
+    // Put box in the place of the child old, return false if it isn't one
+    bool replaceChild(const Box *old, std::shared_ptr<Box> box) {
+        for (auto &item : children_) {
+            if (item.get() == old) {
+                box->parent_ = this;
+                item = std::move(box);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool removeChild(const Box *old) {
+        for (auto it = children_.begin(); it != children_.end(); ++it) {
+            if (it->get() == old) {
+                children_.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Box *getAncestor(uint32_t type) {
+        auto p = parent_;
+        while (p) {
+            if (p->type_ == type) return p;
+            p = p->parent_;
+        }
+        return nullptr;
+    }
+
+    template <typename T>
+    T *ancestor() {
+        return static_cast<T *>(getAncestor(T::tag_));
+    }
+
+protected:
+    /**
+     * Payload size as written. Boxes that don't override it and
+     * writePayload() are written as they were read: the payload bytes of
+     * leaf boxes, and for containers the bytes ahead of the children
+     * followed by the children themselves.
+     */
+    virtual uint64_t payloadSize() {
+        auto children = childrenOffset(type_);
+        if (children < 0) {
+            return inputPayloadSize();
+        }
+        return children + childrenSize();
+    }
+
+    virtual void writePayload(BoxWriter &out) {
+        auto children = childrenOffset(type_);
+        if (children < 0) {
+            out.copyFrom(offset_ + header_size_, inputPayloadSize());
+            return;
+        }
+        out.copyFrom(offset_ + header_size_, children);
+        writeChildren(out);
+    }
+
+    // Payload bytes in the input, 0 for a box made in memory
+    uint64_t inputPayloadSize() const {
+        return header_size_ != 0 ? size_ - header_size_ : 0;
+    }
+
+    uint64_t childrenSize() {
+        uint64_t size = 0;
+        for (const auto &item : children_) {
+            size += item->updateSize();
+        }
+        return size;
+    }
+
+    void writeChildren(BoxWriter &out) {
+        for (const auto &item : children_) {
+            item->write(out);
+        }
+    }
+
+    void writeFullBox(BoxWriter &out, uint8_t version) const {
+        out.writeBigU32(static_cast<uint32_t>(version) << 24U | fullbox_flag_);
+    }
+
+    void writeFullBox(BoxWriter &out) const {
+        writeFullBox(out, fullbox_version_);
+    }
+
+    // Version to write for a box whose times are 64 bit in version 1
+    uint8_t timesVersion(std::initializer_list<uint64_t> times) const {
+        if (fullbox_version_ == 1 || std::max(times) > UINT32_MAX) {
+            return 1;
+        }
+        return 0;
+    }
+
+    /**
+     * Copy the rest of the input payload, from skip bytes in, for boxes that
+     * only decode the fields at its front
+     */
+    uint64_t inputTailSize(uint64_t skip) const {
+        auto size = inputPayloadSize();
+        return size > skip ? size - skip : 0;
+    }
+
+    void copyInputTail(BoxWriter &out, uint64_t skip) const {
+        out.copyFrom(offset_ + header_size_ + skip, inputTailSize(skip));
+    }
+
+    uint64_t size_ = 0;
+    uint64_t offset_ = 0;
+    uint32_t type_{};
+    ExtendedType extended_type_{};
+    uint32_t header_size_ = 0;
+
+    uint8_t fullbox_version_ = 0;
+    uint32_t fullbox_flag_ = 0;
+
+    // Set by updateSize()
+    uint64_t write_size_ = 0;
+    bool write_large_ = false;
+
+    Boxes children_;
+    Box *parent_ = nullptr;
+    friend class Stsd;
+};
+
+/**
+ * The text of dumps and detail(): "name: value" fields joined by commas,
+ * table entries one per line
+ */
+class TextDetailWriter : public DetailWriter {
+public:
+    explicit TextDetailWriter(std::string &out,
+                              uint64_t max_entries = UINT64_MAX)
+        : DetailWriter(max_entries), out_(out) {}
+
+    bool plainText() const override { return true; }
+
+    void beginBox(Box &box, int depth) override {
+        endLine();
+        out_.append(depth * 4, ' ');
+        out_ += "type ";
+        out_ += box.boxTypeStr();
+        out_ += ", offset ";
+        appendNumber(out_, box.offset());
+        out_ += ", size ";
+        appendNumber(out_, box.size());
+        out_ += ", ";
+        separate_ = false;
+        line_open_ = true;
+    }
+
+    void endBox() override { endLine(); }
+
+protected:
+    void putUnsigned(const char *name, uint64_t value) override {
+        appendName(name);
+        appendNumber(out_, value);
+    }
+
+    void putSigned(const char *name, int64_t value) override {
+        appendName(name);
+        appendNumber(out_, value);
+    }
+
+    void putHex(const char *name, uint64_t value) override {
+        appendName(name);
+        out_ += "0x";
+        appendNumber(out_, value, 16);
+    }
+
+    void putString(const char *name, const std::string &value) override {
+        appendName(name);
+        out_ += value;
+    }
+
+    // Cut at the newline that would start the line past the entry limit
+    void putText(const std::string &text) override {
+        if (separate_) out_ += ", ";
+        auto cut = text.find('\n');
+        for (uint64_t lines = 0;
+             cut != std::string::npos && lines < maxEntries(); lines++) {
+            cut = text.find('\n', cut + 1);
+        }
+        if (cut == std::string::npos) {
+            out_ += text;
+        } else {
+            out_.append(text, 0, cut);
+            out_ += " ...";
+        }
+        separate_ = true;
+    }
+
+    void putEntry(const char *table, uint64_t index) override {
+        out_ += '\n';
+        out_ += table;
+        out_ += ' ';
+        appendNumber(out_, index);
+        separate_ = true;
+    }
+
+    void putMore(const char *, uint64_t) override { out_ += " ..."; }
+
+private:
+    void appendName(const char *name) {
+        if (separate_) out_ += ", ";
+        out_ += name;
+        out_ += ": ";
+        separate_ = true;
+    }
+
+    void endLine() {
+        if (line_open_) out_ += '\n';
+        line_open_ = false;
+    }
+
+    std::string &out_;
+    bool separate_ = false;
+    bool line_open_ = false;
+};
+
+// detail() of a box that implements format()
+inline std::string formatDetail(Box &box) {
+    std::string text;
+    TextDetailWriter writer(text);
+    box.format(writer);
+    return text;
+}
+
+template <typename T>
+static std::shared_ptr<Box> toDetail(Box base) {
+    return std::static_pointer_cast<Box>(std::make_shared<T>(std::move(base)));
+}
+
+/**
+ * Table of entries made of big endian integer fields, decoded on first access
+ *
+ * Parsing only records where the table starts and how many entries it has,
+ * so listing the boxes of a file never pays for tables nobody reads. The
+ * input is kept open until then, and the whole table is decoded with one
+ * bulk read, or straight from the mapping when the input is mapped.
+ *
+ * Decoding writes to the table, so two threads must not read the same
+ * table for the first time at once.
+ */
+template <typename T>
+class LazyTable {
+public:
+    static_assert(std::is_trivially_copyable<T>::value && sizeof(T) % 4 == 0,
+                  "table entry must be made of integer fields");
+
+    /**
+     * Record a table of count entries at the position of file, and move file
+     * past it. The entry count is capped by what is left before end, so a
+     * corrupt count can't trigger a huge allocation.
+     */
+    void defer(FileOp &file, uint32_t type, uint64_t count, uint64_t end) {
+        auto pos = file.tell();
+        type_ = type;
+        count_ = count;
+        size_ = std::min<uint64_t>(count,
+                                   pos < end ? (end - pos) / sizeof(T) : 0);
+        table_.clear();
+        source_ = file.source();
+        pos_ = pos;
+        file.seek(pos + size_ * sizeof(T), SEEK_SET);
+    }
+
+    // Entries the box holds, without decoding them
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    // The entries, empty if the table couldn't be read
+    const std::vector<T> &get() const {
+        if (source_ != nullptr) {
+            decode();
+        }
+        return table_;
+    }
+
+    /**
+     * The first n entries, or all of them if there are fewer. Only those are
+     * decoded when the table hasn't been yet, so a look at the start of a
+     * huge table stays cheap.
+     */
+    std::vector<T> head(size_t n) const {
+        n = std::min<uint64_t>(n, size_);
+        if (source_ == nullptr) {
+            return std::vector<T>(table_.begin(), table_.begin() + n);
+        }
+#ifdef MOV_STATS
+        BoxTimer timer(type_, true);
+#endif
+        std::vector<T> entries(n);
+        FileOp file(source_, pos_);
+        bool ok;
+        if (std::is_same<T, uint64_t>::value) {
+            ok = file.readBigU64Array(
+                reinterpret_cast<uint64_t *>(entries.data()), n);
+        } else {
+            ok = file.readBigU32Array(
+                reinterpret_cast<uint32_t *>(entries.data()),
+                n * sizeof(T) / 4);
+        }
+        if (!ok) entries.clear();
+        return entries;
+    }
+
+    void set(std::vector<T> table) {
+        table_ = std::move(table);
+        size_ = count_ = table_.size();
+        source_ = nullptr;
+    }
+
+    /**
+     * Write the entries. A table nobody decoded is copied from the input as
+     * it is, so rewriting a box doesn't pay for its table either.
+     */
+    void write(BoxWriter &out) const {
+        if (source_ != nullptr) {
+            auto bytes = size_ * sizeof(T);
+            if (source_->readAt(pos_, out.reserve(bytes), bytes) != bytes) {
+                throw std::runtime_error("LazyTable: table read failed");
+            }
+        } else if (std::is_same<T, uint64_t>::value) {
+            out.writeBigU64Array(reinterpret_cast<const uint64_t *>(
+                                     table_.data()),
+                                 size_);
+        } else {
+            out.writeBigU32Array(reinterpret_cast<const uint32_t *>(
+                                     table_.data()),
+                                 size_ * sizeof(T) / 4);
+        }
+    }
+
+private:
+    void decode() const {
+#ifdef MOV_STATS
+        BoxTimer timer(type_, true);
+#endif
+        FileOp file(std::move(source_), pos_);
+        table_.resize(size_);
+        auto data = table_.data();
+        bool ok;
+        if (std::is_same<T, uint64_t>::value) {
+            ok = file.readBigU64Array(reinterpret_cast<uint64_t *>(data),
+                                      size_);
+        } else {
+            ok = file.readBigU32Array(reinterpret_cast<uint32_t *>(data),
+                                      size_ * sizeof(T) / 4);
+        }
+        if (!ok) {
+            table_.clear();
+            size_ = 0;
+        }
+        if (!ok || size_ != count_) {
+            std::cerr << "parse " << Box::boxType2Str(type_) << " failed\n";
+        }
+    }
+
+    uint32_t type_ = 0;
+    uint64_t count_ = 0;
+    mutable uint64_t size_ = 0;
+    uint64_t pos_ = 0;
+    mutable std::shared_ptr<ByteSource> source_;
+    mutable std::vector<T> table_;
+};
+
+class Ftyp : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("ftyp");
+
+    Ftyp(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        auto remain = size_ - (file.tell() - offset_);
+        if (remain >= 4) {
+            file.read(&major_brand_, 4, 1);
+            remain -= 4;
+        }
+        if (remain >= 4) {
+            minor_version = file.readAsBigU32().value();
+            remain -= 4;
+        }
+        remain /= 4;
+        if (remain > 0) {
+            compatible_brands_.resize(remain);
+            file.read(compatible_brands_.data(), 4 * remain, 1);
+        }
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "major brand: " << boxType2Str(major_brand_)
+           << ", minor version: " << minor_version << ", compatible_brands_: ";
+        for (const auto n : compatible_brands_) {
+            ss << boxType2Str(n) << " ";
+        }
+        return ss.str();
+    }
+
+    uint32_t majorBrand() const { return major_brand_; }
+
+private:
+    uint32_t major_brand_;
+    uint32_t minor_version = 0;
+    std::vector<uint32_t> compatible_brands_{};
+};
+
+class Mvhd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("mvhd");
+
+    Mvhd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        if (!parseFullBox(file)) {
+            std::cerr << "parse mvhd failed\n";
+            return;
+        }
+        if (fullbox_version_ == 1) {
+            creation_time_ = file.readAsBigU64().value();
+            modification_time_ = file.readAsBigU64().value();
+            timescale_ = file.readAsBigU32().value();
+            duration_ = file.readAsBigU64().value();
+        } else {
+            creation_time_ = file.readAsBigU32().value();
+            modification_time_ = file.readAsBigU32().value();
+            timescale_ = file.readAsBigU32().value();
+            duration_ = file.readAsBigU32().value();
+        }
+        rate_ = (double)file.readAsBigU32().value() / (1U << 16U);
+        volume_ = (float)file.readAsBigU16().value() / (1U << 8U);
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "creation_time: " << creation_time_
+           << ", modification_time: " << modification_time_
+           << ", timescale: " << timescale_ << ", duration: " << duration_
+           << ", " << sec2Str(duration_ / timescale_) << ", rate: " << rate_
+           << ", volume: " << volume_;
+        return ss.str();
+    }
+
+    uint32_t timescale() const { return timescale_; }
+
+    uint64_t duration() const { return duration_; }
+
+    void setDuration(uint64_t duration) { duration_ = duration; }
+
+protected:
+    // Fields after the times are copied from the input
+    uint64_t payloadSize() override {
+        auto version = timesVersion({creation_time_, modification_time_,
+                                     duration_});
+        return 4 + timesSize(version) +
+               inputTailSize(4 + timesSize(fullbox_version_));
+    }
+
+    void writePayload(BoxWriter &out) override {
+        auto version = timesVersion({creation_time_, modification_time_,
+                                     duration_});
+        writeFullBox(out, version);
+        if (version == 1) {
+            out.writeBigU64(creation_time_);
+            out.writeBigU64(modification_time_);
+            out.writeBigU32(timescale_);
+            out.writeBigU64(duration_);
+        } else {
+            out.writeBigU32(creation_time_);
+            out.writeBigU32(modification_time_);
+            out.writeBigU32(timescale_);
+            out.writeBigU32(duration_);
+        }
+        copyInputTail(out, 4 + timesSize(fullbox_version_));
+    }
+
+private:
+    static uint64_t timesSize(uint8_t version) {
+        return version == 1 ? 28 : 16;
+    }
+
+    uint64_t creation_time_ = 0;
+    uint64_t modification_time_ = 0;
+    uint32_t timescale_ = 0;
+    uint64_t duration_ = 0;
+    float rate_ = 1.0;
+    float volume_ = 1.0;
+};
+
+class Tkhd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("tkhd");
+
+    Tkhd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        if (fullbox_version_ == 1) {
+            creation_time_ = file.readAsBigU64().value();
+            modification_time_ = file.readAsBigU64().value();
+            track_id_ = file.readAsBigU32().value();
+            file.readAsBigU32();
+            duration_ = file.readAsBigU64().value();
+        } else {
+            creation_time_ = file.readAsBigU32().value();
+            modification_time_ = file.readAsBigU32().value();
+            track_id_ = file.readAsBigU32().value();
+            file.readAsBigU32();
+            duration_ = file.readAsBigU32().value();
+        }
+        file.readAsBigU64();
+        layer_ = file.readAsBigU16().value();
+        alternate_group_ = file.readAsBigU16().value();
+        volume_ = file.readAsBigU16().value() / (1 << 8);
+        file.seek(2 + 36, SEEK_CUR);
+        width_ = file.readAsBigU32().value() / (1 << 16);
+        height_ = file.readAsBigU32().value() / (1 << 16);
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "create: " << creation_time_ << ", modify: " << modification_time_
+           << ", id: " << track_id_ << ", dura: " << duration_
+           << ", layer: " << layer_ << ", alternate: " << alternate_group_
+           << ", volume: " << volume_ << ", width x height: " << width_ << " "
+           << height_;
+        return ss.str();
+    }
+
+    uint32_t trackId() const { return track_id_; }
+
+    uint64_t duration() const { return duration_; }
+
+    uint32_t width() const { return width_; }
+
+    uint32_t height() const { return height_; }
+
+    void setDuration(uint64_t duration) { duration_ = duration; }
+
+protected:
+    // Fields after the duration are copied from the input
+    uint64_t payloadSize() override {
+        auto version = timesVersion({creation_time_, modification_time_,
+                                     duration_});
+        return 4 + timesSize(version) +
+               inputTailSize(4 + timesSize(fullbox_version_));
+    }
+
+    void writePayload(BoxWriter &out) override {
+        auto version = timesVersion({creation_time_, modification_time_,
+                                     duration_});
+        writeFullBox(out, version);
+        if (version == 1) {
+            out.writeBigU64(creation_time_);
+            out.writeBigU64(modification_time_);
+            out.writeBigU32(track_id_);
+            out.writeBigU32(0);
+            out.writeBigU64(duration_);
+        } else {
+            out.writeBigU32(creation_time_);
+            out.writeBigU32(modification_time_);
+            out.writeBigU32(track_id_);
+            out.writeBigU32(0);
+            out.writeBigU32(duration_);
+        }
+        copyInputTail(out, 4 + timesSize(fullbox_version_));
+    }
+
+private:
+    static uint64_t timesSize(uint8_t version) {
+        return version == 1 ? 32 : 20;
+    }
+
+    uint64_t creation_time_ = 0;
+    uint64_t modification_time_ = 0;
+    uint32_t track_id_ = 0;
+    uint64_t duration_ = 0;
+    int16_t layer_ = 0;
+    int16_t alternate_group_ = 0;
+    int16_t volume_ = 0;
+    uint32_t width_ = 0;
+    uint32_t height_ = 0;
+};
+
+// Media Header
+class Mdhd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("mdhd");
+
+    Mdhd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        if (fullbox_version_ == 1) {
+            creation_time_ = file.readAsBigU64().value();
+            modification_time_ = file.readAsBigU64().value();
+            timescale_ = file.readAsBigU32().value();
+            duration_ = file.readAsBigU64().value();
+        } else {
+            creation_time_ = file.readAsBigU32().value();
+            modification_time_ = file.readAsBigU32().value();
+            timescale_ = file.readAsBigU32().value();
+            duration_ = file.readAsBigU32().value();
+        }
+        uint16_t lang = file.readAsBigU16().value();
+        lang_[0] = static_cast<char>((lang >> 10U) + 0x60);
+        lang_[1] = static_cast<char>(((lang >> 5U) & 0x1F) + 0x60);
+        lang_[2] = static_cast<char>((lang & 0x1F) + 0x60);
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "create: " << creation_time_ << ", modify: " << modification_time_
+           << ", timescale: " << timescale_ << ", dura: " << duration_ << ", "
+           << sec2Str(duration_ / timescale_) << ", lang: " << lang_;
+        return ss.str();
+    }
+
+    uint32_t timescale() { return timescale_; }
+
+    uint64_t duration() const { return duration_; }
+
+    const char *language() const { return lang_; }
+
+    void setDuration(uint64_t duration) { duration_ = duration; }
+
+protected:
+    // Language and the rest are copied from the input
+    uint64_t payloadSize() override {
+        auto version = timesVersion({creation_time_, modification_time_,
+                                     duration_});
+        return 4 + timesSize(version) +
+               inputTailSize(4 + timesSize(fullbox_version_));
+    }
+
+    void writePayload(BoxWriter &out) override {
+        auto version = timesVersion({creation_time_, modification_time_,
+                                     duration_});
+        writeFullBox(out, version);
+        if (version == 1) {
+            out.writeBigU64(creation_time_);
+            out.writeBigU64(modification_time_);
+            out.writeBigU32(timescale_);
+            out.writeBigU64(duration_);
+        } else {
+            out.writeBigU32(creation_time_);
+            out.writeBigU32(modification_time_);
+            out.writeBigU32(timescale_);
+            out.writeBigU32(duration_);
+        }
+        copyInputTail(out, 4 + timesSize(fullbox_version_));
+    }
+
+private:
+    static uint64_t timesSize(uint8_t version) {
+        return version == 1 ? 28 : 16;
+    }
+
+    uint64_t creation_time_ = 0;
+    uint64_t modification_time_ = 0;
+    uint32_t timescale_ = 0;
+    uint64_t duration_ = 0;
+    char lang_[4] = {};
+};
+
+// Handler reference box
+class Hdlr : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("hdlr");
+
+    Hdlr(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        file.readAsBigU32();
+        file.read(&handler_type_, sizeof(handler_type_), 1);
+        file.readAsBigU32();
+        file.readAsBigU64();
+        auto strSize = offset_ + size_ - file.tell();
+        name_.resize(strSize);
+        file.read(name_.data(), strSize, 1);
+        name_.back() = '\0';
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "handler type: " << boxType2Str(handler_type_)
+           << ", name: " << name_.data();
+        return ss.str();
+    }
+
+    uint32_t handleType() { return handler_type_; }
+
+private:
+    uint32_t handler_type_{};
+    std::vector<char> name_;
+};
+
+/**
+ * Media Information Header: Video
+ */
+class Vmhd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("vmhd");
+
+    Vmhd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        graphics_mode_ = file.readAsBigU16().value();
+        opcolor_[0] = file.readAsBigU16().value();
+        opcolor_[1] = file.readAsBigU16().value();
+        opcolor_[2] = file.readAsBigU16().value();
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "graphics_mode: " << graphics_mode_
+           << ", opcolor: " << opcolor_[0] << ", " << opcolor_[1] << ", "
+           << opcolor_[2];
+        return ss.str();
+    }
+
+private:
+    uint16_t graphics_mode_ = 0;
+    uint16_t opcolor_[3]{};
+};
+
+/**
+ * Media Information Header: Sound
+ */
+class Smhd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("smhd");
+
+    Smhd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        balance_ = file.readAsBigU16().value();
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "balance: " << balance_;
+        return ss.str();
+    }
+
+private:
+    uint16_t balance_ = 0;
+};
+
+/**
+ * Media Information Header: Hint
+ */
+class Hmhd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("hmhd");
+
+    Hmhd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        max_pdu_size_ = file.readAsBigU16().value();
+        avg_pdu_size_ = file.readAsBigU16().value();
+        max_bitrate_ = file.readAsBigU32().value();
+        avg_bitrate_ = file.readAsBigU32().value();
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "max pdu: " << max_pdu_size_ << ", avg pdu: " << avg_pdu_size_
+           << ", max bitrate: " << max_bitrate_
+           << ", avg bitrate: " << avg_bitrate_;
+        return ss.str();
+    }
+
+private:
+    uint16_t max_pdu_size_ = 0;
+    uint16_t avg_pdu_size_ = 0;
+    uint32_t max_bitrate_ = 0;
+    uint32_t avg_bitrate_ = 0;
+};
+
+class Durl : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("url ");
+
+    Durl(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        auto strSize = offset_ + size_ - file.tell();
+        if (strSize > 0) {
+            location_.resize(strSize);
+            file.read(location_.data(), strSize, 1);
+            location_.back() = '\0';
+        }
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "location: ";
+        if (location_.empty()) {
+            ss << "null";
+        } else {
+            ss << location_.data();
+        }
+        return ss.str();
+    }
+
+private:
+    std::vector<char> location_;
+};
+
+class Dref : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("dref");
+
+    // version and flags, entry count
+    static constexpr int children_offset_ = 8;
+
+    Dref(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        entry_count_ = file.readAsBigU32().value();
+        parseChild(file);
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "entry count: " << entry_count_;
+        return ss.str();
+    }
+
+protected:
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(children_.size());
+        writeChildren(out);
+    }
+
+private:
+    uint32_t entry_count_ = 0;
+};
+
+class Dinf : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("dinf");
+
+    static constexpr int children_offset_ = 0;
+
+    Dinf(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override { parseChild(file); }
+};
+
+class Mdia : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("mdia");
+
+    static constexpr int children_offset_ = 0;
+
+    Mdia(Box box) : Box(std::move(box)) {}
+
+    void parseInternal(FileOp &file) override { parseChild(file); }
+
+    uint32_t getTimeScale() {
+        if (mdhd_ != nullptr) {
+            return mdhd_->timescale();
+        }
+        auto mdhd = child<Mdhd>();
+        return mdhd != nullptr ? mdhd->timescale() : 1;
+    }
+
+    uint32_t handleType() {
+        if (hdlr_ != nullptr) {
+            return hdlr_->handleType();
+        }
+        auto hdlr = child<Hdlr>();
+        return hdlr != nullptr ? hdlr->handleType() : str2BoxType("und ");
+    }
+
+    /**
+     * Point at mdhd and hdlr for trees that don't keep them in children(),
+     * like BoxTree. The boxes must outlive this one.
+     */
+    void link(Mdhd *mdhd, Hdlr *hdlr) {
+        if (mdhd != nullptr) mdhd_ = mdhd;
+        if (hdlr != nullptr) hdlr_ = hdlr;
+    }
+
+private:
+    Mdhd *mdhd_ = nullptr;
+    Hdlr *hdlr_ = nullptr;
+};
+
+/**
+ * Decoding time to sample box
+ *
+ * The decoding time is defined in decoding time to sample box, giving time
+ * deltas between successive decoding times.
+ *
+ * The time to sample boxes must give non-zero durations for all samples with
+ * the possible exception of the last one. Durations in the 'stts' box are
+ * strictly positive (non-zero), except for the very last entry, which may be
+ * zero.
+ *
+ * indexing from decoding time => sample number
+ *
+ */
+class Stts : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("stts");
+
+    Stts(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        entry_count_ = file.readAsBigU32().value();
+        time_to_sample_table_.defer(file, type_, entry_count_, offset_ + size_);
+    }
+
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        auto mdia = ancestor<Mdia>();
+        uint32_t timescale = mdia != nullptr ? mdia->getTimeScale() : 1U;
+        if (out.plainText()) {
+            // One line past the limit tells the writer there is more
+            auto entries = time_to_sample_table_.head(
+                std::min<uint64_t>(entry_count_, out.maxEntries()) + 1);
+            std::string text = "entry: " + std::to_string(entry_count_) + '\n';
+            for (const auto &item : entries) {
+                text += "*** sample count: " +
+                        std::to_string(item.sample_count_) +
+                        " -> delta: " + std::to_string(item.sample_delta_) +
+                        ", timescale: " + std::to_string(timescale) + '\n';
+            }
+            out.text(text);
+            return;
+        }
+        out.field("entry", entry_count_);
+        out.field("timescale", timescale);
+        auto entries = time_to_sample_table_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < entries.size() && out.entry("entry", i); i++) {
+            out.field("sample count", entries[i].sample_count_);
+            out.field("delta", entries[i].sample_delta_);
+        }
+        out.more("entry", time_to_sample_table_.size() - i);
+    }
+
+    struct Entry {
+        uint32_t sample_count_;
+        uint32_t sample_delta_;
+    };
+
+    const std::vector<Entry> &entries() const {
+        return time_to_sample_table_.get();
+    }
+
+    void setEntries(std::vector<Entry> entries) {
+        time_to_sample_table_.set(std::move(entries));
+        entry_count_ = time_to_sample_table_.size();
+    }
+
+protected:
+    uint64_t payloadSize() override {
+        return 8 + time_to_sample_table_.size() * sizeof(Entry);
+    }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(time_to_sample_table_.size());
+        time_to_sample_table_.write(out);
+    }
+
+private:
+    uint32_t entry_count_ = 0;
+    LazyTable<Entry> time_to_sample_table_;
+};
+
+/**
+ * Composition time to sample box
+ *
+ * composition time offsets from decoding time.
+ */
+class Ctts : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("mvhd");
+    static const uint32_t tag_ = str2BoxType("ctts");
 
-    Mvhd(const Box &box) : Box(box) {}
+    Ctts(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
-        if (!parseFullBox(file)) {
-            std::cerr << "parse mvhd failed\n";
+        parseFullBox(file);
+        entry_count_ = file.readAsBigU32().value();
+        time_to_sample_table_.defer(file, type_, entry_count_, offset_ + size_);
+    }
+
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        auto mdia = ancestor<Mdia>();
+        uint32_t timescale = mdia != nullptr ? mdia->getTimeScale() : 1U;
+        if (out.plainText()) {
+            auto entries = time_to_sample_table_.head(
+                std::min<uint64_t>(entry_count_, out.maxEntries()) + 1);
+            std::string text = "entry: " + std::to_string(entry_count_) + '\n';
+            for (const auto &item : entries) {
+                text += "*** sample count: " +
+                        std::to_string(item.sample_count_) +
+                        " -> sample offset: " +
+                        std::to_string(item.sample_offset_) +
+                        ", timescale: " + std::to_string(timescale) + '\n';
+            }
+            out.text(text);
             return;
         }
-        if (fullbox_version_ == 1) {
-            creation_time_ = file.readAsBigU64().value();
-            modification_time_ = file.readAsBigU64().value();
-            timescale_ = file.readAsBigU32().value();
-            duration_ = file.readAsBigU64().value();
-        } else {
-            creation_time_ = file.readAsBigU32().value();
-            modification_time_ = file.readAsBigU32().value();
-            timescale_ = file.readAsBigU32().value();
-            duration_ = file.readAsBigU32().value();
+        out.field("entry", entry_count_);
+        out.field("timescale", timescale);
+        auto entries = time_to_sample_table_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < entries.size() && out.entry("entry", i); i++) {
+            out.field("sample count", entries[i].sample_count_);
+            out.field("sample offset", entries[i].sample_offset_);
         }
-        rate_ = (double)file.readAsBigU32().value() / (1U << 16U);
-        volume_ = (float)file.readAsBigU16().value() / (1U << 8U);
+        out.more("entry", time_to_sample_table_.size() - i);
+    }
+
+    struct Entry {
+        uint32_t sample_count_;
+        uint32_t sample_offset_;
+    };
+
+    const std::vector<Entry> &entries() const {
+        return time_to_sample_table_.get();
+    }
+
+    void setEntries(std::vector<Entry> entries) {
+        time_to_sample_table_.set(std::move(entries));
+        entry_count_ = time_to_sample_table_.size();
+    }
+
+protected:
+    uint64_t payloadSize() override {
+        return 8 + time_to_sample_table_.size() * sizeof(Entry);
+    }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(time_to_sample_table_.size());
+        time_to_sample_table_.write(out);
+    }
+
+private:
+    uint32_t entry_count_ = 0;
+    LazyTable<Entry> time_to_sample_table_;
+};
+
+template <typename... Ts>
+struct BoxTypeList {};
+
+// Registry key of a box class: its box type
+struct ByBoxType {
+    template <typename T>
+    static constexpr uint32_t key_ = T::tag_;
+};
+
+// Registry key of a sample entry class: the handler type of its track
+struct ByHandlerType {
+    template <typename T>
+    static constexpr uint32_t key_ = T::handler_;
+};
+
+/**
+ * Lookup from box type to detail type, generated from a list of box classes
+ *
+ * The tags go into a constexpr open addressing hash table, so finding the
+ * detail type of a box is a hash and usually one compare. Adding a box
+ * class to the list is all it takes to register it. Key picks what the
+ * classes are looked up by.
+ */
+template <typename List, typename Key = ByBoxType>
+class BoxRegistry;
+
+template <typename... Ts, typename Key>
+class BoxRegistry<BoxTypeList<Ts...>, Key> {
+public:
+    static constexpr size_t count_ = sizeof...(Ts);
+
+    // Index of type in the type list, -1 if not registered
+    static constexpr int find(uint32_t type) {
+        for (auto slot = hash(type);; slot = (slot + 1) % kSlots) {
+            if (table_[slot].index_ < 0) return -1;
+            if (table_[slot].tag_ == type) return table_[slot].index_;
+        }
+    }
+
+    static constexpr int childrenOffset(uint32_t type) {
+        auto i = find(type);
+        return i < 0 ? Box::children_offset_ : children_offsets_[i];
+    }
+
+    /**
+     * Call maker.template make<T>() with the detail type T of type, or with
+     * Box itself for types without one
+     */
+    template <typename Maker>
+    static auto visit(uint32_t type, Maker &&maker) {
+        using M = std::remove_reference_t<Maker>;
+        using R = decltype(maker.template make<Box>());
+        static constexpr R (*makers[])(M &) = {&callMake<Ts, M, R>...};
+        auto i = find(type);
+        if (i < 0) {
+            return maker.template make<Box>();
+        }
+        return makers[i](maker);
+    }
+
+private:
+    struct Slot {
+        uint32_t tag_ = 0;
+        int index_ = -1;
+    };
+
+    // At most half full
+    static constexpr size_t kSlots = [] {
+        size_t n = 1;
+        while (n < count_ * 2) n *= 2;
+        return n;
+    }();
+
+    static constexpr size_t hash(uint32_t type) {
+        return (type * 2654435761U) % kSlots;
+    }
+
+    static constexpr std::array<Slot, kSlots> buildTable() {
+        std::array<Slot, kSlots> table{};
+        constexpr uint32_t tags[] = {Key::template key_<Ts>...};
+        for (size_t i = 0; i < count_; i++) {
+            auto slot = hash(tags[i]);
+            while (table[slot].index_ >= 0) {
+                if (table[slot].tag_ == tags[i]) {
+                    throw "box type registered twice";
+                }
+                slot = (slot + 1) % kSlots;
+            }
+            table[slot] = Slot{tags[i], static_cast<int>(i)};
+        }
+        return table;
+    }
+
+    template <typename T, typename M, typename R>
+    static R callMake(M &maker) {
+        return maker.template make<T>();
+    }
+
+    static constexpr std::array<Slot, kSlots> table_ = buildTable();
+    static constexpr int children_offsets_[] = {Ts::children_offset_...};
+};
+
+// Maker for BoxRegistry::visit() that gives the detail box its own heap block
+struct SharedBoxMaker {
+    std::unique_ptr<Box> &base_;
+
+    template <typename T>
+    std::shared_ptr<Box> make() {
+        if (std::is_same<T, Box>::value) {
+            return std::move(base_);
+        }
+        return toDetail<T>(*base_);
+    }
+};
+
+class SampleEntry : public Box {
+public:
+    SampleEntry(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        file.seek(6, SEEK_CUR);
+        data_reference_index_ = file.readAsBigU16().value();
+    }
+
+protected:
+    uint16_t data_reference_index_ = 0;
+};
+
+class VideoSampleEntry : public SampleEntry {
+public:
+    static const uint32_t handler_ = str2BoxType("vide");
+
+    VideoSampleEntry(const Box &box) : SampleEntry(box) {}
+
+    void parseInternal(FileOp &file) override {
+        SampleEntry::parseInternal(file);
+        file.seek(2 + 2 + 12, SEEK_CUR);
+        width_ = file.readAsBigU16().value();
+        height_ = file.readAsBigU16().value();
+        horizresolution_ = file.readAsBigU32().value() / (1U << 16U);
+        vertresolution_ = file.readAsBigU32().value() / (1U << 16U);
+        file.readAsBigU32();
+        frame_count_ = file.readAsBigU16().value();
+        file.read(&compressor_name_len_, 1, 1);
+        compressor_name_.resize(31);
+        file.read(compressor_name_.data(), 31, 1);
+        depth_ = file.readAsBigU16().value();
+        file.readAsBigU16();
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "width: " << width_ << ", height: " << height_
+           << ", horiz resolu: " << horizresolution_
+           << ", vert resolu: " << vertresolution_
+           << ", frame cnt: " << frame_count_
+           << ", compressor name len: " << (int)compressor_name_len_;
+        if (compressor_name_len_ > 0) {
+            ss << ", compressor name: " << compressor_name_;
+        }
+        ss << ", depth: " << depth_;
+        return ss.str();
+    }
+
+    uint16_t width() const { return width_; }
+
+    uint16_t height() const { return height_; }
+
+private:
+    uint16_t width_ = 0;
+    uint16_t height_ = 0;
+    float horizresolution_ = 0;
+    float vertresolution_ = 0;
+    uint16_t frame_count_ = 1;
+    uint8_t compressor_name_len_ = 0;
+    std::string compressor_name_;
+    uint16_t depth_ = 0;
+};
+
+class AudioSampleEntry : public SampleEntry {
+public:
+    static const uint32_t handler_ = str2BoxType("soun");
+
+    AudioSampleEntry(const Box &box) : SampleEntry(box) {}
+
+    void parseInternal(FileOp &file) override {
+        SampleEntry::parseInternal(file);
+        file.readAsBigU64();
+        channel_ = file.readAsBigU16().value();
+        samplesize_ = file.readAsBigU16().value();
+        file.readAsBigU32();
+        samplerate_ = (double)file.readAsBigU32().value() / (1U << 16U);
+    }
+
+    std::string detail() override {
+        std::ostringstream ss;
+        ss << "channel: " << channel_ << ", samplesize: " << samplesize_
+           << ", samplerate: " << samplerate_;
+        return ss.str();
+    }
+
+    uint16_t channel() const { return channel_; }
+
+    float samplerate() const { return samplerate_; }
+
+private:
+    uint16_t channel_ = 2;
+    uint16_t samplesize_ = 16;
+    float samplerate_ = 0;
+};
+
+// Sample entry classes, looked up by the handler type of their track
+using SampleEntries =
+    BoxRegistry<BoxTypeList<VideoSampleEntry, AudioSampleEntry>, ByHandlerType>;
+
+/**
+ * Sample description box
+ *
+ * The sample description table gives detailed information about the coding
+ * type used, and any initialization information used for that coding.
+ */
+class Stsd : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("stsd");
+
+    // version and flags, entry count
+    static constexpr int children_offset_ = 8;
+
+    Stsd(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        entry_count_ = file.readAsBigU32().value();
+        auto end = offset_ + size_;
+        auto mdia = ancestor<Mdia>();
+        if (mdia != nullptr) {
+            handler_type_ = mdia->handleType();
+        }
+        for (uint64_t pos = file.tell(); pos < end;) {
+            auto box = parseBasic(file, pos);
+            if (box == nullptr) {
+                return;
+            }
+            box->parent_ = this;
+            auto detailBox = makeEntry(std::move(box));
+            detailBox->parse(file);
+            children_.push_back(detailBox);
+            if (detailBox->size() == 0) {
+                return;
+            }
+            pos = detailBox->offset() + detailBox->size();
+        }
+    }
+
+    std::string detail() override {
+        return std::string("entry: ") + std::to_string(entry_count_);
+    }
+
+    /**
+     * Call maker.template make<T>() with the detail type T of a sample entry,
+     * which depends on the handler type of the track rather than on the
+     * entry's own box type
+     */
+    template <typename Maker>
+    auto visitEntryType(Maker &&maker) {
+        return SampleEntries::visit(handler_type_, std::forward<Maker>(maker));
+    }
+
+    // visitEntryType() for a box that is already read
+    std::shared_ptr<Box> makeEntry(std::unique_ptr<Box> box) {
+        return visitEntryType(SharedBoxMaker{box});
+    }
+
+    // Handler of the enclosing track, which decides the sample entry type
+    uint32_t handlerType() const { return handler_type_; }
+
+protected:
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(children_.size());
+        writeChildren(out);
+    }
+
+private:
+    uint32_t entry_count_ = 0;
+    uint32_t handler_type_ = str2BoxType("und ");
+};
+
+class Stsz : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("stsz");
+
+    Stsz(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override {
+        parseFullBox(file);
+        sample_size_ = file.readAsBigU32().value();
+        sample_count_ = file.readAsBigU32().value();
+        if (sample_size_ == 0) {
+            entry_size_.defer(file, type_, sample_count_, offset_ + size_);
+        }
+    }
+
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        if (out.plainText()) {
+            auto sizes = entry_size_.head(
+                std::min<uint64_t>(entry_size_.size(), out.maxEntries()) + 1);
+            std::string text = "sample size: " + std::to_string(sample_size_) +
+                               ", count: " + std::to_string(sample_count_);
+            for (auto n : sizes) {
+                text += "\nentry size: " + std::to_string(n);
+            }
+            out.text(text);
+            return;
+        }
+        out.field("sample size", sample_size_);
+        out.field("count", sample_count_);
+        auto sizes = entry_size_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < sizes.size() && out.entry("entry", i); i++) {
+            out.field("size", sizes[i]);
+        }
+        out.more("entry", entry_size_.size() - i);
+    }
+
+    uint32_t sampleSize() const { return sample_size_; }
+
+    uint32_t sampleCount() const { return sample_count_; }
+
+    const std::vector<uint32_t> &entrySizes() const {
+        return entry_size_.get();
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "creation_time: " << creation_time_
-           << ", modification_time: " << modification_time_
-           << ", timescale: " << timescale_ << ", duration: " << duration_
-           << ", " << sec2Str(duration_ / timescale_) << ", rate: " << rate_
-           << ", volume: " << volume_;
-        return ss.str();
+    void setEntrySizes(std::vector<uint32_t> sizes) {
+        entry_size_.set(std::move(sizes));
+        sample_size_ = 0;
+        sample_count_ = entry_size_.size();
+    }
+
+    // count samples of the same size, which must not be 0
+    void setSampleSize(uint32_t size, uint32_t count) {
+        entry_size_.set({});
+        sample_size_ = size;
+        sample_count_ = count;
+    }
+
+protected:
+    uint64_t payloadSize() override {
+        return 12 + (sample_size_ == 0 ? entry_size_.size() * 4 : 0);
+    }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(sample_size_);
+        if (sample_size_ == 0) {
+            out.writeBigU32(entry_size_.size());
+            entry_size_.write(out);
+        } else {
+            out.writeBigU32(sample_count_);
+        }
     }
 
 private:
-    uint64_t creation_time_ = 0;
-    uint64_t modification_time_ = 0;
-    uint32_t timescale_ = 0;
-    uint64_t duration_ = 0;
-    float rate_ = 1.0;
-    float volume_ = 1.0;
+    uint32_t sample_size_ = 0;
+    uint32_t sample_count_ = 0;
+    LazyTable<uint32_t> entry_size_;
 };
 
-class Tkhd : public Box {
+class Stsc : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("tkhd");
+    static const uint32_t tag_ = str2BoxType("stsc");
 
-    Tkhd(const Box &box) : Box(box) {}
+    Stsc(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        if (fullbox_version_ == 1) {
-            creation_time_ = file.readAsBigU64().value();
-            modification_time_ = file.readAsBigU64().value();
-            track_id_ = file.readAsBigU32().value();
-            file.readAsBigU32();
-            duration_ = file.readAsBigU64().value();
-        } else {
-            creation_time_ = file.readAsBigU32().value();
-            modification_time_ = file.readAsBigU32().value();
-            track_id_ = file.readAsBigU32().value();
-            file.readAsBigU32();
-            duration_ = file.readAsBigU32().value();
+        entry_count_ = file.readAsBigU32().value();
+        entrys_.defer(file, type_, entry_count_, offset_ + size_);
+    }
+
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        if (out.plainText()) {
+            auto entries = entrys_.head(
+                std::min<uint64_t>(entrys_.size(), out.maxEntries()) + 1);
+            std::string text = "entry count: " + std::to_string(entry_count_);
+            for (size_t i = 0; i < entries.size(); i++) {
+                text += "\nentry " + std::to_string(i) + ", first chunk: " +
+                        std::to_string(entries[i].first_chunk_) +
+                        ", sample per chunk: " +
+                        std::to_string(entries[i].samples_per_chunk_) +
+                        ", sample description index: " +
+                        std::to_string(entries[i].sample_description_index_);
+            }
+            out.text(text);
+            return;
         }
-        file.readAsBigU64();
-        layer_ = file.readAsBigU16().value();
-        alternate_group_ = file.readAsBigU16().value();
-        volume_ = file.readAsBigU16().value() / (1 << 8);
-        file.seek(2 + 36, SEEK_CUR);
-        width_ = file.readAsBigU32().value() / (1 << 16);
-        height_ = file.readAsBigU32().value() / (1 << 16);
+        out.field("entry count", entry_count_);
+        auto entries = entrys_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < entries.size() && out.entry("entry", i); i++) {
+            out.field("first chunk", entries[i].first_chunk_);
+            out.field("sample per chunk", entries[i].samples_per_chunk_);
+            out.field("sample description index",
+                      entries[i].sample_description_index_);
+        }
+        out.more("entry", entrys_.size() - i);
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "create: " << creation_time_ << ", modify: " << modification_time_
-           << ", id: " << track_id_ << ", dura: " << duration_
-           << ", layer: " << layer_ << ", alternate: " << alternate_group_
-           << ", volume: " << volume_ << ", width x height: " << width_ << " "
-           << height_;
-        return ss.str();
+    struct Entry {
+        uint32_t first_chunk_;
+        uint32_t samples_per_chunk_;
+        uint32_t sample_description_index_;
+    };
+
+    const std::vector<Entry> &entries() const { return entrys_.get(); }
+
+    void setEntries(std::vector<Entry> entries) {
+        entrys_.set(std::move(entries));
+        entry_count_ = entrys_.size();
+    }
+
+protected:
+    uint64_t payloadSize() override {
+        return 8 + entrys_.size() * sizeof(Entry);
+    }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(entrys_.size());
+        entrys_.write(out);
     }
 
 private:
-    uint64_t creation_time_ = 0;
-    uint64_t modification_time_ = 0;
-    uint32_t track_id_ = 0;
-    uint64_t duration_ = 0;
-    int16_t layer_ = 0;
-    int16_t alternate_group_ = 0;
-    int16_t volume_ = 0;
-    uint32_t width_ = 0;
-    uint32_t height_ = 0;
+    uint32_t entry_count_ = 0;
+    LazyTable<Entry> entrys_;
 };
 
-// Media Header
-class Mdhd : public Box {
+/**
+ * Chunk offset box
+ */
+class Stco : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("mdhd");
+    static const uint32_t tag_ = str2BoxType("stco");
 
-    Mdhd(const Box &box) : Box(box) {}
+    Stco(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        if (fullbox_version_ == 1) {
-            creation_time_ = file.readAsBigU64().value();
-            modification_time_ = file.readAsBigU64().value();
-            timescale_ = file.readAsBigU32().value();
-            duration_ = file.readAsBigU64().value();
-        } else {
-            creation_time_ = file.readAsBigU32().value();
-            modification_time_ = file.readAsBigU32().value();
-            timescale_ = file.readAsBigU32().value();
-            duration_ = file.readAsBigU32().value();
+        entry_count_ = file.readAsBigU32().value();
+        chunk_offsets_.defer(file, type_, entry_count_, offset_ + size_);
+    }
+
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        if (out.plainText()) {
+            auto offsets = chunk_offsets_.head(
+                std::min<uint64_t>(chunk_offsets_.size(), out.maxEntries()) +
+                1);
+            std::string text = "entry count: " + std::to_string(entry_count_);
+            for (size_t i = 0; i < offsets.size(); i++) {
+                text += "\nentry " + std::to_string(i) + ", offset " +
+                        std::to_string(offsets[i]);
+            }
+            out.text(text);
+            return;
         }
-        uint16_t lang = file.readAsBigU16().value();
-        lang_[0] = static_cast<char>((lang >> 10U) + 0x60);
-        lang_[1] = static_cast<char>(((lang >> 5U) & 0x1F) + 0x60);
-        lang_[2] = static_cast<char>((lang & 0x1F) + 0x60);
+        out.field("entry count", entry_count_);
+        auto offsets = chunk_offsets_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < offsets.size() && out.entry("entry", i); i++) {
+            out.field("offset", offsets[i]);
+        }
+        out.more("entry", chunk_offsets_.size() - i);
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "create: " << creation_time_ << ", modify: " << modification_time_
-           << ", timescale: " << timescale_ << ", dura: " << duration_ << ", "
-           << sec2Str(duration_ / timescale_) << ", lang: " << lang_;
-        return ss.str();
+    const std::vector<uint32_t> &chunkOffsets() const {
+        return chunk_offsets_.get();
     }
 
-    uint32_t timescale() { return timescale_; }
+    void setChunkOffsets(std::vector<uint32_t> offsets) {
+        chunk_offsets_.set(std::move(offsets));
+        entry_count_ = chunk_offsets_.size();
+    }
+
+protected:
+    uint64_t payloadSize() override { return 8 + chunk_offsets_.size() * 4; }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(chunk_offsets_.size());
+        chunk_offsets_.write(out);
+    }
 
 private:
-    uint64_t creation_time_ = 0;
-    uint64_t modification_time_ = 0;
-    uint32_t timescale_ = 0;
-    uint64_t duration_ = 0;
-    char lang_[4] = {};
+    uint32_t entry_count_ = 0;
+    LazyTable<uint32_t> chunk_offsets_;
 };
 
-// Handler reference box
-class Hdlr : public Box {
+/**
+ * Sync sample box
+ */
+class Stss : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("hdlr");
+    static const uint32_t tag_ = str2BoxType("stss");
 
-    Hdlr(const Box &box) : Box(box) {}
+    Stss(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        file.readAsBigU32();
-        file.read(&handler_type_, sizeof(handler_type_), 1);
-        file.readAsBigU32();
-        file.readAsBigU64();
-        auto strSize = offset_ + size_ - file.tell();
-        name_.resize(strSize);
-        file.read(name_.data(), strSize, 1);
-        name_.back() = '\0';
+        entry_count_ = file.readAsBigU32().value();
+        sample_numbers_.defer(file, type_, entry_count_, offset_ + size_);
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "handler type: " << boxType2Str(handler_type_)
-           << ", name: " << name_.data();
-        return ss.str();
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        if (out.plainText()) {
+            auto numbers = sample_numbers_.head(
+                std::min<uint64_t>(sample_numbers_.size(), out.maxEntries()) +
+                1);
+            std::string text = "entry count: " + std::to_string(entry_count_);
+            for (size_t i = 0; i < numbers.size(); i++) {
+                text += "\nsync sample box, entry " + std::to_string(i) +
+                        ", sample: " + std::to_string(numbers[i]);
+            }
+            out.text(text);
+            return;
+        }
+        out.field("entry count", entry_count_);
+        auto numbers = sample_numbers_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < numbers.size() && out.entry("entry", i); i++) {
+            out.field("sample", numbers[i]);
+        }
+        out.more("entry", sample_numbers_.size() - i);
     }
 
-    uint32_t handleType() { return handler_type_; }
+    const std::vector<uint32_t> &sampleNumbers() const {
+        return sample_numbers_.get();
+    }
+
+    void setSampleNumbers(std::vector<uint32_t> numbers) {
+        sample_numbers_.set(std::move(numbers));
+        entry_count_ = sample_numbers_.size();
+    }
+
+protected:
+    uint64_t payloadSize() override { return 8 + sample_numbers_.size() * 4; }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(sample_numbers_.size());
+        sample_numbers_.write(out);
+    }
 
 private:
-    uint32_t handler_type_{};
-    std::vector<char> name_;
+    uint32_t entry_count_ = 0;
+    LazyTable<uint32_t> sample_numbers_;
 };
 
 /**
- * Media Information Header: Video
+ * Chunk offset box
  */
-class Vmhd : public Box {
+class Co64 : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("vmhd");
+    static const uint32_t tag_ = str2BoxType("co64");
 
-    Vmhd(const Box &box) : Box(box) {}
+    Co64(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        graphics_mode_ = file.readAsBigU16().value();
-        opcolor_[0] = file.readAsBigU16().value();
-        opcolor_[1] = file.readAsBigU16().value();
-        opcolor_[2] = file.readAsBigU16().value();
+        entry_count_ = file.readAsBigU32().value();
+        chunk_offsets_.defer(file, type_, entry_count_, offset_ + size_);
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "graphics_mode: " << graphics_mode_
-           << ", opcolor: " << opcolor_[0] << ", " << opcolor_[1] << ", "
-           << opcolor_[2];
-        return ss.str();
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        if (out.plainText()) {
+            auto offsets = chunk_offsets_.head(
+                std::min<uint64_t>(chunk_offsets_.size(), out.maxEntries()) +
+                1);
+            std::string text = "entry count: " + std::to_string(entry_count_);
+            for (size_t i = 0; i < offsets.size(); i++) {
+                text += "\nentry " + std::to_string(i) + ", offset " +
+                        std::to_string(offsets[i]);
+            }
+            out.text(text);
+            return;
+        }
+        out.field("entry count", entry_count_);
+        auto offsets = chunk_offsets_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < offsets.size() && out.entry("entry", i); i++) {
+            out.field("offset", offsets[i]);
+        }
+        out.more("entry", chunk_offsets_.size() - i);
+    }
+
+    const std::vector<uint64_t> &chunkOffsets() const {
+        return chunk_offsets_.get();
+    }
+
+    void setChunkOffsets(std::vector<uint64_t> offsets) {
+        chunk_offsets_.set(std::move(offsets));
+        entry_count_ = chunk_offsets_.size();
+    }
+
+protected:
+    uint64_t payloadSize() override { return 8 + chunk_offsets_.size() * 8; }
+
+    void writePayload(BoxWriter &out) override {
+        writeFullBox(out);
+        out.writeBigU32(chunk_offsets_.size());
+        chunk_offsets_.write(out);
     }
 
 private:
-    uint16_t graphics_mode_ = 0;
-    uint16_t opcolor_[3]{};
+    uint32_t entry_count_ = 0;
+    LazyTable<uint64_t> chunk_offsets_;
 };
 
 /**
- * Media Information Header: Sound
+ * Sample table box
  */
-class Smhd : public Box {
+class Stbl : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("smhd");
-
-    Smhd(const Box &box) : Box(box) {}
+    static const uint32_t tag_ = str2BoxType("stbl");
 
-    void parseInternal(FileOp &file) override {
-        parseFullBox(file);
-        balance_ = file.readAsBigU16().value();
-    }
+    static constexpr int children_offset_ = 0;
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "balance: " << balance_;
-        return ss.str();
-    }
+    Stbl(const Box &box) : Box(box) {}
 
-private:
-    uint16_t balance_ = 0;
+    void parseInternal(FileOp &file) override { parseChild(file); }
 };
 
 /**
- * Media Information Header: Hint
+ * Media Information Box
+ *
+ * Container: Media Box(mdia)
  */
-class Hmhd : public Box {
+class Minf : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("hmhd");
+    static const uint32_t tag_ = str2BoxType("minf");
 
-    Hmhd(const Box &box) : Box(box) {}
+    static constexpr int children_offset_ = 0;
 
-    void parseInternal(FileOp &file) override {
-        parseFullBox(file);
-        max_pdu_size_ = file.readAsBigU16().value();
-        avg_pdu_size_ = file.readAsBigU16().value();
-        max_bitrate_ = file.readAsBigU32().value();
-        avg_bitrate_ = file.readAsBigU32().value();
-    }
+    Minf(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override { parseChild(file); }
+};
+
+/**
+ * Movie extends box, present when the file has movie fragments
+ */
+class Mvex : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("mvex");
+
+    static constexpr int children_offset_ = 0;
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "max pdu: " << max_pdu_size_ << ", avg pdu: " << avg_pdu_size_
-           << ", max bitrate: " << max_bitrate_
-           << ", avg bitrate: " << avg_bitrate_;
-        return ss.str();
-    }
+    Mvex(const Box &box) : Box(box) {}
 
-private:
-    uint16_t max_pdu_size_ = 0;
-    uint16_t avg_pdu_size_ = 0;
-    uint32_t max_bitrate_ = 0;
-    uint32_t avg_bitrate_ = 0;
+    void parseInternal(FileOp &file) override { parseChild(file); }
 };
 
-class Durl : public Box {
+/**
+ * Movie extends header box, duration of the whole fragmented movie
+ */
+class Mehd : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("url ");
+    static const uint32_t tag_ = str2BoxType("mehd");
 
-    Durl(const Box &box) : Box(box) {}
+    Mehd(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        auto strSize = offset_ + size_ - file.tell();
-        if (strSize > 0) {
-            location_.resize(strSize);
-            file.read(location_.data(), strSize, 1);
-            location_.back() = '\0';
+        if (fullbox_version_ == 1) {
+            fragment_duration_ = file.readAsBigU64().value();
+        } else {
+            fragment_duration_ = file.readAsBigU32().value();
         }
     }
 
     std::string detail() override {
-        std::ostringstream ss;
-        ss << "location: ";
-        if (location_.empty()) {
-            ss << "null";
+        return "fragment duration: " + std::to_string(fragment_duration_);
+    }
+
+    uint64_t fragmentDuration() const { return fragment_duration_; }
+
+    void setFragmentDuration(uint64_t duration) {
+        fragment_duration_ = duration;
+    }
+
+protected:
+    uint64_t payloadSize() override {
+        return timesVersion({fragment_duration_}) == 1 ? 12 : 8;
+    }
+
+    void writePayload(BoxWriter &out) override {
+        auto version = timesVersion({fragment_duration_});
+        writeFullBox(out, version);
+        if (version == 1) {
+            out.writeBigU64(fragment_duration_);
         } else {
-            ss << location_.data();
+            out.writeBigU32(fragment_duration_);
         }
-        return ss.str();
     }
 
 private:
-    std::vector<char> location_;
+    uint64_t fragment_duration_ = 0;
 };
 
-class Dref : public Box {
+/**
+ * Track extends box, sample defaults for the fragments of one track
+ */
+class Trex : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("dref");
+    static const uint32_t tag_ = str2BoxType("trex");
 
-    Dref(const Box &box) : Box(box) {}
+    Trex(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        parseChild(file);
+        track_id_ = file.readAsBigU32().value();
+        default_sample_description_index_ = file.readAsBigU32().value();
+        default_sample_duration_ = file.readAsBigU32().value();
+        default_sample_size_ = file.readAsBigU32().value();
+        default_sample_flags_ = file.readAsBigU32().value();
     }
 
     std::string detail() override {
         std::ostringstream ss;
-        ss << "entry count: " << entry_count_;
+        ss << "track id: " << track_id_ << ", default sample description: "
+           << default_sample_description_index_
+           << ", duration: " << default_sample_duration_
+           << ", size: " << default_sample_size_ << ", flags: 0x" << std::hex
+           << default_sample_flags_;
         return ss.str();
     }
 
-private:
-    uint32_t entry_count_ = 0;
-};
+    uint32_t trackId() const { return track_id_; }
 
-class Dinf : public Box {
-public:
-    static const uint32_t tag_ = str2BoxType("dinf");
+    uint32_t defaultSampleDuration() const { return default_sample_duration_; }
 
-    Dinf(const Box &box) : Box(box) {}
+    uint32_t defaultSampleSize() const { return default_sample_size_; }
 
-    void parseInternal(FileOp &file) override { parseChild(file); }
+    uint32_t defaultSampleFlags() const { return default_sample_flags_; }
+
+private:
+    uint32_t track_id_ = 0;
+    uint32_t default_sample_description_index_ = 0;
+    uint32_t default_sample_duration_ = 0;
+    uint32_t default_sample_size_ = 0;
+    uint32_t default_sample_flags_ = 0;
 };
 
-class Mdia : public Box {
+/**
+ * Movie fragment box
+ */
+class Moof : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("mdia");
-
-    Mdia(Box box) : Box(std::move(box)) {}
+    static const uint32_t tag_ = str2BoxType("moof");
 
-    void parseInternal(FileOp &file) override { parseChild(file); }
+    static constexpr int children_offset_ = 0;
 
-    uint32_t getTimeScale() {
-        for (const auto &item : children_) {
-            if (item->baseType() == str2BoxType("mdhd")) {
-                return dynamic_cast<Mdhd *>(item.get())->timescale();
-            }
-        }
-        return 1;
-    }
+    Moof(const Box &box) : Box(box) {}
 
-    uint32_t handleType() {
-        for (const auto &item : children_) {
-            if (item->baseType() == str2BoxType("hdlr")) {
-                return dynamic_cast<Hdlr *>(item.get())->handleType();
-            }
-        }
-        return str2BoxType("und ");
-    }
+    void parseInternal(FileOp &file) override { parseChild(file); }
 };
 
 /**
- * Decoding time to sample box
- *
- * The decoding time is defined in decoding time to sample box, giving time
- * deltas between successive decoding times.
- *
- * The time to sample boxes must give non-zero durations for all samples with
- * the possible exception of the last one. Durations in the 'stts' box are
- * strictly positive (non-zero), except for the very last entry, which may be
- * zero.
- *
- * indexing from decoding time => sample number
- *
+ * Movie fragment header box
  */
-class Stts : public Box {
+class Mfhd : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("stts");
+    static const uint32_t tag_ = str2BoxType("mfhd");
 
-    Stts(const Box &box) : Box(box) {}
+    Mfhd(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        for (unsigned i = 0; i < entry_count_; i++) {
-            auto count = file.readAsBigU32().value();
-            auto delta = file.readAsBigU32().value();
-            time_to_sample_table_.emplace_back(count, delta);
-        }
+        sequence_number_ = file.readAsBigU32().value();
     }
 
     std::string detail() override {
-        std::ostringstream ss;
-        ss << "entry: " << entry_count_ << '\n';
-        auto mdia = getAncestor(str2BoxType("mdia"));
-        uint32_t timescale = 1;
-        if (mdia != nullptr) {
-            timescale = dynamic_cast<Mdia *>(mdia)->getTimeScale();
-        }
-        for (const auto &item : time_to_sample_table_) {
-            ss << "*** sample count: " << item.first << " -> "
-               << "delta: " << item.second << ", timescale: " << timescale
-               << '\n';
-        }
-        return ss.str();
+        return "sequence number: " + std::to_string(sequence_number_);
     }
 
+    uint32_t sequenceNumber() const { return sequence_number_; }
+
 private:
-    uint32_t entry_count_ = 0;
-    std::vector<std::pair<uint32_t, uint32_t>> time_to_sample_table_;
+    uint32_t sequence_number_ = 0;
 };
 
 /**
- * Composition time to sample box
+ * Track fragment box
+ */
+class Traf : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("traf");
+
+    static constexpr int children_offset_ = 0;
+
+    Traf(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override { parseChild(file); }
+};
+
+/**
+ * Track fragment header box
  *
- * composition time offsets from decoding time.
+ * Every field after the track id is optional. The ones left out fall back
+ * to trex.
  */
-class Ctts : public Box {
+class Tfhd : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("ctts");
+    static const uint32_t tag_ = str2BoxType("tfhd");
 
-    Ctts(const Box &box) : Box(box) {}
+    // Flags telling which fields are present
+    static const uint32_t kBaseDataOffset = 0x1;
+    static const uint32_t kSampleDescriptionIndex = 0x2;
+    static const uint32_t kDefaultSampleDuration = 0x8;
+    static const uint32_t kDefaultSampleSize = 0x10;
+    static const uint32_t kDefaultSampleFlags = 0x20;
+    static const uint32_t kDurationIsEmpty = 0x10000;
+    static const uint32_t kDefaultBaseIsMoof = 0x20000;
+
+    Tfhd(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        for (unsigned i = 0; i < entry_count_; i++) {
-            auto count = file.readAsBigU32().value();
-            auto delta = file.readAsBigU32().value();
-            time_to_sample_table_.emplace_back(count, delta);
+        track_id_ = file.readAsBigU32().value();
+        if (fullbox_flag_ & kBaseDataOffset) {
+            base_data_offset_ = file.readAsBigU64().value();
+        }
+        if (fullbox_flag_ & kSampleDescriptionIndex) {
+            sample_description_index_ = file.readAsBigU32().value();
+        }
+        if (fullbox_flag_ & kDefaultSampleDuration) {
+            default_sample_duration_ = file.readAsBigU32().value();
+        }
+        if (fullbox_flag_ & kDefaultSampleSize) {
+            default_sample_size_ = file.readAsBigU32().value();
+        }
+        if (fullbox_flag_ & kDefaultSampleFlags) {
+            default_sample_flags_ = file.readAsBigU32().value();
         }
     }
 
     std::string detail() override {
         std::ostringstream ss;
-        ss << "entry: " << entry_count_ << '\n';
-        auto mdia = getAncestor(str2BoxType("mdia"));
-        uint32_t timescale = 1;
-        if (mdia != nullptr) {
-            timescale = dynamic_cast<Mdia *>(mdia)->getTimeScale();
+        ss << "track id: " << track_id_;
+        if (base_data_offset_.has_value()) {
+            ss << ", base data offset: " << base_data_offset_.value();
+        }
+        if (sample_description_index_.has_value()) {
+            ss << ", sample description: "
+               << sample_description_index_.value();
+        }
+        if (default_sample_duration_.has_value()) {
+            ss << ", default duration: " << default_sample_duration_.value();
         }
-        for (const auto &item : time_to_sample_table_) {
-            ss << "*** sample count: " << item.first << " -> "
-               << "sample offset: " << item.second
-               << ", timescale: " << timescale << '\n';
+        if (default_sample_size_.has_value()) {
+            ss << ", default size: " << default_sample_size_.value();
+        }
+        if (default_sample_flags_.has_value()) {
+            ss << ", default flags: 0x" << std::hex
+               << default_sample_flags_.value() << std::dec;
+        }
+        if (fullbox_flag_ & kDefaultBaseIsMoof) {
+            ss << ", default base is moof";
         }
         return ss.str();
     }
 
-private:
-    uint32_t entry_count_ = 0;
-    std::vector<std::pair<uint32_t, uint32_t>> time_to_sample_table_;
-};
-
-class SampleEntry : public Box {
-public:
-    SampleEntry(const Box &box) : Box(box) {}
+    uint32_t trackId() const { return track_id_; }
 
-    void parseInternal(FileOp &file) override {
-        file.seek(6, SEEK_CUR);
-        data_reference_index_ = file.readAsBigU16().value();
+    bool defaultBaseIsMoof() const {
+        return fullbox_flag_ & kDefaultBaseIsMoof;
     }
 
-protected:
-    uint16_t data_reference_index_ = 0;
-};
+    const std::optional<uint64_t> &baseDataOffset() const {
+        return base_data_offset_;
+    }
 
-class VideoSampleEntry : public SampleEntry {
-public:
-    VideoSampleEntry(const Box &box) : SampleEntry(box) {}
+    const std::optional<uint32_t> &defaultSampleDuration() const {
+        return default_sample_duration_;
+    }
 
-    void parseInternal(FileOp &file) override {
-        SampleEntry::parseInternal(file);
-        file.seek(2 + 2 + 12, SEEK_CUR);
-        width_ = file.readAsBigU16().value();
-        height_ = file.readAsBigU16().value();
-        horizresolution_ = file.readAsBigU32().value() / (1U << 16U);
-        vertresolution_ = file.readAsBigU32().value() / (1U << 16U);
-        file.readAsBigU32();
-        frame_count_ = file.readAsBigU16().value();
-        file.read(&compressor_name_len_, 1, 1);
-        compressor_name_.resize(31);
-        file.read(compressor_name_.data(), 31, 1);
-        depth_ = file.readAsBigU16().value();
-        file.readAsBigU16();
+    const std::optional<uint32_t> &defaultSampleSize() const {
+        return default_sample_size_;
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "width: " << width_ << ", height: " << height_
-           << ", horiz resolu: " << horizresolution_
-           << ", vert resolu: " << vertresolution_
-           << ", frame cnt: " << frame_count_
-           << ", compressor name len: " << (int)compressor_name_len_;
-        if (compressor_name_len_ > 0) {
-            ss << ", compressor name: " << compressor_name_;
-        }
-        ss << ", depth: " << depth_;
-        return ss.str();
+    const std::optional<uint32_t> &defaultSampleFlags() const {
+        return default_sample_flags_;
     }
 
 private:
-    uint16_t width_ = 0;
-    uint16_t height_ = 0;
-    float horizresolution_ = 0;
-    float vertresolution_ = 0;
-    uint16_t frame_count_ = 1;
-    uint8_t compressor_name_len_ = 0;
-    std::string compressor_name_;
-    uint16_t depth_ = 0;
+    uint32_t track_id_ = 0;
+    std::optional<uint64_t> base_data_offset_;
+    std::optional<uint32_t> sample_description_index_;
+    std::optional<uint32_t> default_sample_duration_;
+    std::optional<uint32_t> default_sample_size_;
+    std::optional<uint32_t> default_sample_flags_;
 };
 
-class AudioSampleEntry : public SampleEntry {
+/**
+ * Track fragment decode time box, decoding time of the first sample
+ */
+class Tfdt : public Box {
 public:
-    AudioSampleEntry(const Box &box) : SampleEntry(box) {}
+    static const uint32_t tag_ = str2BoxType("tfdt");
+
+    Tfdt(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
-        SampleEntry::parseInternal(file);
-        file.readAsBigU64();
-        channel_ = file.readAsBigU16().value();
-        samplesize_ = file.readAsBigU16().value();
-        file.readAsBigU32();
-        samplerate_ = (double)file.readAsBigU32().value() / (1U << 16U);
+        parseFullBox(file);
+        if (fullbox_version_ == 1) {
+            base_media_decode_time_ = file.readAsBigU64().value();
+        } else {
+            base_media_decode_time_ = file.readAsBigU32().value();
+        }
     }
 
     std::string detail() override {
-        std::ostringstream ss;
-        ss << "channel: " << channel_ << ", samplesize: " << samplesize_
-           << ", samplerate: " << samplerate_;
-        return ss.str();
+        return "base media decode time: " +
+               std::to_string(base_media_decode_time_);
+    }
+
+    uint64_t baseMediaDecodeTime() const { return base_media_decode_time_; }
+
+    void setBaseMediaDecodeTime(uint64_t time) {
+        base_media_decode_time_ = time;
+    }
+
+protected:
+    uint64_t payloadSize() override {
+        return timesVersion({base_media_decode_time_}) == 1 ? 12 : 8;
+    }
+
+    void writePayload(BoxWriter &out) override {
+        auto version = timesVersion({base_media_decode_time_});
+        writeFullBox(out, version);
+        if (version == 1) {
+            out.writeBigU64(base_media_decode_time_);
+        } else {
+            out.writeBigU32(base_media_decode_time_);
+        }
     }
 
 private:
-    uint16_t channel_ = 2;
-    uint16_t samplesize_ = 16;
-    float samplerate_ = 0;
+    uint64_t base_media_decode_time_ = 0;
 };
 
 /**
- * Sample description box
+ * Track fragment run box
  *
- * The sample description table gives detailed information about the coding
- * type used, and any initialization information used for that coding.
+ * Each sample has only the fields named by the box flags, in a fixed
+ * order. The rest come from tfhd or trex. The per sample words are decoded
+ * on first access, like the sample tables.
  */
-class Stsd : public Box {
+class Trun : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("stsd");
+    static const uint32_t tag_ = str2BoxType("trun");
 
-    Stsd(const Box &box) : Box(box) {}
+    static const uint32_t kDataOffset = 0x1;
+    static const uint32_t kFirstSampleFlags = 0x4;
+    static const uint32_t kSampleDuration = 0x100;
+    static const uint32_t kSampleSize = 0x200;
+    static const uint32_t kSampleFlags = 0x400;
+    static const uint32_t kSampleCompositionOffset = 0x800;
+
+    // Set in sample flags for samples that are not sync samples
+    static const uint32_t kSampleIsNonSync = 0x10000;
+
+    static constexpr size_t kMaxImplicitSamples = 1 << 20;
+
+    struct Sample {
+        uint32_t duration_ = 0;
+        uint32_t size_ = 0;
+        uint32_t flags_ = 0;
+        int32_t composition_offset_ = 0;
+    };
+
+    Trun(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        auto end = offset_ + size_;
-        auto mdia = getAncestor(str2BoxType("mdia"));
-        auto handleType = dynamic_cast<Mdia *>(mdia)->handleType();
-        while (file.tell() < end) {
-            auto box = parseBasic(file);
-            if (box == nullptr) {
-                return;
+        sample_count_ = file.readAsBigU32().value();
+        if (fullbox_flag_ & kDataOffset) {
+            data_offset_ = static_cast<int32_t>(file.readAsBigU32().value());
+        }
+        if (fullbox_flag_ & kFirstSampleFlags) {
+            first_sample_flags_ = file.readAsBigU32().value();
+        }
+        values_.defer(file, type_, uint64_t(sample_count_) * stride(),
+                      offset_ + size_);
+    }
+
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        out.field("sample count", sample_count_);
+        if (data_offset_.has_value()) {
+            out.field("data offset", data_offset_.value());
+        }
+        if (first_sample_flags_.has_value()) {
+            out.hexField("first sample flags", first_sample_flags_.value());
+        }
+        auto stride = std::max(this->stride(), 1U);
+        auto count = values_.size() / stride;
+        auto values = values_.head(std::min<uint64_t>(count, out.maxEntries()) *
+                                   stride);
+        auto words = values.data();
+        size_t i = 0;
+        for (; i < values.size() / stride && out.entry("sample", i);
+             i++, words += stride) {
+            auto word = words;
+            if (fullbox_flag_ & kSampleDuration) {
+                out.field("duration", *word++);
             }
-            box->parent_ = this;
-            std::shared_ptr<Box> detailBox;
-            if (handleType == str2BoxType("vide")) {
-                detailBox = toDetail<VideoSampleEntry>(*box);
-            } else if (handleType == str2BoxType("soun")) {
-                detailBox = toDetail<AudioSampleEntry>(*box);
-            } else {
-                detailBox = std::move(box);
+            if (fullbox_flag_ & kSampleSize) {
+                out.field("size", *word++);
+            }
+            if (fullbox_flag_ & kSampleFlags) {
+                out.hexField("flags", *word++);
+            }
+            if (fullbox_flag_ & kSampleCompositionOffset) {
+                out.field("composition offset", static_cast<int32_t>(*word));
             }
-            detailBox->parseInternal(file);
-            children_.push_back(detailBox);
-            file.seek(detailBox->offset() + detailBox->size(), SEEK_SET);
         }
+        out.more("sample", count - i);
     }
 
-    std::string detail() override {
-        return std::string("entry: ") + std::to_string(entry_count_);
+    uint32_t sampleCount() const { return sample_count_; }
+
+    const std::optional<int32_t> &dataOffset() const { return data_offset_; }
+
+    /**
+     * Expand the run, taking the fields a sample doesn't have from defaults.
+     * Truncated runs come back short.
+     */
+    std::vector<Sample> samples(const Sample &defaults) const {
+        std::vector<Sample> samples;
+        auto &values = values_.get();
+        // Without per sample fields nothing in the box bounds the count
+        auto n = stride() == 0
+                     ? std::min<size_t>(sample_count_, kMaxImplicitSamples)
+                     : values.size() / stride();
+        samples.resize(n, defaults);
+        auto word = values.data();
+        for (auto &sample : samples) {
+            if (fullbox_flag_ & kSampleDuration) sample.duration_ = *word++;
+            if (fullbox_flag_ & kSampleSize) sample.size_ = *word++;
+            if (fullbox_flag_ & kSampleFlags) sample.flags_ = *word++;
+            if (fullbox_flag_ & kSampleCompositionOffset) {
+                sample.composition_offset_ = static_cast<int32_t>(*word++);
+            }
+        }
+        if (!samples.empty() && first_sample_flags_.has_value() &&
+            !(fullbox_flag_ & kSampleFlags)) {
+            samples[0].flags_ = first_sample_flags_.value();
+        }
+        return samples;
     }
 
 private:
-    uint32_t entry_count_ = 0;
+    // Words per sample
+    uint32_t stride() const {
+        return __builtin_popcount(fullbox_flag_ & 0xF00U);
+    }
+
+    uint32_t sample_count_ = 0;
+    std::optional<int32_t> data_offset_;
+    std::optional<uint32_t> first_sample_flags_;
+    LazyTable<uint32_t> values_;
 };
 
-class Stsz : public Box {
-public:
-    static const uint32_t tag_ = str2BoxType("stsz");
+/**
+ * Segment index box
+ *
+ * Each reference covers one subsegment, or another sidx when the index is
+ * hierarchical. Subsegments follow each other from first offset on, counted
+ * from the end of this box.
+ */
+class Sidx : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("sidx");
+
+    struct Reference {
+        // Top bit set for references to another sidx, the rest is the size
+        uint32_t type_size_;
+        uint32_t subsegment_duration_;
+        // starts_with_SAP, SAP_type and SAP_delta_time
+        uint32_t sap_;
+
+        bool isIndex() const { return type_size_ >> 31U; }
+
+        uint32_t size() const { return type_size_ & 0x7FFFFFFFU; }
+
+        bool startsWithSap() const { return sap_ >> 31U; }
+    };
 
-    Stsz(const Box &box) : Box(box) {}
+    Sidx(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        sample_size_ = file.readAsBigU32().value();
-        sample_count_ = file.readAsBigU32().value();
-        if (sample_size_ == 0) {
-            for (uint32_t i = 0; i < sample_count_; i++) {
-                entry_size_.push_back(file.readAsBigU32().value());
-            }
+        reference_id_ = file.readAsBigU32().value();
+        timescale_ = file.readAsBigU32().value();
+        if (fullbox_version_ == 0) {
+            earliest_presentation_time_ = file.readAsBigU32().value();
+            first_offset_ = file.readAsBigU32().value();
+        } else {
+            earliest_presentation_time_ = file.readAsBigU64().value();
+            first_offset_ = file.readAsBigU64().value();
         }
+        file.readAsBigU16();
+        auto count = file.readAsBigU16().value();
+        references_.defer(file, type_, count, offset_ + size_);
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "sample size: " << sample_size_ << ", count: " << sample_count_;
-        if (!entry_size_.empty()) {
-            for (auto n : entry_size_) {
-                ss << "\nentry size: " << n;
-            }
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        out.field("reference id", reference_id_);
+        out.field("timescale", timescale_);
+        out.field("earliest presentation time", earliest_presentation_time_);
+        out.field("first offset", first_offset_);
+        out.field("reference count", references_.size());
+        auto references = references_.head(out.maxEntries());
+        size_t i = 0;
+        for (; i < references.size() && out.entry("reference", i); i++) {
+            const auto &ref = references[i];
+            out.field("type", ref.isIndex());
+            out.field("size", ref.size());
+            out.field("duration", ref.subsegment_duration_);
+            out.field("starts with sap", ref.startsWithSap());
         }
-        return ss.str();
+        out.more("reference", references_.size() - i);
+    }
+
+    uint32_t referenceId() const { return reference_id_; }
+
+    uint32_t timescale() const { return timescale_; }
+
+    uint64_t earliestPresentationTime() const {
+        return earliest_presentation_time_;
+    }
+
+    // Offset of the first subsegment
+    uint64_t firstOffset() const { return offset_ + size_ + first_offset_; }
+
+    const std::vector<Reference> &references() const {
+        return references_.get();
     }
 
 private:
-    uint32_t sample_size_ = 0;
-    uint32_t sample_count_ = 0;
-    std::vector<uint32_t> entry_size_;
+    uint32_t reference_id_ = 0;
+    uint32_t timescale_ = 1;
+    uint64_t earliest_presentation_time_ = 0;
+    uint64_t first_offset_ = 0;
+    LazyTable<Reference> references_;
 };
 
-class Stsc : public Box {
+/**
+ * Movie fragment random access box, usually at the end of the file
+ */
+class Mfra : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("stsc");
+    static const uint32_t tag_ = str2BoxType("mfra");
 
-    Stsc(const Box &box) : Box(box) {}
+    static constexpr int children_offset_ = 0;
+
+    Mfra(const Box &box) : Box(box) {}
+
+    void parseInternal(FileOp &file) override { parseChild(file); }
+};
+
+/**
+ * Track fragment random access box, sync sample times of one track with
+ * the moof that holds them
+ */
+class Tfra : public Box {
+public:
+    static const uint32_t tag_ = str2BoxType("tfra");
+
+    struct Entry {
+        uint64_t time_;
+        uint64_t moof_offset_;
+        uint32_t traf_number_;
+        uint32_t trun_number_;
+        uint32_t sample_number_;
+    };
+
+    Tfra(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        for (uint32_t i = 0; i < entry_count_; i++) {
-            entrys_.push_back(Entry{file.readAsBigU32().value(),
-                                    file.readAsBigU32().value(),
-                                    file.readAsBigU32().value()});
+        track_id_ = file.readAsBigU32().value();
+        auto sizes = file.readAsBigU32().value();
+        uint32_t count = file.readAsBigU32().value();
+        size_t traf_size = (sizes >> 4U & 3U) + 1;
+        size_t trun_size = (sizes >> 2U & 3U) + 1;
+        size_t sample_size = (sizes & 3U) + 1;
+        size_t time_size = fullbox_version_ == 1 ? 8 : 4;
+        size_t entry_size = time_size * 2 + traf_size + trun_size + sample_size;
+
+        auto end = offset_ + size_;
+        auto pos = file.tell();
+        auto n = std::min<uint64_t>(count, pos < end ? (end - pos) / entry_size
+                                                     : 0);
+        auto buf = file.span(n * entry_size);
+        n = buf.size() / entry_size;
+        entries_.resize(n);
+        size_t p = 0;
+        auto readN = [&buf, &p](size_t bytes) {
+            uint64_t v = 0;
+            for (size_t i = 0; i < bytes; i++) v = v << 8U | buf.u8(p++);
+            return v;
+        };
+        for (auto &entry : entries_) {
+            entry.time_ = readN(time_size);
+            entry.moof_offset_ = readN(time_size);
+            entry.traf_number_ = readN(traf_size);
+            entry.trun_number_ = readN(trun_size);
+            entry.sample_number_ = readN(sample_size);
+        }
+        if (n != count) {
+            std::cerr << "parse tfra failed\n";
         }
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "entry count: " << entry_count_;
-        int i = 0;
-        for (const auto &entry : entrys_) {
-            ss << "\nentry " << i << ", first chunk: " << entry.first_chunk_
-               << ", sample per chunk: " << entry.samples_per_chunk_
-               << ", sample description index: "
-               << entry.sample_description_index_;
-            ++i;
+    std::string detail() override { return formatDetail(*this); }
+
+    void format(DetailWriter &out) override {
+        out.field("track id", track_id_);
+        out.field("entry count", entries_.size());
+        size_t i = 0;
+        for (; i < entries_.size() && out.entry("entry", i); i++) {
+            const auto &entry = entries_[i];
+            out.field("time", entry.time_);
+            out.field("moof offset", entry.moof_offset_);
+            out.field("traf", entry.traf_number_);
+            out.field("trun", entry.trun_number_);
+            out.field("sample", entry.sample_number_);
         }
-        return ss.str();
+        out.more("entry", entries_.size() - i);
     }
 
-    struct Entry {
-        uint32_t first_chunk_;
-        uint32_t samples_per_chunk_;
-        uint32_t sample_description_index_;
-    };
+    uint32_t trackId() const { return track_id_; }
+
+    const std::vector<Entry> &entries() const { return entries_; }
 
 private:
-    uint32_t entry_count_ = 0;
-    std::vector<Entry> entrys_;
+    uint32_t track_id_ = 0;
+    std::vector<Entry> entries_;
 };
 
 /**
- * Chunk offset box
+ * Movie fragment random access offset box, the last box of a file with mfra
  */
-class Stco : public Box {
+class Mfro : public Box {
 public:
-    static const uint32_t tag_ = str2BoxType("stco");
+    static const uint32_t tag_ = str2BoxType("mfro");
 
-    Stco(const Box &box) : Box(box) {}
+    Mfro(const Box &box) : Box(box) {}
 
     void parseInternal(FileOp &file) override {
         parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        for (uint32_t i = 0; i < entry_count_; i++) {
-            chunk_offsets_.push_back(file.readAsBigU32().value());
-        }
+        mfra_size_ = file.readAsBigU32().value();
     }
 
     std::string detail() override {
-        std::ostringstream ss;
-        ss << "entry count: " << entry_count_;
-        for (uint32_t i = 0, len = chunk_offsets_.size(); i < len; i++) {
-            ss << "\nentry " << i << ", offset " << chunk_offsets_[i];
-        }
-        return ss.str();
+        return "mfra size: " + std::to_string(mfra_size_);
     }
 
+    uint32_t mfraSize() const { return mfra_size_; }
+
 private:
-    uint32_t entry_count_ = 0;
-    std::vector<uint32_t> chunk_offsets_;
+    uint32_t mfra_size_ = 0;
 };
 
 /**
- * Sync sample box
+ * Read only view of an array stored elsewhere
  */
-class Stss : public Box {
+template <typename T>
+class ArrayView {
 public:
-    static const uint32_t tag_ = str2BoxType("stss");
+    ArrayView() = default;
 
-    Stss(const Box &box) : Box(box) {}
+    ArrayView(const T *data, size_t size) : data_(data), size_(size) {}
 
-    void parseInternal(FileOp &file) override {
-        parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        for (unsigned i = 0; i < entry_count_; i++) {
-            sample_numbers_.push_back(file.readAsBigU32().value());
-        }
-    }
+    ArrayView(const std::vector<T> &v) : data_(v.data()), size_(v.size()) {}
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "entry count: " << entry_count_;
-        for (unsigned i = 0, n = sample_numbers_.size(); i < n; i++) {
-            ss << "\nsync sample box, entry " << i
-               << ", sample: " << sample_numbers_[i];
-        }
+    const T *data() const { return data_; }
 
-        return ss.str();
-    }
+    size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    const T *begin() const { return data_; }
+
+    const T *end() const { return data_ + size_; }
+
+    const T &operator[](size_t i) const { return data_[i]; }
 
 private:
-    uint32_t entry_count_ = 0;
-    std::vector<uint32_t> sample_numbers_;
+    const T *data_ = nullptr;
+    size_t size_ = 0;
 };
 
 /**
- * Chunk offset box
+ * Per sample view of one track
+ *
+ * stts, ctts, stsc, stco/co64, stsz and stss are expanded once into one
+ * contiguous array per field, so every lookup is an index into plain arrays.
+ * Samples are indexed from 0, one less than the sample number used by the
+ * boxes themselves. The samples of movie fragments are appended after the
+ * ones in moov.
+ *
+ * The arrays can also live outside the index, in a mapped index cache for
+ * one, see assign(). Copies share the arrays until one of them changes.
  */
-class Co64 : public Box {
+class TrackIndex {
 public:
-    static const uint32_t tag_ = str2BoxType("co64");
+    // The arrays of an index, sync_ holds one bit per sample
+    struct Tables {
+        ArrayView<uint64_t> offsets_;
+        ArrayView<uint32_t> sizes_;
+        ArrayView<uint64_t> dts_;
+        ArrayView<int32_t> cts_delta_;
+        ArrayView<uint64_t> sync_;
+    };
 
-    Co64(const Box &box) : Box(box) {}
+    /**
+     * Expand the sample tables under stbl, in time linear to the number of
+     * samples. Return false if a mandatory box is missing.
+     */
+    bool build(Box &stbl, uint32_t timescale) {
+        auto stsz = stbl.child<Stsz>();
+        auto stts = stbl.child<Stts>();
+        auto stsc = stbl.child<Stsc>();
+        auto stco = stbl.child<Stco>();
+        auto co64 = stbl.child<Co64>();
+        if (stsz == nullptr || stts == nullptr || stsc == nullptr ||
+            (stco == nullptr && co64 == nullptr)) {
+            return false;
+        }
+        timescale_ = timescale;
+        auto count = stsz->sampleCount();
+        columns_ = std::make_shared<Columns>();
+        hold_.reset();
+        auto &c = *columns_;
+
+        c.sizes_.assign(count, stsz->sampleSize());
+        if (stsz->sampleSize() == 0) {
+            auto &entry_size = stsz->entrySizes();
+            auto n = std::min<size_t>(count, entry_size.size());
+            std::copy_n(entry_size.begin(), n, c.sizes_.begin());
+        }
 
-    void parseInternal(FileOp &file) override {
-        parseFullBox(file);
-        entry_count_ = file.readAsBigU32().value();
-        for (uint32_t i = 0; i < entry_count_; i++) {
-            chunk_offsets_.push_back(file.readAsBigU64().value());
+        c.dts_.resize(count);
+        size_t i = 0;
+        uint64_t dts = 0;
+        for (const auto &entry : stts->entries()) {
+            auto end = std::min<size_t>(count, i + entry.sample_count_);
+            for (; i < end; i++) {
+                c.dts_[i] = dts;
+                dts += entry.sample_delta_;
+            }
+        }
+        for (; i < count; i++) {
+            c.dts_[i] = dts;
+        }
+        next_dts_ = dts;
+
+        c.cts_delta_.assign(count, 0);
+        auto ctts = stbl.child<Ctts>();
+        if (ctts != nullptr) {
+            i = 0;
+            for (const auto &entry : ctts->entries()) {
+                auto end = std::min<size_t>(count, i + entry.sample_count_);
+                std::fill(c.cts_delta_.begin() + i, c.cts_delta_.begin() + end,
+                          static_cast<int32_t>(entry.sample_offset_));
+                i = end;
+            }
+        }
+
+        if (stco != nullptr) {
+            auto &offsets = stco->chunkOffsets();
+            expandChunks(stsc->entries(), offsets.data(), offsets.size());
+        } else {
+            auto &offsets = co64->chunkOffsets();
+            expandChunks(stsc->entries(), offsets.data(), offsets.size());
+        }
+
+        auto stss = stbl.child<Stss>();
+        c.sync_.assign((count + 63) / 64, stss == nullptr ? ~0ULL : 0);
+        if (stss != nullptr) {
+            for (auto number : stss->sampleNumbers()) {
+                if (number >= 1 && number <= count) {
+                    c.sync_[(number - 1) / 64] |= 1ULL << ((number - 1) % 64);
+                }
+            }
         }
+        refresh();
+        return true;
     }
 
-    std::string detail() override {
-        std::ostringstream ss;
-        ss << "entry count: " << entry_count_;
-        for (uint32_t i = 0, len = chunk_offsets_.size(); i < len; i++) {
-            ss << "\nentry " << i << ", offset " << chunk_offsets_[i];
+    /**
+     * Append the samples of one track fragment. moof_offset is where the
+     * enclosing moof starts, and trex, if given, has the defaults that tfhd
+     * leaves out. data_end is where the data of the previous traf of the
+     * moof ends, moof_offset before the first one, and is moved past the
+     * data of this one. Without tfdt the fragment starts where the samples
+     * so far end.
+     */
+    void appendFragment(const Traf &traf, const Trex *trex,
+                        uint64_t moof_offset, uint64_t &data_end) {
+        if (traf.child<Tfhd>() == nullptr) {
+            return;
         }
-        return ss.str();
+        auto tfdt = traf.child<Tfdt>();
+        if (tfdt != nullptr) {
+            next_dts_ = tfdt->baseMediaDecodeTime();
+        }
+        auto &c = columns();
+        walkFragment(traf, trex, moof_offset, data_end,
+                     [this, &c](const Trun::Sample &sample, uint64_t offset) {
+                         auto index = c.sizes_.size();
+                         c.offsets_.push_back(offset);
+                         c.sizes_.push_back(sample.size_);
+                         c.dts_.push_back(next_dts_);
+                         c.cts_delta_.push_back(sample.composition_offset_);
+                         if (index / 64 >= c.sync_.size()) {
+                             c.sync_.push_back(0);
+                         }
+                         auto bit = 1ULL << (index % 64);
+                         if (sample.flags_ & Trun::kSampleIsNonSync) {
+                             c.sync_[index / 64] &= ~bit;
+                         } else {
+                             c.sync_[index / 64] |= bit;
+                         }
+                         next_dts_ += sample.duration_;
+                     });
+        refresh();
+    }
+
+    /**
+     * Move data_end past the data of a traf of another track, for the trafs
+     * after it that continue from there
+     */
+    static void skipFragment(const Traf &traf, const Trex *trex,
+                             uint64_t moof_offset, uint64_t &data_end) {
+        walkFragment(traf, trex, moof_offset, data_end,
+                     [](const Trun::Sample &, uint64_t) {});
+    }
+
+    /**
+     * Use arrays kept elsewhere instead of building them. hold keeps their
+     * memory valid for as long as the index or a copy of it needs them.
+     * Return false if the arrays don't agree on the number of samples.
+     */
+    bool assign(uint32_t timescale, uint64_t next_dts, const Tables &tables,
+                std::shared_ptr<const void> hold) {
+        auto count = tables.sizes_.size();
+        if (tables.offsets_.size() != count || tables.dts_.size() != count ||
+            tables.cts_delta_.size() != count ||
+            tables.sync_.size() != (count + 63) / 64) {
+            return false;
+        }
+        timescale_ = timescale;
+        next_dts_ = next_dts;
+        tables_ = tables;
+        columns_.reset();
+        hold_ = std::move(hold);
+        return true;
+    }
+
+    const Tables &tables() const { return tables_; }
+
+    size_t sampleCount() const { return tables_.sizes_.size(); }
+
+    uint32_t timescale() const { return timescale_; }
+
+    void setTimescale(uint32_t timescale) { timescale_ = timescale; }
+
+    // Decoding time after the last sample
+    uint64_t nextDts() const { return next_dts_; }
+
+    uint64_t offset(size_t sample) const { return tables_.offsets_[sample]; }
+
+    uint32_t size(size_t sample) const { return tables_.sizes_[sample]; }
+
+    uint64_t dts(size_t sample) const { return tables_.dts_[sample]; }
+
+    int32_t ctsDelta(size_t sample) const {
+        return tables_.cts_delta_[sample];
+    }
+
+    // The last sample lasts until the end of the track
+    uint64_t duration(size_t sample) const {
+        const auto &dts = tables_.dts_;
+        auto next = sample + 1 < dts.size() ? dts[sample + 1] : next_dts_;
+        return next - dts[sample];
+    }
+
+    int64_t cts(size_t sample) const {
+        return static_cast<int64_t>(tables_.dts_[sample]) +
+               tables_.cts_delta_[sample];
+    }
+
+    bool isSync(size_t sample) const {
+        return tables_.sync_[sample / 64] >> (sample % 64) & 1U;
     }
 
+    ArrayView<uint64_t> offsets() const { return tables_.offsets_; }
+
+    ArrayView<uint32_t> sizes() const { return tables_.sizes_; }
+
+    ArrayView<uint64_t> dtsArray() const { return tables_.dts_; }
+
+    ArrayView<int32_t> ctsDeltas() const { return tables_.cts_delta_; }
+
 private:
-    uint32_t entry_count_ = 0;
-    std::vector<uint64_t> chunk_offsets_;
-};
+    // Arrays owned by the index
+    struct Columns {
+        std::vector<uint64_t> offsets_;
+        std::vector<uint32_t> sizes_;
+        std::vector<uint64_t> dts_;
+        std::vector<int32_t> cts_delta_;
+        std::vector<uint64_t> sync_;
+    };
 
-/**
- * Sample table box
- */
-class Stbl : public Box {
-public:
-    static const uint32_t tag_ = str2BoxType("stbl");
+    // Owned arrays nothing else shares, copied out of tables_ if need be
+    Columns &columns() {
+        if (columns_ == nullptr || columns_.use_count() > 1) {
+            auto c = std::make_shared<Columns>();
+            c->offsets_.assign(tables_.offsets_.begin(),
+                               tables_.offsets_.end());
+            c->sizes_.assign(tables_.sizes_.begin(), tables_.sizes_.end());
+            c->dts_.assign(tables_.dts_.begin(), tables_.dts_.end());
+            c->cts_delta_.assign(tables_.cts_delta_.begin(),
+                                 tables_.cts_delta_.end());
+            c->sync_.assign(tables_.sync_.begin(), tables_.sync_.end());
+            columns_ = std::move(c);
+            hold_.reset();
+        }
+        return *columns_;
+    }
 
-    Stbl(const Box &box) : Box(box) {}
+    void refresh() {
+        const auto &c = *columns_;
+        tables_ = Tables{c.offsets_, c.sizes_, c.dts_, c.cts_delta_, c.sync_};
+    }
 
-    void parseInternal(FileOp &file) override { parseChild(file); }
+    /**
+     * Call fn with each sample of traf and its offset in the file. Without
+     * an explicit base, or default-base-is-moof, the data of a traf starts
+     * where that of the traf before it in the moof ends, data_end.
+     */
+    template <typename Fn>
+    static void walkFragment(const Traf &traf, const Trex *trex,
+                             uint64_t moof_offset, uint64_t &data_end,
+                             Fn &&fn) {
+        auto tfhd = traf.child<Tfhd>();
+        if (tfhd == nullptr) {
+            return;
+        }
+        Trun::Sample defaults;
+        defaults.duration_ = tfhd->defaultSampleDuration().value_or(
+            trex ? trex->defaultSampleDuration() : 0);
+        defaults.size_ = tfhd->defaultSampleSize().value_or(
+            trex ? trex->defaultSampleSize() : 0);
+        defaults.flags_ = tfhd->defaultSampleFlags().value_or(
+            trex ? trex->defaultSampleFlags() : 0);
+        auto base = tfhd->baseDataOffset().value_or(
+            tfhd->defaultBaseIsMoof() ? moof_offset : data_end);
+        auto data = base;
+        for (const auto &item : traf.children()) {
+            if (item->baseType() != Trun::tag_) {
+                continue;
+            }
+            auto trun = static_cast<const Trun *>(item.get());
+            if (trun->dataOffset().has_value()) {
+                data = base + trun->dataOffset().value();
+            }
+            for (const auto &sample : trun->samples(defaults)) {
+                fn(sample, data);
+                data += sample.size_;
+            }
+        }
+        data_end = data;
+    }
+
+    template <typename T>
+    void expandChunks(const std::vector<Stsc::Entry> &stsc,
+                      const T *chunk_offsets, size_t chunk_count) {
+        auto &c = *columns_;
+        auto count = c.sizes_.size();
+        c.offsets_.assign(count, 0);
+        size_t sample = 0;
+        for (size_t e = 0; e < stsc.size() && sample < count; e++) {
+            // first_chunk_ counts from 1, the run ends where the next starts
+            size_t first = stsc[e].first_chunk_ - 1;
+            size_t last = e + 1 < stsc.size() ? stsc[e + 1].first_chunk_ - 1
+                                              : chunk_count;
+            last = std::min(last, chunk_count);
+            for (size_t chunk = first; chunk < last && sample < count;
+                 chunk++) {
+                uint64_t offset = chunk_offsets[chunk];
+                auto end = std::min<size_t>(
+                    count, sample + stsc[e].samples_per_chunk_);
+                for (; sample < end; sample++) {
+                    c.offsets_[sample] = offset;
+                    offset += c.sizes_[sample];
+                }
+            }
+        }
+    }
+
+    uint32_t timescale_ = 1;
+    Tables tables_;
+    std::shared_ptr<Columns> columns_;
+    // Keeps tables_ valid when it points outside columns_
+    std::shared_ptr<const void> hold_;
+    // Decoding time after the last sample
+    uint64_t next_dts_ = 0;
 };
 
 /**
- * Media Information Box
+ * Timestamp to sample lookup over the run length coded stts table
  *
- * Container: Media Box(mdia)
+ * Keeps the first sample and start time of every run, so mapping a time to a
+ * sample is a binary search over runs rather than a walk over all samples.
+ * Times are in the media timescale and samples are indexed from 0.
  */
-class Minf : public Box {
+class SeekIndex {
 public:
-    static const uint32_t tag_ = str2BoxType("minf");
+    void build(const Stts &stts, const Stss *stss, uint32_t timescale) {
+        timescale_ = timescale ? timescale : 1;
+        run_first_sample_.clear();
+        run_start_time_.clear();
+        run_delta_.clear();
+        uint64_t sample = 0;
+        uint64_t time = 0;
+        for (const auto &entry : stts.entries()) {
+            if (entry.sample_count_ == 0) continue;
+            run_first_sample_.push_back(sample);
+            run_start_time_.push_back(time);
+            run_delta_.push_back(entry.sample_delta_);
+            sample += entry.sample_count_;
+            time += (uint64_t)entry.sample_count_ * entry.sample_delta_;
+        }
+        sample_count_ = sample;
+        duration_ = time;
+        all_sync_ = stss == nullptr;
+        sync_samples_.clear();
+        if (stss != nullptr) {
+            sync_samples_ = stss->sampleNumbers();
+            // Sample numbers count from 1, a 0 names no sample
+            sync_samples_.erase(
+                std::remove(sync_samples_.begin(), sync_samples_.end(), 0U),
+                sync_samples_.end());
+            std::sort(sync_samples_.begin(), sync_samples_.end());
+        }
+    }
 
-    Minf(const Box &box) : Box(box) {}
+    uint64_t sampleCount() const { return sample_count_; }
 
-    void parseInternal(FileOp &file) override { parseChild(file); }
+    uint32_t timescale() const { return timescale_; }
+
+    uint64_t duration() const { return duration_; }
+
+    /**
+     * Sample being decoded at time, clamped to the last sample. Return 0 for
+     * an empty track.
+     */
+    uint64_t sampleAtTime(uint64_t time) const {
+        if (sample_count_ == 0) {
+            return 0;
+        }
+        auto it = std::upper_bound(run_start_time_.begin(),
+                                   run_start_time_.end(), time);
+        size_t run = it - run_start_time_.begin() - 1;
+        uint64_t first = run_first_sample_[run];
+        uint64_t last = run + 1 < run_first_sample_.size()
+                            ? run_first_sample_[run + 1] - 1
+                            : sample_count_ - 1;
+        if (run_delta_[run] == 0) {
+            return first;
+        }
+        auto sample = first + (time - run_start_time_[run]) / run_delta_[run];
+        return std::min(sample, last);
+    }
+
+    uint64_t sampleAtSeconds(double sec) const {
+        auto time = sec * timescale_;
+        if (!(time > 0)) return sampleAtTime(0);
+        if (time >= 1.8e19) return sampleAtTime(UINT64_MAX);
+        return sampleAtTime(static_cast<uint64_t>(time));
+    }
+
+    /**
+     * Decoding time of sample
+     */
+    uint64_t sampleTime(uint64_t sample) const {
+        if (sample_count_ == 0) {
+            return 0;
+        }
+        auto it = std::upper_bound(run_first_sample_.begin(),
+                                   run_first_sample_.end(), sample);
+        size_t run = it - run_first_sample_.begin() - 1;
+        return run_start_time_[run] +
+               (sample - run_first_sample_[run]) * run_delta_[run];
+    }
+
+    /**
+     * Nearest sync sample at or before sample. Return the first sync sample
+     * when none precedes it, and 0 when an stss lists none at all.
+     */
+    uint64_t syncSampleBefore(uint64_t sample) const {
+        if (all_sync_) {
+            return sample;
+        }
+        if (sync_samples_.empty()) {
+            return 0;
+        }
+        // sample numbers in stss count from 1
+        auto it = std::upper_bound(sync_samples_.begin(), sync_samples_.end(),
+                                   sample + 1);
+        if (it == sync_samples_.begin()) {
+            return sync_samples_.front() - 1;
+        }
+        return *(it - 1) - 1;
+    }
+
+    uint64_t syncSampleAtTime(uint64_t time) const {
+        return syncSampleBefore(sampleAtTime(time));
+    }
+
+private:
+    uint32_t timescale_ = 1;
+    uint64_t sample_count_ = 0;
+    uint64_t duration_ = 0;
+    std::vector<uint64_t> run_first_sample_;
+    std::vector<uint64_t> run_start_time_;
+    std::vector<uint32_t> run_delta_;
+    bool all_sync_ = true;
+    std::vector<uint32_t> sync_samples_;
 };
 
 class Trak : public Box {
 public:
     static const uint32_t tag_ = str2BoxType("trak");
 
+    static constexpr int children_offset_ = 0;
+
     Trak(Box box) : Box(std::move(box)) {}
 
     void parseInternal(FileOp &file) override { parseChild(file); }
+
+    /**
+     * Sample index of this track, built on first use. Return nullptr if the
+     * track has no usable sample table.
+     */
+    const TrackIndex *sampleIndex() {
+        if (!index_built_) {
+            index_built_ = true;
+            Mdia *mdia = nullptr;
+            auto stbl = sampleTable(mdia);
+            if (stbl != nullptr) {
+                auto index = std::make_unique<TrackIndex>();
+                if (index->build(*stbl, mdia->getTimeScale())) {
+                    index_ = std::move(index);
+                }
+            }
+        }
+        return index_.get();
+    }
+
+    /**
+     * Timestamp to sample lookup of this track, built on first use. Return
+     * nullptr if the track has no stts.
+     */
+    const SeekIndex *seekIndex() {
+        if (!seek_built_) {
+            seek_built_ = true;
+            Mdia *mdia = nullptr;
+            auto stbl = sampleTable(mdia);
+            auto stts = stbl ? stbl->child<Stts>() : nullptr;
+            if (stts != nullptr) {
+                seek_ = std::make_shared<SeekIndex>();
+                seek_->build(*stts, stbl->child<Stss>(), mdia->getTimeScale());
+            }
+        }
+        return seek_.get();
+    }
+
+private:
+    Box *sampleTable(Mdia *&mdia) {
+        mdia = child<Mdia>();
+        auto minf = mdia ? mdia->child<Minf>() : nullptr;
+        return minf ? minf->child<Stbl>() : nullptr;
+    }
+
+    bool index_built_ = false;
+    std::shared_ptr<TrackIndex> index_;
+    bool seek_built_ = false;
+    std::shared_ptr<SeekIndex> seek_;
 };
 
 class Moov : public Box {
 public:
     static const uint32_t tag_ = str2BoxType("moov");
 
+    static constexpr int children_offset_ = 0;
+
     Moov(Box box) : Box(box) {}
 
     void parseInternal(FileOp &file) override { parseChild(file); }
@@ -1085,13 +4256,18 @@ public:
         Box::Boxes boxes;
         FileOp file(path);
         if (!file.open("r")) return boxes;
+        uint64_t pos = 0;
         while (true) {
-            auto box = Box::parseBasic(file);
+            auto box = Box::parseBasic(file, pos);
             if (box != nullptr) {
                 auto detailBox = toDetailType(std::move(box));
-                detailBox->parseInternal(file);
+                detailBox->parse(file);
                 boxes.push_back(detailBox);
-                file.seek(detailBox->offset() + detailBox->size(), SEEK_SET);
+                auto end = detailBox->offset() + detailBox->size();
+                if (end <= pos) {
+                    return boxes;
+                }
+                pos = end;
             } else {
                 return boxes;
             }
@@ -1099,61 +4275,203 @@ public:
     }
 };
 
-std::shared_ptr<Box> toDetailType(std::unique_ptr<Box> base) {
-    switch (base->baseType()) {
-        case Ctts::tag_:
-            return toDetail<Ctts>(*base);
-        case Dinf::tag_:
-            return toDetail<Dinf>(*base);
-        case Dref::tag_:
-            return toDetail<Dref>(*base);
-        case Durl::tag_:
-            return toDetail<Durl>(*base);
-        case Hmhd::tag_:
-            return toDetail<Hmhd>(*base);
-        case Mdhd::tag_:
-            return toDetail<Mdhd>(*base);
-        case Hdlr::tag_:
-            return toDetail<Hdlr>(*base);
-        case Minf::tag_:
-            return toDetail<Minf>(*base);
-        case Smhd::tag_:
-            return toDetail<Smhd>(*base);
-        case Stbl::tag_:
-            return toDetail<Stbl>(*base);
-        case Stsc::tag_:
-            return toDetail<Stsc>(*base);
-        case Stsd::tag_:
-            return toDetail<Stsd>(*base);
-        case Stsz::tag_:
-            return toDetail<Stsz>(*base);
-        case Stts::tag_:
-            return toDetail<Stts>(*base);
-        case Vmhd::tag_:
-            return toDetail<Vmhd>(*base);
-        case Tkhd::tag_:
-            return toDetail<Tkhd>(*base);
-        case Mdia::tag_:
-            return toDetail<Mdia>(*base);
-        case Mvhd::tag_:
-            return toDetail<Mvhd>(*base);
-        case Trak::tag_:
-            return toDetail<Trak>(*base);
-        case Moov::tag_:
-            return toDetail<Moov>(*base);
-        case Ftyp::tag_:
-            return toDetail<Ftyp>(*base);
-        case Mdat::tag_:
-            return toDetail<Mdat>(*base);
-        case Stco::tag_:
-            return toDetail<Stco>(*base);
-        case Co64::tag_:
-            return toDetail<Co64>(*base);
-        case Stss::tag_:
-            return toDetail<Stss>(*base);
-        default:
-            return base;
+/**
+ * Push based parser for input that can't seek
+ *
+ * Bytes are fed in chunks of any size as they arrive, and each top level
+ * box is handed to the callback as soon as its last byte is in. mdat, free
+ * and skip payloads are counted off instead of buffered, so memory stays
+ * bounded by the largest metadata box. A box declaring more than
+ * max_box_size bytes fails the parse instead of being buffered, and the
+ * buffer grows with the bytes that arrive rather than with the declared
+ * size.
+ */
+class StreamParser {
+public:
+    using Callback = std::function<void(const std::shared_ptr<Box> &)>;
+
+    static constexpr uint64_t kMaxBoxSize = 256ULL << 20;
+
+    explicit StreamParser(Callback on_box,
+                          uint64_t max_box_size = kMaxBoxSize)
+        : on_box_(std::move(on_box)), max_box_size_(max_box_size) {}
+
+    /**
+     * Feed the next chunk of input. Return false once the input is found to
+     * be malformed, later calls keep failing.
+     */
+    bool push(const uint8_t *data, size_t size) {
+        while (size > 0 && !failed_) {
+            if (skip_ > 0) {
+                auto n = std::min<uint64_t>(skip_, size);
+                if (skip_ != UINT64_MAX) skip_ -= n;
+                offset_ += n;
+                data += n;
+                size -= n;
+                continue;
+            }
+            auto n = std::min<uint64_t>(need_ - buffer_.size(), size);
+            buffer_.insert(buffer_.end(), data, data + n);
+            data += n;
+            size -= n;
+            // A header can complete its box too, when there is no payload
+            while (!failed_ && buffer_.size() == need_) {
+                step();
+            }
+        }
+        return !failed_;
+    }
+
+    /**
+     * Signal the end of input. Return false if it ended inside a box.
+     */
+    bool finish() {
+        return !failed_ && buffer_.empty() &&
+               (skip_ == 0 || skip_ == UINT64_MAX);
     }
+
+    // Input offset of the next byte expected
+    uint64_t offset() const { return offset_ + buffer_.size(); }
+
+    // Largest amount of input held at once
+    size_t maxBuffered() const { return max_buffered_; }
+
+private:
+    static bool isSkipped(uint32_t type) {
+        return type == Box::str2BoxType("mdat") ||
+               type == Box::str2BoxType("free") ||
+               type == Box::str2BoxType("skip");
+    }
+
+    void step() {
+        max_buffered_ = std::max(max_buffered_, buffer_.size());
+        if (header_size_ == 0) {
+            parseHeader();
+            return;
+        }
+        // The whole box is in
+        FileOp file(std::make_shared<MemorySource>(std::move(buffer_), offset_),
+                    offset_);
+        offset_ += need_;
+        reset();
+        auto box = Box::parseBasic(file);
+        auto detailBox = toDetailType(std::move(box));
+        detailBox->parse(file);
+        on_box_(detailBox);
+    }
+
+    void parseHeader() {
+        uint64_t size = buf2UInt32(buffer_.data());
+        uint32_t type = 0;
+        memcpy(&type, buffer_.data() + 4, sizeof(type));
+        size_t header = 8;
+        if (size == 1) {
+            header += 8;
+            if (buffer_.size() < header) {
+                need_ = header;
+                return;
+            }
+            size = buf2UInt64(buffer_.data() + 8);
+        }
+        if (type == Box::str2BoxType("uuid")) {
+            header += 16;
+            if (buffer_.size() < header) {
+                need_ = header;
+                return;
+            }
+        }
+        // size 0 means the box runs to the end of input
+        if ((size != 0 && size < header) || (size == 0 && !isSkipped(type)) ||
+            (size > max_box_size_ && !isSkipped(type))) {
+            failed_ = true;
+            return;
+        }
+        if (isSkipped(type)) {
+            // Only the header is in, so it can't be read back as a whole box
+            Box::BoxBuilder builder;
+            builder.offset_ = offset_;
+            builder.size_ = size;
+            builder.type_ = type;
+            builder.header_size_ = header;
+            auto box = toDetailType(builder.build());
+            offset_ += header;
+            skip_ = size == 0 ? UINT64_MAX : size - header;
+            reset();
+            on_box_(box);
+            return;
+        }
+        header_size_ = header;
+        need_ = size;
+    }
+
+    void reset() {
+        buffer_.clear();
+        header_size_ = 0;
+        need_ = 8;
+    }
+
+    Callback on_box_;
+    uint64_t max_box_size_;
+    std::vector<uint8_t> buffer_;
+    uint64_t offset_ = 0;
+    uint64_t need_ = 8;
+    size_t header_size_ = 0;
+    uint64_t skip_ = 0;
+    size_t max_buffered_ = 0;
+    bool failed_ = false;
+};
+
+using DetailBoxes = BoxRegistry<BoxTypeList<
+    Ctts,
+    Dinf,
+    Dref,
+    Durl,
+    Hmhd,
+    Mdhd,
+    Hdlr,
+    Minf,
+    Smhd,
+    Stbl,
+    Stsc,
+    Stsd,
+    Stsz,
+    Stts,
+    Vmhd,
+    Tkhd,
+    Mdia,
+    Mvhd,
+    Trak,
+    Moov,
+    Ftyp,
+    Mdat,
+    Stco,
+    Co64,
+    Stss,
+    Mvex,
+    Mehd,
+    Trex,
+    Moof,
+    Mfhd,
+    Traf,
+    Tfhd,
+    Tfdt,
+    Trun,
+    Sidx,
+    Mfra,
+    Tfra,
+    Mfro>>;
+
+template <typename Maker>
+auto visitDetailType(uint32_t type, Maker &&maker) {
+    return DetailBoxes::visit(type, std::forward<Maker>(maker));
+}
+
+inline int Box::childrenOffset(uint32_t type) {
+    return DetailBoxes::childrenOffset(type);
+}
+
+std::shared_ptr<Box> toDetailType(std::unique_ptr<Box> base) {
+    return visitDetailType(base->baseType(), SharedBoxMaker{base});
 }
 
 }  // namespace mov
@@ -0,0 +1,437 @@
+#include <getopt.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <random>
+
+#include "synthetic.h"
+
+extern char **environ;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Result {
+    std::string benchmark_;
+    std::string input_;
+    double value_ = 0;
+    // Times are better lower, rates ("/s") higher
+    std::string unit_;
+
+    bool higherIsBetter() const {
+        return unit_.size() > 2 &&
+               unit_.compare(unit_.size() - 2, 2, "/s") == 0;
+    }
+};
+
+/**
+ * Seconds f takes, the fastest of at least kMinRuns calls and as many more
+ * as fit in min_seconds. The fastest run is the one least disturbed by the
+ * rest of the machine, so it moves the least from one run to the next.
+ */
+template <typename F>
+double measure(double min_seconds, F &&f) {
+    const size_t kMinRuns = 5;
+    std::vector<double> runs;
+    auto start = Clock::now();
+    while (runs.size() < kMinRuns ||
+           std::chrono::duration<double>(Clock::now() - start).count() <
+               min_seconds) {
+        auto begin = Clock::now();
+        f();
+        runs.push_back(
+            std::chrono::duration<double>(Clock::now() - begin).count());
+    }
+    return *std::min_element(runs.begin(), runs.end());
+}
+
+// Keeps the compiler from dropping work whose result is unused
+volatile uint64_t sink;
+
+void collect(const mov::Box::Boxes &boxes,
+             std::map<uint32_t, std::vector<uint64_t>> &tables) {
+    static const uint32_t kTables[] = {
+        mov::Stts::tag_, mov::Ctts::tag_, mov::Stsz::tag_, mov::Stsc::tag_,
+        mov::Stco::tag_, mov::Co64::tag_, mov::Stss::tag_, mov::Trun::tag_};
+    for (const auto &box : boxes) {
+        auto type = box->baseType();
+        if (std::find(std::begin(kTables), std::end(kTables), type) !=
+            std::end(kTables)) {
+            tables[type].push_back(box->offset());
+        }
+        if (box->hasChild()) {
+            collect(box->children(), tables);
+        }
+    }
+}
+
+// Parse the table at offset and decode all of it. Return its entry count.
+uint64_t decodeTable(mov::FileOp &file, uint64_t offset) {
+    auto box = mov::toDetailType(mov::Box::parseBasic(file, offset));
+    box->parse(file);
+    if (auto stts = box->as<mov::Stts>()) return stts->entries().size();
+    if (auto ctts = box->as<mov::Ctts>()) return ctts->entries().size();
+    if (auto stsz = box->as<mov::Stsz>()) return stsz->entrySizes().size();
+    if (auto stsc = box->as<mov::Stsc>()) return stsc->entries().size();
+    if (auto stco = box->as<mov::Stco>()) return stco->chunkOffsets().size();
+    if (auto co64 = box->as<mov::Co64>()) return co64->chunkOffsets().size();
+    if (auto stss = box->as<mov::Stss>()) return stss->sampleNumbers().size();
+    if (auto trun = box->as<mov::Trun>()) {
+        return trun->samples(mov::Trun::Sample()).size();
+    }
+    return 0;
+}
+
+// Run command with its output thrown away. Return false if it fails.
+bool run(const std::vector<std::string> &command) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    std::vector<char *> argv;
+    for (const auto &arg : command) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    int status = 0;
+    bool ok = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(),
+                          environ) == 0 &&
+              waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+              WEXITSTATUS(status) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    return ok;
+}
+
+// The mp4 tool built next to this benchmark
+std::string cliPath() {
+    char self[PATH_MAX];
+    auto n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+    if (n <= 0) return std::string();
+    std::string path(self, n);
+    path = path.substr(0, path.rfind('/') + 1) + "mp4";
+    return access(path.c_str(), X_OK) == 0 ? path : std::string();
+}
+
+class Bench {
+public:
+    Bench(double min_seconds, std::string cli)
+        : min_seconds_(min_seconds), cli_(std::move(cli)) {}
+
+    const std::vector<Result> &results() const { return results_; }
+
+    void runAll(const std::string &path, const std::string &input) {
+        walk(path, input);
+        auto boxes = parse(path, input);
+        decode(path, input, boxes);
+        seek(input, boxes);
+        dump(path, input);
+    }
+
+private:
+    void add(const std::string &benchmark, const std::string &input,
+             double value, const char *unit) {
+        results_.push_back(Result{benchmark, input, value, unit});
+        std::cerr << benchmark << ' ' << input << ": " << value << ' ' << unit
+                  << '\n';
+    }
+
+    // Top level box headers only, what locating moov costs
+    void walk(const std::string &path, const std::string &input) {
+        mov::FileOp file(path.c_str());
+        if (!file.open("r")) return;
+        auto seconds = measure(min_seconds_, [&file] {
+            uint64_t pos = 0;
+            while (auto box = mov::Box::parseBasic(file, pos)) {
+                if (box->size() == 0) break;
+                pos = box->offset() + box->size();
+                sink = sink + 1;
+            }
+        });
+        add("walk", input, seconds * 1e3, "ms");
+    }
+
+    // Every box, tables deferred until used
+    mov::Box::Boxes parse(const std::string &path, const std::string &input) {
+        mov::Box::Boxes boxes;
+        auto seconds = measure(min_seconds_, [&] {
+            boxes = mov::Mp4Paser::parse(path.c_str());
+        });
+        add("parse", input, seconds * 1e3, "ms");
+        return boxes;
+    }
+
+    void decode(const std::string &path, const std::string &input,
+                const mov::Box::Boxes &boxes) {
+        std::map<uint32_t, std::vector<uint64_t>> tables;
+        collect(boxes, tables);
+        mov::FileOp file(path.c_str());
+        if (!file.open("r")) return;
+        for (const auto &item : tables) {
+            uint64_t entries = 0;
+            auto seconds = measure(min_seconds_, [&] {
+                entries = 0;
+                for (auto offset : item.second) {
+                    entries += decodeTable(file, offset);
+                }
+            });
+            if (entries == 0) continue;
+            add("decode_" + mov::Box::boxType2Str(item.first), input,
+                entries / seconds, "entries/s");
+        }
+    }
+
+    // Sync sample lookups by time on the first track with samples
+    void seek(const std::string &input, const mov::Box::Boxes &boxes) {
+        const size_t kQueries = 100000;
+        for (const auto &top : boxes) {
+            auto moov = top->as<mov::Moov>();
+            if (moov == nullptr) continue;
+            for (const auto &item : moov->children()) {
+                auto trak = item->as<mov::Trak>();
+                auto mdia = trak ? trak->child<mov::Mdia>() : nullptr;
+                auto mdhd = mdia ? mdia->child<mov::Mdhd>() : nullptr;
+                auto minf = mdia ? mdia->child<mov::Minf>() : nullptr;
+                auto stbl = minf ? minf->child<mov::Stbl>() : nullptr;
+                auto stts = stbl ? stbl->child<mov::Stts>() : nullptr;
+                if (mdhd == nullptr || stts == nullptr) continue;
+                mov::SeekIndex index;
+                auto build = measure(min_seconds_, [&] {
+                    index.build(*stts, stbl->child<mov::Stss>(),
+                                mdhd->timescale());
+                });
+                if (index.sampleCount() == 0) continue;
+                std::mt19937_64 rng(1);
+                std::uniform_int_distribution<uint64_t> time(
+                    0, index.duration() - 1);
+                std::vector<uint64_t> times(kQueries);
+                for (auto &t : times) t = time(rng);
+                auto seconds = measure(min_seconds_, [&] {
+                    for (auto t : times) {
+                        sink = sink + index.syncSampleAtTime(t);
+                    }
+                });
+                add("seek_build", input, build * 1e3, "ms");
+                add("seek", input, seconds / kQueries * 1e9, "ns");
+                return;
+            }
+        }
+    }
+
+    // The mp4 tool on the file, default and verbose output
+    void dump(const std::string &path, const std::string &input) {
+        if (cli_.empty()) return;
+        for (bool verbose : {false, true}) {
+            std::vector<std::string> command = {cli_, path};
+            if (verbose) command.insert(command.begin() + 1, "-v");
+            bool ok = true;
+            auto seconds = measure(min_seconds_,
+                                   [&] { ok = run(command) && ok; });
+            if (!ok) {
+                std::cerr << cli_ << " failed on " << path << '\n';
+                continue;
+            }
+            add(verbose ? "dump_verbose" : "dump", input, seconds * 1e3,
+                "ms");
+        }
+    }
+
+    double min_seconds_;
+    std::string cli_;
+    std::vector<Result> results_;
+};
+
+// Results are tab separated lines of benchmark, input, value and unit
+void writeResults(std::ostream &out, const std::vector<Result> &results) {
+    out << "# benchmark\tinput\tvalue\tunit\n";
+    out.precision(6);
+    for (const auto &result : results) {
+        out << result.benchmark_ << '\t' << result.input_ << '\t'
+            << result.value_ << '\t' << result.unit_ << '\n';
+    }
+}
+
+bool readResults(const char *path, std::vector<Result> &results) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "open " << path << " failed\n";
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        std::stringstream ss(line);
+        Result result;
+        std::string value;
+        if (!std::getline(ss, result.benchmark_, '\t') ||
+            !std::getline(ss, result.input_, '\t') ||
+            !std::getline(ss, value, '\t') ||
+            !std::getline(ss, result.unit_)) {
+            std::cerr << "bad line in " << path << ": " << line << '\n';
+            return false;
+        }
+        result.value_ = strtod(value.c_str(), nullptr);
+        results.push_back(std::move(result));
+    }
+    return true;
+}
+
+/**
+ * Print how results changed from baseline to std::cerr, stdout being left to
+ * the results. Return false if any got worse by more than threshold percent.
+ */
+bool compare(const std::vector<Result> &baseline,
+             const std::vector<Result> &results, double threshold) {
+    std::map<std::pair<std::string, std::string>, const Result *> base;
+    for (const auto &result : baseline) {
+        base[{result.benchmark_, result.input_}] = &result;
+    }
+    size_t regressions = 0;
+    std::cerr << "# baseline -> now, and time per unit of work, + for slower\n";
+    for (const auto &result : results) {
+        auto it = base.find({result.benchmark_, result.input_});
+        if (it == base.end() || it->second->value_ <= 0 ||
+            it->second->unit_ != result.unit_) {
+            continue;
+        }
+        auto ratio = result.value_ / it->second->value_;
+        // Percent slower, negative when faster
+        auto slower = (result.higherIsBetter() ? 1 / ratio - 1 : ratio - 1) *
+                      100;
+        bool regressed = slower > threshold;
+        regressions += regressed;
+        char line[256];
+        snprintf(line, sizeof(line),
+                 "%-16s %-16s %14.6g -> %-14.6g %+7.1f%%%s",
+                 result.benchmark_.c_str(), result.input_.c_str(),
+                 it->second->value_, result.value_, slower,
+                 regressed ? "  REGRESSION" : "");
+        std::cerr << line << '\n';
+    }
+    std::cerr << regressions << " regressions over " << threshold << "%\n";
+    return regressions == 0;
+}
+
+bool parseScales(const char *arg, std::vector<uint64_t> &scales) {
+    scales.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        char *end = nullptr;
+        auto value = strtoull(item.c_str(), &end, 10);
+        if (end == item.c_str() || *end != '\0' || value == 0) return false;
+        scales.push_back(value);
+    }
+    return !scales.empty();
+}
+
+void usage(const char *arg0) {
+    std::cout << "usage: " << arg0
+              << " [-s samples,...] [-d dir] [-m ms] [-o results.tsv]\n"
+              << "       [-b baseline.tsv] [-t percent]\n"
+              << "  -s  video samples of the generated inputs, one input "
+                 "pair per scale,\n"
+              << "      10000,100000,1000000 by default\n"
+              << "  -d  where inputs are generated, /tmp by default\n"
+              << "  -m  minimum time per measurement, 200 ms by default\n"
+              << "  -o  write results there instead of stdout\n"
+              << "  -b  compare with results written before, exit 1 on a "
+                 "regression\n"
+              << "  -t  regression threshold, 10% by default\n";
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    std::vector<uint64_t> scales = {10000, 100000, 1000000};
+    std::string dir = "/tmp";
+    double min_ms = 200;
+    const char *output = nullptr;
+    const char *baseline = nullptr;
+    double threshold = 10;
+
+    int ch;
+    bool ok = true;
+    while ((ch = getopt(argc, argv, "s:d:m:o:b:t:")) != -1) {
+        switch (ch) {
+            case 's':
+                ok = ok && parseScales(optarg, scales);
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'm':
+                min_ms = strtod(optarg, nullptr);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 't':
+                threshold = strtod(optarg, nullptr);
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    if (!ok || optind != argc || min_ms <= 0 || threshold <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Result> base;
+    if (baseline != nullptr && !readResults(baseline, base)) {
+        return EXIT_FAILURE;
+    }
+    auto cli = cliPath();
+    if (cli.empty()) {
+        std::cerr << "mp4 not found next to " << argv[0]
+                  << ", skipping dump benchmarks\n";
+    }
+
+    Bench bench(min_ms / 1e3, cli);
+    for (auto samples : scales) {
+        // Plain with large stts, ctts and stsc, and fragmented. Sample data
+        // is a hole, none of the benchmarks read it.
+        auto plain = mov::avSpec(1, 1, samples, {10, 20, 30});
+        plain.tracks_[0].ctts_ = true;
+        plain.tracks_[0].variable_delta_ = true;
+        auto fragmented = plain;
+        fragmented.fragment_ms_ = 2000;
+        for (auto *spec : {&plain, &fragmented}) {
+            spec->sparse_ = true;
+            auto input = std::string(spec == &plain ? "plain_" : "frag_") +
+                         std::to_string(samples);
+            auto path = dir + "/mp4_bench_" + input + ".mp4";
+            mov::SyntheticWriter writer(*spec);
+            if (!writer.write(path.c_str())) {
+                return EXIT_FAILURE;
+            }
+            bench.runAll(path, input);
+            unlink(path.c_str());
+        }
+    }
+
+    if (output != nullptr) {
+        std::ofstream out(output);
+        writeResults(out, bench.results());
+        if (!out) {
+            std::cerr << "write " << output << " failed\n";
+            return EXIT_FAILURE;
+        }
+    } else {
+        writeResults(std::cout, bench.results());
+    }
+    if (baseline != nullptr && !compare(base, bench.results(), threshold)) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,146 @@
+#include <getopt.h>
+
+#include <chrono>
+
+#include "synthetic.h"
+
+static void usage(const char *arg0) {
+    std::cout
+        << "usage: " << arg0 << " [options] out.mp4\n"
+        << "  -v tracks     video tracks, 1 by default\n"
+        << "  -a tracks     audio tracks as long as the video, 1 by default\n"
+        << "  -n samples    samples per video track, 3000 by default\n"
+        << "  -s bytes      average video sample size, 20000 by default\n"
+        << "  -c n[,n...]   samples per video chunk, cycled, 30 by default\n"
+        << "  -g gop        video sync sample interval, 0 for all, 60 by "
+           "default\n"
+        << "  -b            B frame composition offsets on video (ctts)\n"
+        << "  -r            variable video sample durations\n"
+        << "  -e            moov at the end\n"
+        << "  -6            co64 even where stco would do\n"
+        << "  -l            64 bit mdat size even where 32 bits would do\n"
+        << "  -F ms         fragmented, ms per fragment\n"
+        << "  -z            sparse file, sample data left a hole\n";
+}
+
+static bool parseCount(const char *arg, uint64_t &value) {
+    char *end = nullptr;
+    errno = 0;
+    value = strtoull(arg, &end, 10);
+    return errno == 0 && end != arg && *end == '\0';
+}
+
+static bool parseChunking(const char *arg, std::vector<uint32_t> &chunking) {
+    chunking.clear();
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        uint64_t count;
+        if (!parseCount(item.c_str(), count) || count == 0 ||
+            count > UINT32_MAX) {
+            return false;
+        }
+        chunking.push_back(static_cast<uint32_t>(count));
+    }
+    return !chunking.empty();
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t video_tracks = 1;
+    uint64_t audio_tracks = 1;
+    uint64_t samples = 3000;
+    uint64_t sample_size = 20000;
+    uint64_t gop = 60;
+    uint64_t fragment_ms = 0;
+    std::vector<uint32_t> chunking = {30};
+    bool ctts = false;
+    bool variable_delta = false;
+    bool moov_at_end = false;
+    bool co64 = false;
+    bool large_mdat = false;
+    bool sparse = false;
+
+    int ch;
+    bool ok = true;
+    while ((ch = getopt(argc, argv, "v:a:n:s:c:g:bre6lF:z")) != -1) {
+        switch (ch) {
+            case 'v':
+                ok = ok && parseCount(optarg, video_tracks);
+                break;
+            case 'a':
+                ok = ok && parseCount(optarg, audio_tracks);
+                break;
+            case 'n':
+                ok = ok && parseCount(optarg, samples);
+                break;
+            case 's':
+                ok = ok && parseCount(optarg, sample_size) &&
+                     sample_size > 0 && sample_size <= UINT32_MAX / 4;
+                break;
+            case 'c':
+                ok = ok && parseChunking(optarg, chunking);
+                break;
+            case 'g':
+                ok = ok && parseCount(optarg, gop) && gop <= UINT32_MAX;
+                break;
+            case 'b':
+                ctts = true;
+                break;
+            case 'r':
+                variable_delta = true;
+                break;
+            case 'e':
+                moov_at_end = true;
+                break;
+            case '6':
+                co64 = true;
+                break;
+            case 'l':
+                large_mdat = true;
+                break;
+            case 'F':
+                ok = ok && parseCount(optarg, fragment_ms) &&
+                     fragment_ms > 0 && fragment_ms <= UINT32_MAX;
+                break;
+            case 'z':
+                sparse = true;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    if (!ok || optind + 1 != argc || video_tracks + audio_tracks == 0 ||
+        video_tracks + audio_tracks > UINT32_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    auto spec = mov::avSpec(video_tracks, audio_tracks, samples, chunking);
+    for (size_t i = 0; i < video_tracks; i++) {
+        auto &track = spec.tracks_[i];
+        track.sample_size_ = static_cast<uint32_t>(sample_size);
+        track.gop_ = static_cast<uint32_t>(gop);
+        track.ctts_ = ctts;
+        track.variable_delta_ = variable_delta;
+    }
+    spec.faststart_ = !moov_at_end;
+    spec.co64_ = co64;
+    spec.large_mdat_ = large_mdat;
+    spec.fragment_ms_ = static_cast<uint32_t>(fragment_ms);
+    spec.sparse_ = sparse;
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    mov::SyntheticWriter writer(std::move(spec));
+    if (!writer.write(argv[optind])) {
+        return 1;
+    }
+    auto ms = std::chrono::duration<double, std::milli>(Clock::now() - start)
+                  .count();
+    std::cout << argv[optind] << ": " << writer.fileSize() << " bytes, "
+              << video_tracks + audio_tracks << " tracks, "
+              << writer.sampleCount() << " samples, written in " << ms
+              << " ms\n";
+    return 0;
+}
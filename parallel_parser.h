@@ -0,0 +1,133 @@
+#pragma once
+
+#include <exception>
+#include <optional>
+
+#include "mp4.h"
+#include "thread_pool.h"
+
+namespace mov {
+
+/**
+ * Parser that spreads the trak boxes of moov over a thread pool
+ *
+ * Tracks are independent byte ranges, so each one is parsed by a worker with
+ * its own cursor over the shared input, and the results are put back in file
+ * order. Everything else is parsed on the calling thread. Input that can't
+ * be read from several threads at once is parsed serially.
+ */
+class ParallelParser {
+public:
+    /**
+     * With build_index, workers also build the sample and seek index of their
+     * track, which decodes its sample tables there instead of on first use.
+     */
+    explicit ParallelParser(ThreadPool &pool, bool build_index = false)
+        : pool_(pool), build_index_(build_index) {}
+
+    Box::Boxes parse(const char *path) {
+        FileOp file(path);
+        if (!file.open("r")) return Box::Boxes();
+        return parse(file);
+    }
+
+    Box::Boxes parse(FileOp &file) {
+        Box::Boxes boxes;
+        auto end = file.size();
+        for (auto pos = file.tell(); pos < end;) {
+            auto box = parseBox(file, pos, nullptr);
+            if (box == nullptr) break;
+            boxes.push_back(box);
+            if (box->size() == 0) break;
+            pos = box->offset() + box->size();
+        }
+        return boxes;
+    }
+
+private:
+    std::shared_ptr<Box> parseBox(FileOp &file, uint64_t pos, Box *parent) {
+        auto base = Box::parseBasic(file, pos);
+        if (base == nullptr) {
+            return nullptr;
+        }
+        base->setParent(parent);
+        auto box = toDetailType(std::move(base));
+        if (box->baseType() == Moov::tag_ &&
+            file.source()->concurrentReads()) {
+            parseMoov(file, *box);
+        } else {
+            box->parse(file);
+        }
+        return box;
+    }
+
+    // file is at the payload of moov
+    void parseMoov(FileOp &file, Box &moov) {
+        struct Slot {
+            std::shared_ptr<Box> box_;
+            std::exception_ptr error_;
+            // What the worker's parse cost, for the caller's StatsScope
+            ParseStats stats_;
+        };
+        std::vector<Slot> slots;
+        auto end = moov.offset() + moov.size();
+        for (auto pos = file.tell(); pos < end;) {
+            auto base = Box::parseBasic(file, pos);
+            if (base == nullptr) break;
+            base->setParent(&moov);
+            auto box = toDetailType(std::move(base));
+            if (box->baseType() != Trak::tag_) {
+                box->parse(file);
+            }
+            slots.push_back(Slot{box, nullptr, {}});
+            if (box->size() == 0) break;
+            pos = box->offset() + box->size();
+        }
+
+        // slots doesn't change size from here on
+        auto stats = StatsScope::active();
+        for (auto &slot : slots) {
+            if (slot.box_->baseType() == Trak::tag_) {
+                pool_.submit([this, source = file.source(), &slot, stats] {
+                    parseTrak(source, slot, stats != nullptr);
+                });
+            }
+        }
+        pool_.wait();
+        for (auto &slot : slots) {
+            if (stats != nullptr) {
+                stats->merge(slot.stats_);
+            }
+            if (slot.error_) {
+                std::rethrow_exception(slot.error_);
+            }
+            moov.appendChild(std::move(slot.box_));
+        }
+    }
+
+    template <typename Slot>
+    void parseTrak(const std::shared_ptr<ByteSource> &source, Slot &slot,
+                   bool counted) {
+        std::optional<StatsScope> scope;
+        if (counted) {
+            scope.emplace(slot.stats_);
+        }
+        try {
+            auto &trak = static_cast<Trak &>(*slot.box_);
+            FileOp cursor(source);
+            Box::parseBasic(cursor, trak.offset());
+            trak.parse(cursor);
+            if (build_index_) {
+                trak.sampleIndex();
+                trak.seekIndex();
+            }
+        } catch (...) {
+            slot.error_ = std::current_exception();
+        }
+    }
+
+    ThreadPool &pool_;
+    bool build_index_;
+};
+
+}  // namespace mov
@@ -0,0 +1,174 @@
+#pragma once
+
+#include "box_visitor.h"
+#include "mp4.h"
+
+namespace mov {
+
+enum ProbeField : uint32_t {
+    kProbeDuration = 1U << 0U,    // movie duration
+    kProbeTimescale = 1U << 1U,   // movie timescale
+    kProbeTrackCount = 1U << 2U,  // number of trak boxes
+    kProbeDimensions = 1U << 3U,  // per track codec, width and height
+    kProbeLanguage = 1U << 4U,    // per track language
+    kProbeAll = (1U << 5U) - 1,
+};
+
+/**
+ * Summary of a file, filled in only for the fields that were asked for
+ */
+struct ProbeInfo {
+    struct Track {
+        uint32_t track_id_ = 0;
+        uint32_t handler_type_ = Box::str2BoxType("und ");
+        uint32_t timescale_ = 0;
+        uint64_t duration_ = 0;
+        uint32_t codec_ = 0;
+        uint32_t width_ = 0;
+        uint32_t height_ = 0;
+        std::string language_;
+    };
+
+    uint32_t fields_ = 0;
+    uint32_t timescale_ = 0;
+    uint64_t duration_ = 0;
+    uint32_t track_count_ = 0;
+    std::vector<Track> tracks_;
+};
+
+/**
+ * Walks only as far as the requested fields need: sample tables are skipped
+ * without being read, boxes after moov are never visited, and movie level
+ * fields alone stop the walk at mvhd.
+ */
+class ProbeVisitor : public BoxVisitor {
+public:
+    ProbeVisitor(uint32_t fields, ProbeInfo &info)
+        : fields_(fields), info_(info) {
+        info_ = ProbeInfo();
+        info_.fields_ = fields;
+    }
+
+    Action enter(const BoxHeader &header, FileOp &file) override {
+        if (done_) return Action::Stop;
+        auto type = header.type_;
+        auto parent = path_.empty() ? nullptr : path_.back().get();
+        auto parent_type = parent ? parent->baseType() : 0;
+        bool per_track = fields_ & (kProbeDimensions | kProbeLanguage);
+
+        if (parent == nullptr) {
+            // Everything we want is in moov
+            if (type != Moov::tag_) return Action::Skip;
+        } else if (type == Mvhd::tag_) {
+            auto mvhd = parseAs<Mvhd>(header, file, parent);
+            info_.timescale_ = mvhd->timescale();
+            info_.duration_ = mvhd->duration();
+            if (!(fields_ & (kProbeTrackCount | kProbeDimensions |
+                             kProbeLanguage))) {
+                return Action::Stop;
+            }
+            return Action::Skip;
+        } else if (type == Trak::tag_) {
+            info_.track_count_++;
+            if (!per_track) return Action::Skip;
+            info_.tracks_.emplace_back();
+        } else if (parent_type == Trak::tag_) {
+            if (type == Tkhd::tag_) {
+                track().track_id_ = parseAs<Tkhd>(header, file, parent)
+                                        ->trackId();
+                return Action::Skip;
+            }
+            if (type != Mdia::tag_) return Action::Skip;
+        } else if (parent_type == Mdia::tag_) {
+            if (type == Mdhd::tag_ || type == Hdlr::tag_) {
+                auto box = parseDetail(header, file, parent);
+                parent->appendChild(box);
+                if (type == Mdhd::tag_) {
+                    auto mdhd = static_cast<Mdhd *>(box.get());
+                    track().timescale_ = mdhd->timescale();
+                    track().duration_ = mdhd->duration();
+                    track().language_ = mdhd->language();
+                } else {
+                    track().handler_type_ =
+                        static_cast<Hdlr *>(box.get())->handleType();
+                }
+                return Action::Skip;
+            }
+            if (type != Minf::tag_ || !(fields_ & kProbeDimensions)) {
+                return Action::Skip;
+            }
+        } else if (parent_type == Minf::tag_) {
+            if (type != Stbl::tag_) return Action::Skip;
+        } else if (parent_type == Stbl::tag_) {
+            // The sample tables are never read
+            if (type != Stsd::tag_) return Action::Skip;
+        } else if (parent_type == Stsd::tag_) {
+            // Only the first sample entry describes the track
+            if (track().codec_ != 0) return Action::Skip;
+            auto entry = parseDetail(header, file, parent);
+            track().codec_ = type;
+            if (static_cast<Stsd *>(parent)->handlerType() ==
+                Box::str2BoxType("vide")) {
+                auto video = static_cast<VideoSampleEntry *>(entry.get());
+                track().width_ = video->width();
+                track().height_ = video->height();
+            }
+            return Action::Skip;
+        }
+
+        path_.push_back(parseDetail(header, file, parent));
+        return Action::Continue;
+    }
+
+    void leave(const BoxHeader &header) override {
+        // Skipped boxes never made it onto the path
+        if (path_.empty() || path_.back()->offset() != header.offset_) {
+            return;
+        }
+        path_.pop_back();
+        if (path_.empty()) {
+            // moov is done
+            done_ = true;
+        }
+    }
+
+    Action payload(const BoxHeader &, FileOp &) override {
+        return Action::Skip;
+    }
+
+    bool done() const { return done_; }
+
+private:
+    template <typename T>
+    std::shared_ptr<T> parseAs(const BoxHeader &header, FileOp &file,
+                               Box *parent) {
+        return std::static_pointer_cast<T>(parseDetail(header, file, parent));
+    }
+
+    ProbeInfo::Track &track() {
+        if (info_.tracks_.empty()) info_.tracks_.emplace_back();
+        return info_.tracks_.back();
+    }
+
+    uint32_t fields_;
+    ProbeInfo &info_;
+    std::vector<std::shared_ptr<Box>> path_;
+    bool done_ = false;
+};
+
+/**
+ * Read the requested fields from file. Return false if no moov was found.
+ */
+inline bool probe(FileOp &file, uint32_t fields, ProbeInfo &info) {
+    ProbeVisitor visitor(fields, info);
+    walkBoxes(file, visitor);
+    return visitor.done() || info.timescale_ != 0;
+}
+
+inline bool probe(const char *path, uint32_t fields, ProbeInfo &info) {
+    FileOp file(path);
+    if (!file.open("r")) return false;
+    return probe(file, fields, info);
+}
+
+}  // namespace mov
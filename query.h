@@ -0,0 +1,242 @@
+#pragma once
+
+#include <map>
+#include <tuple>
+
+#include "box_tree.h"
+
+namespace mov {
+
+/**
+ * The value [type=value] compares against: handler type of hdlr, track id
+ * of tkhd, tfhd, trex and tfra, language of mdhd, major brand of ftyp.
+ * Other boxes have none.
+ */
+inline std::string boxKey(Box &box) {
+    if (auto hdlr = box.as<Hdlr>()) {
+        return Box::boxType2Str(hdlr->handleType());
+    }
+    if (auto tkhd = box.as<Tkhd>()) return std::to_string(tkhd->trackId());
+    if (auto tfhd = box.as<Tfhd>()) return std::to_string(tfhd->trackId());
+    if (auto trex = box.as<Trex>()) return std::to_string(trex->trackId());
+    if (auto tfra = box.as<Tfra>()) return std::to_string(tfra->trackId());
+    if (auto mdhd = box.as<Mdhd>()) return mdhd->language();
+    if (auto ftyp = box.as<Ftyp>()) {
+        return Box::boxType2Str(ftyp->majorBrand());
+    }
+    return std::string();
+}
+
+/**
+ * Box path query over a BoxTree
+ *
+ * A path is steps separated by '/', starting at the top level boxes. A
+ * step is a box type ("url" stands for "url "), "*" for any one box or
+ * "**" for any number of levels, and may be followed by predicates:
+ *
+ *   [n]           the n-th of the siblings matched so far, from 0, or
+ *                 from the end when negative
+ *   [type]        has a box of that type somewhere below it
+ *   [type=value]  has one whose boxKey() is value
+ *
+ * so "moov/trak[hdlr=soun]/mdia/mdhd" is the mdhd of every sound track, and
+ * a path that starts with "**" finds its boxes at any depth. Matching
+ * starts from the boxes of the last step's type, taken from the tree's type
+ * index, and checks the earlier steps against their ancestors; predicates
+ * look up the index by offset range. The cost follows the number of
+ * candidates, not the size of the tree.
+ */
+class BoxQuery {
+public:
+    using Index = BoxTree::Index;
+
+    /**
+     * Parse path. Return false with a message in error if it is not a
+     * valid path.
+     */
+    bool compile(const std::string &path, std::string &error) {
+        steps_.clear();
+        size_t pos = path.size() > 0 && path[0] == '/' ? 1 : 0;
+        while (true) {
+            Step step;
+            auto end = path.find_first_of("/[", pos);
+            auto name = path.substr(pos, end - pos);
+            if (name == "**") {
+                step.deep_ = true;
+            } else if (name != "*") {
+                if (name.empty() || name.size() > 4 ||
+                    name.find_first_of("]=*") != std::string::npos) {
+                    error = "bad box type '" + name + "'";
+                    return false;
+                }
+                step.type_ = toType(name);
+            }
+            pos = end;
+            while (pos < path.size() && path[pos] == '[') {
+                auto close = path.find(']', pos);
+                if (close == std::string::npos || step.deep_ ||
+                    !parsePredicate(path.substr(pos + 1, close - pos - 1),
+                                    step)) {
+                    error = "bad predicate at " + std::to_string(pos);
+                    return false;
+                }
+                pos = close + 1;
+            }
+            steps_.push_back(std::move(step));
+            if (pos >= path.size()) break;
+            if (path[pos] != '/') {
+                error = "expected / at " + std::to_string(pos);
+                return false;
+            }
+            pos++;
+        }
+        return true;
+    }
+
+    // Boxes the path matches, in file order
+    std::vector<Index> run(const BoxTree &tree) const {
+        std::vector<Index> result;
+        siblings_.clear();
+        if (steps_.empty()) return result;
+        const auto &last = steps_.back();
+        if (!last.deep_ && last.type_ != 0) {
+            for (auto i : tree.boxes(last.type_)) {
+                if (before(tree, i, steps_.size())) result.push_back(i);
+            }
+            return result;
+        }
+        for (Index i = 0; i < tree.size(); i++) {
+            if (before(tree, i, steps_.size())) result.push_back(i);
+        }
+        std::sort(result.begin(), result.end(), [&tree](Index a, Index b) {
+            return tree.node(a).offset_ < tree.node(b).offset_;
+        });
+        return result;
+    }
+
+private:
+    struct Predicate {
+        enum Kind { Position, Has, Equals } kind_;
+        int64_t position_ = 0;
+        uint32_t type_ = 0;
+        std::string value_;
+    };
+
+    struct Step {
+        bool deep_ = false;
+        // 0 for any type
+        uint32_t type_ = 0;
+        std::vector<Predicate> predicates_;
+    };
+
+    static uint32_t toType(std::string name) {
+        name.resize(4, ' ');
+        uint32_t type;
+        memcpy(&type, name.data(), 4);
+        return type;
+    }
+
+    static bool parsePredicate(const std::string &text, Step &step) {
+        Predicate predicate;
+        char *end = nullptr;
+        predicate.position_ = strtoll(text.c_str(), &end, 10);
+        if (!text.empty() && end == text.c_str() + text.size()) {
+            predicate.kind_ = Predicate::Position;
+            step.predicates_.push_back(predicate);
+            return true;
+        }
+        auto equals = text.find('=');
+        auto name = text.substr(0, equals);
+        if (name.empty() || name.size() > 4) return false;
+        predicate.type_ = toType(name);
+        predicate.kind_ = Predicate::Has;
+        if (equals != std::string::npos) {
+            predicate.kind_ = Predicate::Equals;
+            predicate.value_ = text.substr(equals + 1);
+        }
+        step.predicates_.push_back(std::move(predicate));
+        return true;
+    }
+
+    /**
+     * Whether steps [0, count) match the chain of boxes from the top level
+     * down to box i, npos standing for the empty chain
+     */
+    bool before(const BoxTree &tree, Index i, size_t count) const {
+        if (count == 0) return i == BoxTree::npos;
+        const auto &step = steps_[count - 1];
+        if (step.deep_) {
+            return before(tree, i, count - 1) ||
+                   (i != BoxTree::npos &&
+                    before(tree, tree.node(i).parent_, count));
+        }
+        return i != BoxTree::npos && matches(tree, i, step, SIZE_MAX) &&
+               before(tree, tree.node(i).parent_, count - 1);
+    }
+
+    // Whether box i passes the type and the first count predicates of step
+    bool matches(const BoxTree &tree, Index i, const Step &step,
+                 size_t count) const {
+        if (step.type_ != 0 && tree.node(i).type_ != step.type_) {
+            return false;
+        }
+        count = std::min(count, step.predicates_.size());
+        for (size_t p = 0; p < count; p++) {
+            const auto &predicate = step.predicates_[p];
+            if (predicate.kind_ == Predicate::Position) {
+                if (!atPosition(tree, i, step, p)) return false;
+                continue;
+            }
+            auto range = tree.within(i, predicate.type_);
+            if (predicate.kind_ == Predicate::Has) {
+                if (range.first == range.second) return false;
+                continue;
+            }
+            if (std::none_of(range.first, range.second, [&](Index b) {
+                    return boxKey(*tree.box(b)) == predicate.value_;
+                })) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Whether predicate p of step, a position, holds for box i, which has
+     * passed the type and the predicates before p. The siblings that pass
+     * them as well are listed once per parent and run, so a position
+     * predicate over many siblings isn't quadratic.
+     */
+    bool atPosition(const BoxTree &tree, Index i, const Step &step,
+                    size_t p) const {
+        auto parent = tree.node(i).parent_;
+        auto key = std::make_tuple(parent, &step, p);
+        auto it = siblings_.find(key);
+        if (it == siblings_.end()) {
+            auto range = parent == BoxTree::npos ? tree.roots()
+                                                 : tree.children(parent);
+            std::vector<Index> matched;
+            for (Index s = range.first; s < range.first + range.second;
+                 s++) {
+                if (matches(tree, s, step, p)) matched.push_back(s);
+            }
+            it = siblings_.emplace(key, std::move(matched)).first;
+        }
+        const auto &matched = it->second;
+        auto found = std::lower_bound(matched.begin(), matched.end(), i);
+        if (found == matched.end() || *found != i) return false;
+        int64_t position = found - matched.begin();
+        int64_t count = matched.size();
+        auto wanted = step.predicates_[p].position_;
+        return position == (wanted < 0 ? count + wanted : wanted);
+    }
+
+    std::vector<Step> steps_;
+    // Siblings passing a step up to a predicate, by parent, step and
+    // predicate, for the run in progress
+    mutable std::map<std::tuple<Index, const Step *, size_t>,
+                     std::vector<Index>>
+        siblings_;
+};
+
+}  // namespace mov
@@ -0,0 +1,121 @@
+#include <stdlib.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+#include "mp4.h"
+
+// Build an in memory stts box with variable length runs covering
+// sample_count samples, roughly what a variable frame rate track looks like.
+static std::vector<uint8_t> makeStts(uint64_t sample_count,
+                                     std::mt19937 &rng) {
+    std::vector<uint32_t> fields;
+    std::uniform_int_distribution<uint32_t> run_len(1, 20);
+    std::uniform_int_distribution<uint32_t> delta(1000, 1010);
+    for (uint64_t n = 0; n < sample_count;) {
+        uint32_t count = std::min<uint64_t>(run_len(rng), sample_count - n);
+        fields.push_back(count);
+        fields.push_back(delta(rng));
+        n += count;
+    }
+    std::vector<uint8_t> buf;
+    auto put32 = [&buf](uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            buf.push_back(static_cast<uint8_t>(v >> shift));
+        }
+    };
+    put32(8 + 4 + 4 + fields.size() * 4);
+    buf.insert(buf.end(), {'s', 't', 't', 's'});
+    put32(0);
+    put32(fields.size() / 2);
+    for (auto v : fields) put32(v);
+    return buf;
+}
+
+static std::vector<uint8_t> makeStss(uint64_t sample_count, uint32_t gop) {
+    std::vector<uint8_t> buf;
+    auto put32 = [&buf](uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            buf.push_back(static_cast<uint8_t>(v >> shift));
+        }
+    };
+    uint32_t count = (sample_count + gop - 1) / gop;
+    put32(8 + 4 + 4 + count * 4);
+    buf.insert(buf.end(), {'s', 't', 's', 's'});
+    put32(0);
+    put32(count);
+    for (uint32_t i = 0; i < count; i++) put32(i * gop + 1);
+    return buf;
+}
+
+template <typename T>
+static std::shared_ptr<T> parseBox(std::vector<uint8_t> data) {
+    mov::FileOp file(std::make_shared<mov::MemorySource>(std::move(data)));
+    auto box = mov::toDetailType(mov::Box::parseBasic(file));
+    box->parse(file);
+    return std::dynamic_pointer_cast<T>(box);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t sample_count = argc > 1 ? strtoull(argv[1], nullptr, 10)
+                                     : 10000000;
+    const size_t queries = 1000000;
+    std::mt19937 rng(1);
+
+    auto stts = parseBox<mov::Stts>(makeStts(sample_count, rng));
+    auto stss = parseBox<mov::Stss>(makeStss(sample_count, 60));
+
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    mov::SeekIndex index;
+    index.build(*stts, stss.get(), 90000);
+    auto build_us = std::chrono::duration<double, std::micro>(Clock::now() -
+                                                              start)
+                        .count();
+
+    std::uniform_int_distribution<uint64_t> time(0, index.duration() - 1);
+    std::vector<uint64_t> times(queries);
+    for (auto &t : times) t = time(rng);
+
+    uint64_t checksum = 0;
+    start = Clock::now();
+    for (auto t : times) {
+        checksum += index.syncSampleAtTime(t);
+    }
+    auto seek_ns = std::chrono::duration<double, std::nano>(Clock::now() -
+                                                            start)
+                       .count() /
+                   queries;
+
+    // Reference: walk the runs from the start, as a caller would without the
+    // index. Only a few queries, it is slow.
+    const size_t linear_queries = 100;
+    start = Clock::now();
+    for (size_t i = 0; i < linear_queries; i++) {
+        uint64_t sample = 0;
+        uint64_t acc = 0;
+        for (const auto &entry : stts->entries()) {
+            uint64_t span = (uint64_t)entry.sample_count_ * entry.sample_delta_;
+            if (acc + span > times[i]) {
+                sample += (times[i] - acc) / entry.sample_delta_;
+                break;
+            }
+            acc += span;
+            sample += entry.sample_count_;
+        }
+        checksum += sample;
+    }
+    auto linear_ns = std::chrono::duration<double, std::nano>(Clock::now() -
+                                                              start)
+                         .count() /
+                     linear_queries;
+
+    std::cout << "samples: " << index.sampleCount()
+              << ", stts entries: " << stts->entries().size()
+              << ", build: " << build_us << " us"
+              << ", seek: " << seek_ns << " ns"
+              << ", linear scan: " << linear_ns << " ns"
+              << ", checksum: " << checksum << '\n';
+    return EXIT_SUCCESS;
+}
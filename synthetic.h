@@ -0,0 +1,871 @@
+#pragma once
+
+#include "faststart.h"
+#include "mp4.h"
+
+namespace mov {
+
+/**
+ * One track of a synthetic file
+ *
+ * Sample sizes and durations vary around the given values in a fixed
+ * pattern, so the same spec always gives the same file.
+ */
+struct SyntheticTrack {
+    uint32_t handler_type_ = Box::str2BoxType("vide");
+    uint32_t timescale_ = 30000;
+    uint32_t sample_delta_ = 1001;
+    uint64_t sample_count_ = 0;
+    // Average sample size, sync samples are kSyncScale times bigger
+    uint32_t sample_size_ = 20000;
+    // Samples per chunk, cycled through chunk after chunk
+    std::vector<uint32_t> chunking_ = {30};
+    // Every gop_-th sample is a sync sample, all of them when 0
+    uint32_t gop_ = 0;
+    // Composition offsets in a B frame pattern, in ctts or in trun
+    bool ctts_ = false;
+    // Durations one tick off either way, so stts has about one entry for
+    // every sample instead of one in all
+    bool variable_delta_ = false;
+
+    static SyntheticTrack video(uint64_t samples) {
+        SyntheticTrack track;
+        track.sample_count_ = samples;
+        track.gop_ = 60;
+        return track;
+    }
+
+    static SyntheticTrack audio(uint64_t samples) {
+        SyntheticTrack track;
+        track.handler_type_ = Box::str2BoxType("soun");
+        track.timescale_ = 48000;
+        track.sample_delta_ = 1024;
+        track.sample_count_ = samples;
+        track.sample_size_ = 400;
+        return track;
+    }
+};
+
+struct SyntheticSpec {
+    std::vector<SyntheticTrack> tracks_;
+    // moov ahead of mdat, after it otherwise
+    bool faststart_ = true;
+    // co64 even where stco would do, it is used anyway when it wouldn't
+    bool co64_ = false;
+    // 64 bit mdat size even where 32 bits would do
+    bool large_mdat_ = false;
+    // Fragment duration in milliseconds, 0 for a file without fragments
+    uint32_t fragment_ms_ = 0;
+    // Leave the sample data a hole rather than fill it
+    bool sparse_ = false;
+};
+
+/**
+ * video_tracks video tracks of video_samples samples each, then audio_tracks
+ * audio tracks as long as them. chunking is that of the video, an audio
+ * chunk covers the time of the video chunk it goes with.
+ */
+inline SyntheticSpec avSpec(size_t video_tracks, size_t audio_tracks,
+                            uint64_t video_samples,
+                            std::vector<uint32_t> chunking = {30}) {
+    SyntheticSpec spec;
+    auto video = SyntheticTrack::video(video_samples);
+    video.chunking_ = chunking;
+    auto audio = SyntheticTrack::audio(0);
+    // Audio samples per video sample
+    auto ratio = static_cast<long double>(video.sample_delta_) *
+                 audio.timescale_ / video.timescale_ / audio.sample_delta_;
+    audio.sample_count_ = static_cast<uint64_t>(video_samples * ratio + 0.5L);
+    audio.chunking_.clear();
+    for (auto count : chunking) {
+        audio.chunking_.push_back(
+            std::max<uint32_t>(1, static_cast<uint32_t>(count * ratio)));
+    }
+    spec.tracks_.assign(video_tracks, video);
+    spec.tracks_.insert(spec.tracks_.end(), audio_tracks, audio);
+    return spec;
+}
+
+/**
+ * Writes a structurally valid MP4 as described by a SyntheticSpec, for
+ * testing and benchmarking at sizes no sample file has
+ *
+ * The sample data is fake: every sample is its size in fillByte() bytes,
+ * so a reader can check it got the right bytes for a sample. Sample tables
+ * are built in memory, the sample data is streamed out, so writing a file
+ * of many GB takes little memory. A file without fragments has one mdat,
+ * with chunks of all tracks in decoding time order, switching to co64 and a
+ * 64 bit mdat size where offsets need it. A fragmented one has an empty
+ * moov with mvex, a moof and mdat per fragment_ms_ of every track and an
+ * mfra with a tfra entry per fragment and track that has a sync sample.
+ */
+class SyntheticWriter {
+public:
+    static const uint32_t kSyncScale = 4;
+
+    explicit SyntheticWriter(SyntheticSpec spec) : spec_(std::move(spec)) {}
+
+    // Byte that sample n of spec track track is filled with
+    static uint8_t fillByte(size_t track, uint64_t n) {
+        return static_cast<uint8_t>(track * 16 + n + 1);
+    }
+
+    /**
+     * Write the file to path, replacing what is there. Return false with a
+     * message on std::cerr if the spec is invalid or writing fails.
+     */
+    bool write(const char *path) {
+        if (!plan()) {
+            return false;
+        }
+        out_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_ < 0) {
+            std::cerr << "open " << path << " failed: " << strerror(errno)
+                      << '\n';
+            return false;
+        }
+        pos_ = 0;
+        bool ok = spec_.fragment_ms_ > 0 ? writeFragmented() : writePlain();
+        ok = flush() && ftruncate(out_, pos_) == 0 && ok;
+        ok = close(out_) == 0 && ok;
+        out_ = -1;
+        if (!ok) {
+            std::cerr << "write " << path << " failed\n";
+        }
+        return ok;
+    }
+
+    // Size of the file written last
+    uint64_t fileSize() const { return pos_; }
+
+    uint64_t sampleCount() const {
+        uint64_t count = 0;
+        for (const auto &track : spec_.tracks_) count += track.sample_count_;
+        return count;
+    }
+
+private:
+    struct Track {
+        std::vector<uint32_t> sizes_;
+        // Empty unless the spec varies them
+        std::vector<uint32_t> deltas_;
+        uint64_t duration_ = 0;
+        // Samples in each chunk, and where the chunk ends up in the file
+        std::vector<uint32_t> chunk_samples_;
+        std::vector<uint64_t> chunk_offsets_;
+        // Where the chunk offset table is in the moov being built
+        size_t offsets_at_ = 0;
+    };
+
+    // A run of samples of one track, stored together
+    struct Chunk {
+        uint32_t track_;
+        uint32_t samples_;
+        uint64_t first_;
+        uint64_t bytes_;
+    };
+
+    /**
+     * Appends boxes to a buffer, each box sized when it ends
+     */
+    class Builder {
+    public:
+        std::vector<uint8_t> &data() { return data_; }
+
+        void begin(const char (&type)[5]) {
+            open_.push_back(data_.size());
+            u32(0);
+            data_.insert(data_.end(), type, type + 4);
+        }
+
+        void beginFull(const char (&type)[5], uint8_t version,
+                       uint32_t flags) {
+            begin(type);
+            u32(static_cast<uint32_t>(version) << 24U | flags);
+        }
+
+        void end() {
+            auto at = open_.back();
+            open_.pop_back();
+            putBigU32(data_.data() + at,
+                      static_cast<uint32_t>(data_.size() - at));
+        }
+
+        void u8(uint8_t v) { data_.push_back(v); }
+
+        void u16(uint16_t v) { putBigU16(grow(2), v); }
+
+        void u32(uint32_t v) { putBigU32(grow(4), v); }
+
+        void u64(uint64_t v) { putBigU64(grow(8), v); }
+
+        // 32 bits in version 0, 64 in version 1
+        void time(uint8_t version, uint64_t v) {
+            if (version == 1) {
+                u64(v);
+            } else {
+                u32(static_cast<uint32_t>(v));
+            }
+        }
+
+        void zeros(size_t n) { data_.resize(data_.size() + n); }
+
+        void bytes(const char *s, size_t n) {
+            data_.insert(data_.end(), s, s + n);
+        }
+
+        void u32Array(const std::vector<uint32_t> &v) {
+            BoxWriter(grow(v.size() * 4), v.size() * 4)
+                .writeBigU32Array(v.data(), v.size());
+        }
+
+        void u64Array(const std::vector<uint64_t> &v) {
+            BoxWriter(grow(v.size() * 8), v.size() * 8)
+                .writeBigU64Array(v.data(), v.size());
+        }
+
+        // Identity transformation matrix
+        void matrix() {
+            for (uint32_t v : {0x10000U, 0U, 0U, 0U, 0x10000U, 0U, 0U, 0U,
+                               0x40000000U}) {
+                u32(v);
+            }
+        }
+
+    private:
+        uint8_t *grow(size_t n) {
+            data_.resize(data_.size() + n);
+            return data_.data() + data_.size() - n;
+        }
+
+        std::vector<uint8_t> data_;
+        std::vector<size_t> open_;
+    };
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30U)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27U)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31U);
+    }
+
+    static bool isSync(const SyntheticTrack &track, uint64_t n) {
+        return track.gop_ == 0 || n % track.gop_ == 0;
+    }
+
+    static uint32_t ctsOffset(const SyntheticTrack &track, uint64_t n) {
+        return static_cast<uint32_t>(n % 3) * track.sample_delta_;
+    }
+
+    uint32_t delta(size_t t, uint64_t n) const {
+        const auto &deltas = tracks_[t].deltas_;
+        return deltas.empty() ? spec_.tracks_[t].sample_delta_ : deltas[n];
+    }
+
+    // Sizes, durations and chunks of every track
+    bool plan() {
+        if (spec_.tracks_.empty()) {
+            std::cerr << "no tracks\n";
+            return false;
+        }
+        tracks_.assign(spec_.tracks_.size(), Track());
+        for (size_t t = 0; t < spec_.tracks_.size(); t++) {
+            const auto &spec = spec_.tracks_[t];
+            if (spec.timescale_ == 0 || spec.sample_delta_ < 2 ||
+                spec.sample_size_ == 0 || spec.chunking_.empty() ||
+                std::count(spec.chunking_.begin(), spec.chunking_.end(), 0) ||
+                spec.sample_count_ > UINT32_MAX) {
+                std::cerr << "invalid track " << t + 1 << '\n';
+                return false;
+            }
+            auto &track = tracks_[t];
+            track.sizes_.resize(spec.sample_count_);
+            if (spec.variable_delta_) {
+                track.deltas_.resize(spec.sample_count_);
+            }
+            for (uint64_t n = 0; n < spec.sample_count_; n++) {
+                auto r = mix(t << 40U ^ n);
+                track.sizes_[n] = isSync(spec, n) && spec.gop_ > 0
+                                      ? spec.sample_size_ * kSyncScale
+                                      : spec.sample_size_ / 2 + 1 +
+                                            r % spec.sample_size_;
+                if (spec.variable_delta_) {
+                    track.deltas_[n] = spec.sample_delta_ - 1 + (r >> 32U) % 3;
+                }
+                track.duration_ += delta(t, n);
+            }
+            if (spec_.fragment_ms_ > 0) continue;
+            for (uint64_t n = 0, i = 0; n < spec.sample_count_; i++) {
+                auto count = std::min<uint64_t>(
+                    spec.chunking_[i % spec.chunking_.size()],
+                    spec.sample_count_ - n);
+                track.chunk_samples_.push_back(static_cast<uint32_t>(count));
+                n += count;
+            }
+        }
+        if (spec_.fragment_ms_ == 0) {
+            planChunks();
+        }
+        return true;
+    }
+
+    // Order the chunks of all tracks by decoding time, as a muxer would
+    void planChunks() {
+        struct Cursor {
+            size_t chunk_ = 0;
+            uint64_t sample_ = 0;
+            uint64_t dts_ = 0;
+        };
+        std::vector<Cursor> cursors(tracks_.size());
+        auto seconds = [&](size_t t) {
+            return static_cast<long double>(cursors[t].dts_) /
+                   spec_.tracks_[t].timescale_;
+        };
+        auto later = [&](size_t a, size_t b) {
+            auto sa = seconds(a);
+            auto sb = seconds(b);
+            return sa != sb ? sa > sb : a > b;
+        };
+        std::vector<size_t> heap;
+        for (size_t t = 0; t < tracks_.size(); t++) {
+            if (!tracks_[t].chunk_samples_.empty()) heap.push_back(t);
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+        chunks_.clear();
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            auto t = heap.back();
+            heap.pop_back();
+            auto &cursor = cursors[t];
+            auto &track = tracks_[t];
+            Chunk chunk{static_cast<uint32_t>(t),
+                        track.chunk_samples_[cursor.chunk_], cursor.sample_,
+                        0};
+            for (uint32_t i = 0; i < chunk.samples_; i++) {
+                chunk.bytes_ += track.sizes_[cursor.sample_];
+                cursor.dts_ += delta(t, cursor.sample_++);
+            }
+            chunks_.push_back(chunk);
+            if (++cursor.chunk_ < track.chunk_samples_.size()) {
+                heap.push_back(t);
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+    }
+
+    bool writePlain() {
+        uint64_t payload = 0;
+        for (const auto &chunk : chunks_) payload += chunk.bytes_;
+        bool large = spec_.large_mdat_ || payload + 8 > UINT32_MAX;
+        uint64_t mdat_header = large ? 16 : 8;
+
+        Builder head;
+        writeFtyp(head, "isom", {"isom", "iso2", "avc1", "mp41"});
+        Builder moov;
+        bool co64 = spec_.co64_;
+        uint64_t base = 0;
+        while (true) {
+            moov = Builder();
+            writeMoov(moov, co64);
+            base = head.data().size() + mdat_header +
+                   (spec_.faststart_ ? moov.data().size() : 0);
+            if (co64 || base + payload <= UINT32_MAX) break;
+            co64 = true;
+        }
+
+        auto pos = base;
+        for (auto &track : tracks_) track.chunk_offsets_.clear();
+        for (const auto &chunk : chunks_) {
+            tracks_[chunk.track_].chunk_offsets_.push_back(pos);
+            pos += chunk.bytes_;
+        }
+        for (const auto &track : tracks_) {
+            auto at = moov.data().data() + track.offsets_at_;
+            for (size_t i = 0; i < track.chunk_offsets_.size(); i++) {
+                auto offset = track.chunk_offsets_[i];
+                if (co64) {
+                    putBigU64(at + i * 8, offset);
+                } else {
+                    putBigU32(at + i * 4, static_cast<uint32_t>(offset));
+                }
+            }
+        }
+
+        if (spec_.faststart_) {
+            head.data().insert(head.data().end(), moov.data().begin(),
+                               moov.data().end());
+        }
+        if (!append(head.data())) {
+            return false;
+        }
+        writeMdatHeader(payload, large);
+        for (const auto &chunk : chunks_) {
+            for (uint64_t n = chunk.first_; n < chunk.first_ + chunk.samples_;
+                 n++) {
+                if (!fill(fillByte(chunk.track_, n),
+                          tracks_[chunk.track_].sizes_[n])) {
+                    return false;
+                }
+            }
+        }
+        return spec_.faststart_ || append(moov.data());
+    }
+
+    bool writeFragmented() {
+        Builder head;
+        writeFtyp(head, "iso6", {"iso6", "cmfc"});
+        writeMoov(head, false);
+        if (!append(head.data())) {
+            return false;
+        }
+
+        struct Cursor {
+            uint64_t sample_ = 0;
+            uint64_t dts_ = 0;
+        };
+        // Per track entries for tfra: time, moof offset, traf, sample
+        std::vector<std::vector<std::array<uint64_t, 4>>> random_access(
+            tracks_.size());
+        std::vector<Cursor> cursors(tracks_.size());
+        for (uint32_t sequence = 1;; sequence++) {
+            uint64_t end_ms = static_cast<uint64_t>(sequence) *
+                              spec_.fragment_ms_;
+            // Samples of each track in this fragment, by traf
+            std::vector<std::pair<size_t, uint64_t>> trafs;
+            for (size_t t = 0; t < tracks_.size(); t++) {
+                const auto &spec = spec_.tracks_[t];
+                uint64_t n = cursors[t].sample_;
+                uint64_t dts = cursors[t].dts_;
+                while (n < spec.sample_count_ &&
+                       dts * 1000 < end_ms * spec.timescale_) {
+                    dts += delta(t, n++);
+                }
+                if (n > cursors[t].sample_) {
+                    trafs.emplace_back(t, n - cursors[t].sample_);
+                }
+            }
+            if (trafs.empty()) {
+                bool done = true;
+                for (size_t t = 0; t < tracks_.size(); t++) {
+                    done = done &&
+                           cursors[t].sample_ == spec_.tracks_[t].sample_count_;
+                }
+                if (done) break;
+                continue;
+            }
+
+            Builder moof;
+            moof.begin("moof");
+            moof.beginFull("mfhd", 0, 0);
+            moof.u32(sequence);
+            moof.end();
+            std::vector<size_t> data_offsets;
+            for (size_t i = 0; i < trafs.size(); i++) {
+                auto t = trafs[i].first;
+                auto count = trafs[i].second;
+                const auto &spec = spec_.tracks_[t];
+                auto first = cursors[t].sample_;
+                for (uint64_t n = first; n < first + count; n++) {
+                    if (isSync(spec, n)) {
+                        uint64_t dts = cursors[t].dts_;
+                        for (uint64_t k = first; k < n; k++) {
+                            dts += delta(t, k);
+                        }
+                        random_access[t].push_back(
+                            {dts, tell(), i + 1, n - first + 1});
+                        break;
+                    }
+                }
+                data_offsets.push_back(writeTraf(moof, t, first, count,
+                                                 cursors[t].dts_));
+                for (uint64_t n = first; n < first + count; n++) {
+                    cursors[t].dts_ += delta(t, n);
+                }
+                cursors[t].sample_ += count;
+            }
+            moof.end();
+
+            uint64_t payload = 0;
+            for (const auto &traf : trafs) {
+                auto t = traf.first;
+                for (auto n = cursors[t].sample_ - traf.second;
+                     n < cursors[t].sample_; n++) {
+                    payload += tracks_[t].sizes_[n];
+                }
+            }
+            bool large = spec_.large_mdat_ || payload + 8 > UINT32_MAX;
+            uint64_t offset = moof.data().size() + (large ? 16 : 8);
+            for (size_t i = 0; i < trafs.size(); i++) {
+                if (offset > INT32_MAX) {
+                    std::cerr << "fragment of " << spec_.fragment_ms_
+                              << " ms too big\n";
+                    return false;
+                }
+                putBigU32(moof.data().data() + data_offsets[i],
+                          static_cast<uint32_t>(offset));
+                auto t = trafs[i].first;
+                for (auto n = cursors[t].sample_ - trafs[i].second;
+                     n < cursors[t].sample_; n++) {
+                    offset += tracks_[t].sizes_[n];
+                }
+            }
+            if (!append(moof.data())) {
+                return false;
+            }
+            writeMdatHeader(payload, large);
+            for (const auto &traf : trafs) {
+                auto t = traf.first;
+                for (auto n = cursors[t].sample_ - traf.second;
+                     n < cursors[t].sample_; n++) {
+                    if (!fill(fillByte(t, n), tracks_[t].sizes_[n])) {
+                        return false;
+                    }
+                }
+            }
+        }
+
+        Builder mfra;
+        mfra.begin("mfra");
+        for (size_t t = 0; t < tracks_.size(); t++) {
+            // 4 byte traf and sample numbers, 1 byte trun numbers
+            mfra.beginFull("tfra", 1, 0);
+            mfra.u32(static_cast<uint32_t>(t + 1));
+            mfra.u32(0x33);
+            mfra.u32(static_cast<uint32_t>(random_access[t].size()));
+            for (const auto &entry : random_access[t]) {
+                mfra.u64(entry[0]);
+                mfra.u64(entry[1]);
+                mfra.u32(static_cast<uint32_t>(entry[2]));
+                mfra.u8(1);
+                mfra.u32(static_cast<uint32_t>(entry[3]));
+            }
+            mfra.end();
+        }
+        mfra.beginFull("mfro", 0, 0);
+        mfra.u32(static_cast<uint32_t>(mfra.data().size() + 4));
+        mfra.end();
+        mfra.end();
+        return append(mfra.data());
+    }
+
+    /**
+     * A traf for count samples of track t from first, decoding from dts.
+     * Return where in moof its data offset goes.
+     */
+    size_t writeTraf(Builder &moof, size_t t, uint64_t first, uint64_t count,
+                     uint64_t dts) {
+        const auto &spec = spec_.tracks_[t];
+        moof.begin("traf");
+        // Data offsets are from the start of the moof
+        moof.beginFull("tfhd", 0, 0x20000);
+        moof.u32(static_cast<uint32_t>(t + 1));
+        moof.end();
+        moof.beginFull("tfdt", 1, 0);
+        moof.u64(dts);
+        moof.end();
+        uint32_t flags = Trun::kDataOffset | Trun::kSampleSize;
+        if (spec.variable_delta_) flags |= Trun::kSampleDuration;
+        if (spec.gop_ > 0) flags |= Trun::kSampleFlags;
+        if (spec.ctts_) flags |= Trun::kSampleCompositionOffset;
+        moof.beginFull("trun", 0, flags);
+        moof.u32(static_cast<uint32_t>(count));
+        auto data_offset = moof.data().size();
+        moof.u32(0);
+        for (uint64_t n = first; n < first + count; n++) {
+            if (spec.variable_delta_) moof.u32(delta(t, n));
+            moof.u32(tracks_[t].sizes_[n]);
+            if (spec.gop_ > 0) {
+                moof.u32(isSync(spec, n) ? 0x2000000 : 0x1010000);
+            }
+            if (spec.ctts_) moof.u32(ctsOffset(spec, n));
+        }
+        moof.end();
+        moof.end();
+        return data_offset;
+    }
+
+    static void writeFtyp(Builder &out, const char (&major)[5],
+                          std::initializer_list<const char *> compatible) {
+        out.begin("ftyp");
+        out.bytes(major, 4);
+        out.u32(0x200);
+        for (auto brand : compatible) out.bytes(brand, 4);
+        out.end();
+    }
+
+    void writeMdatHeader(uint64_t payload, bool large) {
+        uint8_t header[16];
+        auto type = Box::str2BoxType("mdat");
+        if (large) {
+            putBigU32(header, 1);
+            memcpy(header + 4, &type, 4);
+            putBigU64(header + 8, payload + 16);
+        } else {
+            putBigU32(header, static_cast<uint32_t>(payload + 8));
+            memcpy(header + 4, &type, 4);
+        }
+        buffer_.insert(buffer_.end(), header, header + (large ? 16 : 8));
+    }
+
+    /**
+     * moov with the sample tables of every track, or with empty ones and an
+     * mvex when fragmented. Chunk offsets are left 0, offsets_at_ says
+     * where they go.
+     */
+    void writeMoov(Builder &out, bool co64) {
+        const uint32_t movie_timescale = 1000;
+        uint64_t movie_duration = 0;
+        std::vector<uint64_t> durations;
+        for (size_t t = 0; t < tracks_.size(); t++) {
+            durations.push_back(tracks_[t].duration_ * movie_timescale /
+                                spec_.tracks_[t].timescale_);
+            movie_duration = std::max(movie_duration, durations.back());
+        }
+        bool fragmented = spec_.fragment_ms_ > 0;
+        if (fragmented) {
+            movie_duration = 0;
+        }
+
+        out.begin("moov");
+        uint8_t version = movie_duration > UINT32_MAX ? 1 : 0;
+        out.beginFull("mvhd", version, 0);
+        out.time(version, 0);
+        out.time(version, 0);
+        out.u32(movie_timescale);
+        out.time(version, movie_duration);
+        out.u32(0x10000);
+        out.u16(0x100);
+        out.zeros(10);
+        out.matrix();
+        out.zeros(24);
+        out.u32(static_cast<uint32_t>(tracks_.size() + 1));
+        out.end();
+        for (size_t t = 0; t < tracks_.size(); t++) {
+            writeTrak(out, t, fragmented ? 0 : durations[t], co64);
+        }
+        if (fragmented) {
+            out.begin("mvex");
+            for (size_t t = 0; t < tracks_.size(); t++) {
+                out.beginFull("trex", 0, 0);
+                out.u32(static_cast<uint32_t>(t + 1));
+                out.u32(1);
+                out.u32(spec_.tracks_[t].sample_delta_);
+                out.u32(0);
+                out.u32(0);
+                out.end();
+            }
+            out.end();
+        }
+        out.end();
+    }
+
+    void writeTrak(Builder &out, size_t t, uint64_t movie_duration,
+                   bool co64) {
+        const auto &spec = spec_.tracks_[t];
+        bool video = spec.handler_type_ == Box::str2BoxType("vide");
+        bool fragmented = spec_.fragment_ms_ > 0;
+        out.begin("trak");
+        uint8_t version = movie_duration > UINT32_MAX ? 1 : 0;
+        // Enabled, in movie
+        out.beginFull("tkhd", version, 3);
+        out.time(version, 0);
+        out.time(version, 0);
+        out.u32(static_cast<uint32_t>(t + 1));
+        out.u32(0);
+        out.time(version, movie_duration);
+        out.zeros(8);
+        out.u16(0);
+        out.u16(0);
+        out.u16(video ? 0 : 0x100);
+        out.u16(0);
+        out.matrix();
+        out.u32(video ? 1920U << 16U : 0);
+        out.u32(video ? 1080U << 16U : 0);
+        out.end();
+
+        out.begin("mdia");
+        auto duration = fragmented ? 0 : tracks_[t].duration_;
+        version = duration > UINT32_MAX ? 1 : 0;
+        out.beginFull("mdhd", version, 0);
+        out.time(version, 0);
+        out.time(version, 0);
+        out.u32(spec.timescale_);
+        out.time(version, duration);
+        // "und"
+        out.u16(0x55c4);
+        out.u16(0);
+        out.end();
+        out.beginFull("hdlr", 0, 0);
+        out.u32(0);
+        out.bytes(reinterpret_cast<const char *>(&spec.handler_type_), 4);
+        out.zeros(12);
+        out.bytes("synthetic", 10);
+        out.end();
+
+        out.begin("minf");
+        if (video) {
+            out.beginFull("vmhd", 0, 1);
+            out.zeros(8);
+        } else {
+            out.beginFull("smhd", 0, 0);
+            out.zeros(4);
+        }
+        out.end();
+        out.begin("dinf");
+        out.beginFull("dref", 0, 0);
+        out.u32(1);
+        // Media in this file
+        out.beginFull("url ", 0, 1);
+        out.end();
+        out.end();
+        out.end();
+        out.begin("stbl");
+        writeStsd(out, video);
+        writeSampleTables(out, t, co64);
+        out.end();
+        out.end();
+        out.end();
+        out.end();
+    }
+
+    static void writeStsd(Builder &out, bool video) {
+        out.beginFull("stsd", 0, 0);
+        out.u32(1);
+        if (video) {
+            out.begin("avc1");
+            out.zeros(6);
+            out.u16(1);
+            out.zeros(16);
+            out.u16(1920);
+            out.u16(1080);
+            out.u32(72U << 16U);
+            out.u32(72U << 16U);
+            out.u32(0);
+            out.u16(1);
+            out.zeros(32);
+            out.u16(24);
+            out.u16(0xffff);
+        } else {
+            out.begin("mp4a");
+            out.zeros(6);
+            out.u16(1);
+            out.zeros(8);
+            out.u16(2);
+            out.u16(16);
+            out.zeros(4);
+            out.u32(48000U << 16U);
+        }
+        out.end();
+        out.end();
+    }
+
+    // Tables of track t, empty ones when fragmented
+    void writeSampleTables(Builder &out, size_t t, bool co64) {
+        const auto &spec = spec_.tracks_[t];
+        auto &track = tracks_[t];
+        bool fragmented = spec_.fragment_ms_ > 0;
+        uint64_t count = fragmented ? 0 : spec.sample_count_;
+
+        std::vector<uint32_t> runs;
+        for (uint64_t n = 0; n < count; n++) {
+            auto d = delta(t, n);
+            if (runs.empty() || runs.back() != d) {
+                runs.push_back(0);
+                runs.push_back(d);
+            }
+            runs[runs.size() - 2]++;
+        }
+        out.beginFull("stts", 0, 0);
+        out.u32(static_cast<uint32_t>(runs.size() / 2));
+        out.u32Array(runs);
+        out.end();
+
+        if (spec.ctts_ && !fragmented) {
+            runs.clear();
+            for (uint64_t n = 0; n < count; n++) {
+                runs.push_back(1);
+                runs.push_back(ctsOffset(spec, n));
+            }
+            out.beginFull("ctts", 0, 0);
+            out.u32(static_cast<uint32_t>(count));
+            out.u32Array(runs);
+            out.end();
+        }
+
+        if (spec.gop_ > 0 && !fragmented) {
+            std::vector<uint32_t> sync;
+            for (uint64_t n = 0; n < count; n += spec.gop_) {
+                sync.push_back(static_cast<uint32_t>(n + 1));
+            }
+            out.beginFull("stss", 0, 0);
+            out.u32(static_cast<uint32_t>(sync.size()));
+            out.u32Array(sync);
+            out.end();
+        }
+
+        runs.clear();
+        const auto &chunks = track.chunk_samples_;
+        for (size_t i = 0; i < chunks.size(); i++) {
+            if (i == 0 || chunks[i] != chunks[i - 1]) {
+                runs.insert(runs.end(),
+                            {static_cast<uint32_t>(i + 1), chunks[i], 1});
+            }
+        }
+        out.beginFull("stsc", 0, 0);
+        out.u32(static_cast<uint32_t>(runs.size() / 3));
+        out.u32Array(runs);
+        out.end();
+
+        out.beginFull("stsz", 0, 0);
+        out.u32(0);
+        out.u32(static_cast<uint32_t>(count));
+        if (!fragmented) out.u32Array(track.sizes_);
+        out.end();
+
+        out.beginFull(co64 ? "co64" : "stco", 0, 0);
+        out.u32(static_cast<uint32_t>(chunks.size()));
+        track.offsets_at_ = out.data().size();
+        out.zeros(chunks.size() * (co64 ? 8 : 4));
+        out.end();
+    }
+
+    // Output goes through buffer_, which starts at file offset pos_
+
+    uint64_t tell() const { return pos_ + buffer_.size(); }
+
+    bool append(const std::vector<uint8_t> &data) {
+        buffer_.insert(buffer_.end(), data.begin(), data.end());
+        return buffer_.size() < kBufferSize || flush();
+    }
+
+    bool fill(uint8_t byte, uint64_t n) {
+        if (spec_.sparse_) {
+            if (!flush()) return false;
+            pos_ += n;
+            return true;
+        }
+        buffer_.resize(buffer_.size() + n, byte);
+        return buffer_.size() < kBufferSize || flush();
+    }
+
+    bool flush() {
+        if (!writeAll(out_, buffer_, pos_)) {
+            return false;
+        }
+        pos_ += buffer_.size();
+        buffer_.clear();
+        return true;
+    }
+
+    static const size_t kBufferSize = 4 << 20;
+
+    SyntheticSpec spec_;
+    std::vector<Track> tracks_;
+    // Chunks in file order
+    std::vector<Chunk> chunks_;
+    int out_ = -1;
+    uint64_t pos_ = 0;
+    std::vector<uint8_t> buffer_;
+};
+
+}  // namespace mov
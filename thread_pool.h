@@ -0,0 +1,222 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mov {
+
+/**
+ * Fixed set of worker threads running tasks from one queue
+ *
+ * Tasks must not throw; catch inside the task and hand the error back to
+ * whoever waits for it.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; i++) {
+            workers_.emplace_back([this] { run(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+            pending_++;
+        }
+        wake_.notify_one();
+    }
+
+    // Block until every task submitted so far has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+private:
+    void run() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) {
+                idle_.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    size_t pending_ = 0;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+};
+
+/**
+ * Thread pool where every worker has its own task queue
+ *
+ * Tasks are spread over the queues round robin, or go to the submitting
+ * worker's own queue when a task submits more work. A worker takes its
+ * newest task first and, once its queue is empty, steals the oldest task
+ * of another worker. Workers mostly touch only their own queue's lock, and
+ * the shared lock is taken only to sleep and wake up, so many short tasks
+ * don't all contend on one mutex.
+ *
+ * Tasks must not throw.
+ */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(
+        size_t threads = std::thread::hardware_concurrency()) {
+        threads = std::max<size_t>(threads, 1);
+        for (size_t i = 0; i < threads; i++) {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < threads; i++) {
+            workers_.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    void submit(std::function<void()> task) {
+        auto target = current_pool_ == this
+                          ? current_index_
+                          : next_.fetch_add(1, std::memory_order_relaxed) %
+                                queues_.size();
+        // Count the task before a worker can pop it, or the worker could
+        // drop pending_ to zero and queued_ below zero first
+        pending_++;
+        queued_++;
+        {
+            auto &queue = *queues_[target];
+            std::lock_guard<std::mutex> lock(queue.mutex_);
+            queue.tasks_.push_back(std::move(task));
+        }
+        {
+            // Pairs with the check in run(), so the wakeup can't get lost
+            std::lock_guard<std::mutex> lock(mutex_);
+        }
+        wake_.notify_one();
+    }
+
+    // Block until every task submitted so far has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex_;
+        std::deque<std::function<void()>> tasks_;
+    };
+
+    bool pop(size_t self, std::function<void()> &task) {
+        for (size_t i = 0; i < queues_.size(); i++) {
+            auto &queue = *queues_[(self + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex_);
+            if (queue.tasks_.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                task = std::move(queue.tasks_.back());
+                queue.tasks_.pop_back();
+            } else {
+                task = std::move(queue.tasks_.front());
+                queue.tasks_.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        current_pool_ = this;
+        current_index_ = self;
+        while (true) {
+            std::function<void()> task;
+            if (pop(self, task)) {
+                queued_--;
+                task();
+                if (--pending_ == 0) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    idle_.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this] { return stop_ || queued_ > 0; });
+            if (stop_ && queued_ == 0) {
+                return;
+            }
+        }
+    }
+
+    static inline thread_local WorkStealingPool *current_pool_ = nullptr;
+    static inline thread_local size_t current_index_ = 0;
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> next_{0};
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> pending_{0};
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+};
+
+}  // namespace mov
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <chrono>
+
+#include "faststart.h"
+#include "mp4.h"
+
+namespace mov {
+
+struct TrimStats {
+    // Where the clip starts after snapping to a sync sample, and ends
+    double start_ = 0;
+    double end_ = 0;
+    uint64_t samples_ = 0;
+    uint64_t bytes_copied_ = 0;
+    // Separate byte ranges read out of the input's mdat
+    uint64_t ranges_ = 0;
+    uint32_t promoted_ = 0;
+    double seconds_ = 0;
+};
+
+/**
+ * Cut the samples from start to end seconds out of a file without decoding
+ * them
+ *
+ * The start moves back to the sync sample at or before it in the first track
+ * with a sync sample table, so the clip decodes from its first frame, and
+ * the other tracks are cut at that same time. Each track gets new sample
+ * tables for the samples it keeps. The output is ftyp, the new moov, and one
+ * mdat holding only the kept samples. Their bytes are copied from the input
+ * in file order, one range per run of adjacent samples, so only the clip and
+ * the metadata are read. Edit lists are dropped, since they map the timeline
+ * of the whole file.
+ */
+class Trim {
+public:
+    static bool run(const char *in_path, const char *out_path, double start,
+                    double end, TrimStats &stats) {
+        auto begin = std::chrono::steady_clock::now();
+        stats = TrimStats();
+        if (!(start < end)) {
+            std::cerr << "empty time range\n";
+            return false;
+        }
+        auto in = std::make_shared<PreadSource>();
+        if (!in->open(in_path)) {
+            std::cerr << "open " << in_path << " failed\n";
+            return false;
+        }
+        FileOp file(in);
+        std::shared_ptr<Box> ftyp;
+        std::shared_ptr<Box> moov;
+        for (uint64_t pos = 0; pos < in->size();) {
+            BoxHeader header;
+            if (!Box::readHeaderAt(*in, pos, header) ||
+                header.size_ < header.header_size_ || header.end() <= pos) {
+                break;
+            }
+            if ((header.type_ == Ftyp::tag_ && ftyp == nullptr) ||
+                (header.type_ == Moov::tag_ && moov == nullptr)) {
+                auto base = Box::parseBasic(file, pos);
+                if (base == nullptr) break;
+                auto box = toDetailType(std::move(base));
+                box->parse(file);
+                (header.type_ == Ftyp::tag_ ? ftyp : moov) = box;
+            }
+            pos = header.end();
+        }
+        if (moov == nullptr) {
+            std::cerr << "no moov in " << in_path << '\n';
+            return false;
+        }
+        auto mvhd = moov->child<Mvhd>();
+        if (mvhd == nullptr || moov->child<Mvex>() != nullptr) {
+            std::cerr << "can't trim " << in_path
+                      << ", no mvhd or fragmented\n";
+            return false;
+        }
+
+        std::vector<Clip> clips;
+        if (!selectSamples(*moov, start, end, clips, stats)) {
+            std::cerr << "no samples to keep in " << in_path << '\n';
+            return false;
+        }
+
+        // Chunks of every track in file order, laid out the same way
+        std::vector<Chunk> chunks;
+        for (size_t i = 0; i < clips.size(); i++) {
+            splitChunks(clips[i], i, chunks);
+        }
+        std::stable_sort(chunks.begin(), chunks.end(),
+                         [](const Chunk &a, const Chunk &b) {
+                             return a.in_offset_ < b.in_offset_;
+                         });
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+        uint64_t data_size = 0;
+        for (auto &chunk : chunks) {
+            chunk.out_offset_ = data_size;
+            data_size += chunk.size_;
+            if (!ranges.empty() &&
+                ranges.back().first + ranges.back().second ==
+                    chunk.in_offset_) {
+                ranges.back().second += chunk.size_;
+            } else {
+                ranges.emplace_back(chunk.in_offset_, chunk.size_);
+            }
+        }
+
+        uint64_t movie_duration = 0;
+        for (size_t i = 0; i < clips.size(); i++) {
+            movie_duration =
+                std::max(movie_duration,
+                         writeTables(clips[i], i, chunks, mvhd->timescale()));
+        }
+        mvhd->setDuration(movie_duration);
+
+        // Chunk offsets depend on the size of moov, which depends on whether
+        // they need co64. Sizes only grow, so this settles quickly.
+        uint64_t mdat_header = data_size + 8 > UINT32_MAX ? 16 : 8;
+        uint64_t head_size = ftyp ? ftyp->updateSize() : 0;
+        uint64_t moov_size = moov->updateSize();
+        while (true) {
+            auto base = head_size + moov_size + mdat_header;
+            for (auto &clip : clips) {
+                std::vector<uint64_t> offsets;
+                for (auto chunk : clip.chunks_) {
+                    offsets.push_back(base + chunks[chunk].out_offset_);
+                }
+                if (!storeChunkOffsets(clip.chunk_offsets_, std::move(offsets),
+                                       stats.promoted_)) {
+                    std::cerr << "rewrite moov failed\n";
+                    return false;
+                }
+            }
+            auto size = moov->updateSize();
+            if (size == moov_size) break;
+            moov_size = size;
+        }
+
+        Box::Boxes head{moov};
+        if (ftyp != nullptr) {
+            head.insert(head.begin(), ftyp);
+        }
+        std::vector<uint8_t> data;
+        if (!Box::serialize(head, in.get(), data)) {
+            return false;
+        }
+        uint8_t mdat[16];
+        if (mdat_header == 16) {
+            putBigU32(mdat, 1);
+            putBigU64(mdat + 8, data_size + 16);
+        } else {
+            putBigU32(mdat, data_size + 8);
+        }
+        memcpy(mdat + 4, "mdat", 4);
+        data.insert(data.end(), mdat, mdat + mdat_header);
+
+        std::string tmp;
+        int out = openOutput(in->fd(), out_path, tmp);
+        if (out < 0) {
+            return false;
+        }
+        bool ok = writeAll(out, data, 0);
+        uint64_t pos = data.size();
+        for (size_t i = 0; ok && i < ranges.size(); i++) {
+            ok = copyRange(in->fd(), ranges[i].first, out, pos,
+                           ranges[i].second);
+            pos += ranges[i].second;
+        }
+        if (!ok) {
+            std::cerr << "write " << out_path << " failed\n";
+        }
+        ok = finishOutput(out, tmp, out_path, ok);
+        stats.bytes_copied_ = data_size;
+        stats.ranges_ = ranges.size();
+        stats.seconds_ = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+        return ok;
+    }
+
+private:
+    // Samples [first_, last_) of one track are kept
+    struct Clip {
+        Trak *trak_;
+        Box *stbl_;
+        const TrackIndex *index_;
+        size_t first_ = 0;
+        size_t last_ = 0;
+        // Description index of each kept sample
+        std::vector<uint32_t> descriptions_;
+        // The track's chunks, as indexes into the chunk list
+        std::vector<size_t> chunks_;
+        Box *chunk_offsets_ = nullptr;
+    };
+
+    // Run of samples of one track, adjacent in the input
+    struct Chunk {
+        size_t track_;
+        size_t first_;
+        uint32_t count_;
+        uint32_t description_;
+        uint64_t in_offset_;
+        uint64_t size_;
+        uint64_t out_offset_;
+    };
+
+    static uint64_t rescale(uint64_t time, uint64_t from, uint64_t to) {
+        from = std::max<uint64_t>(from, 1);
+        return time / from * to + time % from * to / from;
+    }
+
+    static uint64_t toUnits(double seconds, uint32_t timescale) {
+        auto units = seconds * timescale;
+        if (units <= 0) return 0;
+        if (units >= 1.8e19) return UINT64_MAX;
+        return static_cast<uint64_t>(units);
+    }
+
+    /**
+     * Pick the samples each track keeps. Tracks without usable sample tables
+     * are left out of moov.
+     */
+    static bool selectSamples(Box &moov, double start, double end,
+                              std::vector<Clip> &clips, TrimStats &stats) {
+        std::vector<Box *> dropped;
+        for (const auto &item : moov.children()) {
+            auto trak = item->as<Trak>();
+            if (trak == nullptr) continue;
+            auto mdia = trak->child<Mdia>();
+            auto minf = mdia ? mdia->child<Minf>() : nullptr;
+            auto stbl = minf ? minf->child<Stbl>() : nullptr;
+            auto index = trak->sampleIndex();
+            auto chunk_offsets =
+                stbl ? stbl->findChild(Stco::tag_) : nullptr;
+            if (chunk_offsets == nullptr && stbl != nullptr) {
+                chunk_offsets = stbl->findChild(Co64::tag_);
+            }
+            if (index == nullptr || chunk_offsets == nullptr) {
+                dropped.push_back(trak);
+                continue;
+            }
+            Clip clip;
+            clip.trak_ = trak;
+            clip.stbl_ = stbl;
+            clip.index_ = index;
+            clip.chunk_offsets_ = chunk_offsets;
+            clips.push_back(std::move(clip));
+        }
+        for (auto trak : dropped) {
+            moov.removeChild(trak);
+        }
+
+        // Start time as a fraction, from the sync sample of the first track
+        // that has a sync sample table
+        uint64_t start_time = toUnits(start, 1000000);
+        uint64_t start_scale = 1000000;
+        for (auto &clip : clips) {
+            if (clip.stbl_->child<Stss>() == nullptr) continue;
+            const auto &dts = clip.index_->dtsArray();
+            auto time = toUnits(start, clip.index_->timescale());
+            size_t sample = std::upper_bound(dts.begin(), dts.end(), time) -
+                            dts.begin();
+            if (sample == 0 ||
+                time >= dts[sample - 1] + clip.index_->duration(sample - 1)) {
+                // Not inside this track, nothing to snap to
+                break;
+            }
+            sample--;
+            while (sample > 0 && !clip.index_->isSync(sample)) {
+                sample--;
+            }
+            start_time = dts[sample];
+            start_scale = clip.index_->timescale();
+            break;
+        }
+        stats.start_ = static_cast<double>(start_time) / start_scale;
+
+        bool any = false;
+        for (auto &clip : clips) {
+            const auto &dts = clip.index_->dtsArray();
+            auto timescale = clip.index_->timescale();
+            auto from = rescale(start_time, start_scale, timescale);
+            auto to = toUnits(end, timescale);
+            clip.first_ =
+                std::lower_bound(dts.begin(), dts.end(), from) - dts.begin();
+            clip.last_ = std::max(
+                clip.first_,
+                static_cast<size_t>(std::lower_bound(dts.begin(), dts.end(),
+                                                     to) -
+                                    dts.begin()));
+            if (clip.last_ > clip.first_) {
+                any = true;
+                auto last = clip.last_ - 1;
+                stats.end_ = std::max(
+                    stats.end_,
+                    static_cast<double>(dts[last] +
+                                        clip.index_->duration(last)) /
+                        timescale);
+            }
+            stats.samples_ += clip.last_ - clip.first_;
+            clip.descriptions_ = sampleDescriptions(clip);
+        }
+        return any;
+    }
+
+    // Walk stsc for the description index of the kept samples
+    static std::vector<uint32_t> sampleDescriptions(const Clip &clip) {
+        std::vector<uint32_t> descriptions(clip.last_ - clip.first_, 1);
+        auto stsc = clip.stbl_->child<Stsc>();
+        if (stsc == nullptr) return descriptions;
+        const auto &entries = stsc->entries();
+        uint64_t sample = 0;
+        for (size_t e = 0; e < entries.size() && sample < clip.last_; e++) {
+            uint64_t chunks = e + 1 < entries.size()
+                                  ? entries[e + 1].first_chunk_ -
+                                        entries[e].first_chunk_
+                                  : UINT64_MAX;
+            auto per_chunk = entries[e].samples_per_chunk_;
+            if (per_chunk == 0) continue;
+            auto end = chunks > (clip.last_ - sample) / per_chunk
+                           ? clip.last_
+                           : sample + chunks * per_chunk;
+            for (auto i = std::max<uint64_t>(sample, clip.first_); i < end;
+                 i++) {
+                descriptions[i - clip.first_] =
+                    entries[e].sample_description_index_;
+            }
+            sample = end;
+        }
+        return descriptions;
+    }
+
+    // Group the kept samples into runs that are adjacent in the input
+    static void splitChunks(const Clip &clip, size_t track,
+                            std::vector<Chunk> &chunks) {
+        const auto &index = *clip.index_;
+        for (auto i = clip.first_; i < clip.last_; i++) {
+            auto description = clip.descriptions_[i - clip.first_];
+            if (i > clip.first_) {
+                auto &chunk = chunks.back();
+                if (chunk.in_offset_ + chunk.size_ == index.offset(i) &&
+                    chunk.description_ == description &&
+                    chunk.count_ < UINT32_MAX) {
+                    chunk.count_++;
+                    chunk.size_ += index.size(i);
+                    continue;
+                }
+            }
+            chunks.push_back(Chunk{track, i, 1, description, index.offset(i),
+                                   index.size(i), 0});
+        }
+    }
+
+    /**
+     * Give the track sample tables for its kept samples, and point
+     * clip.chunks_ at its chunks. Return the track duration in the movie
+     * timescale.
+     */
+    static uint64_t writeTables(Clip &clip, size_t track,
+                                const std::vector<Chunk> &chunks,
+                                uint32_t movie_timescale) {
+        const auto &index = *clip.index_;
+        auto &stbl = *clip.stbl_;
+        auto first = clip.first_;
+        auto last = clip.last_;
+
+        std::vector<Stts::Entry> stts;
+        uint64_t duration = 0;
+        for (auto i = first; i < last; i++) {
+            auto delta = static_cast<uint32_t>(index.duration(i));
+            duration += delta;
+            if (!stts.empty() && stts.back().sample_delta_ == delta) {
+                stts.back().sample_count_++;
+            } else {
+                stts.push_back(Stts::Entry{1, delta});
+            }
+        }
+        stbl.child<Stts>()->setEntries(std::move(stts));
+
+        if (auto ctts = stbl.child<Ctts>()) {
+            std::vector<Ctts::Entry> entries;
+            for (auto i = first; i < last; i++) {
+                auto offset = static_cast<uint32_t>(index.ctsDelta(i));
+                if (!entries.empty() &&
+                    entries.back().sample_offset_ == offset) {
+                    entries.back().sample_count_++;
+                } else {
+                    entries.push_back(Ctts::Entry{1, offset});
+                }
+            }
+            ctts->setEntries(std::move(entries));
+        }
+
+        auto stsz = stbl.child<Stsz>();
+        if (stsz->sampleSize() != 0) {
+            stsz->setSampleSize(stsz->sampleSize(), last - first);
+        } else {
+            stsz->setEntrySizes(std::vector<uint32_t>(
+                index.sizes().begin() + first, index.sizes().begin() + last));
+        }
+
+        if (auto stss = stbl.child<Stss>()) {
+            std::vector<uint32_t> numbers;
+            for (auto i = first; i < last; i++) {
+                if (index.isSync(i)) {
+                    numbers.push_back(i - first + 1);
+                }
+            }
+            stss->setSampleNumbers(std::move(numbers));
+        }
+
+        // Back to sample order, in case the input didn't store it that way
+        clip.chunks_.clear();
+        for (size_t c = 0; c < chunks.size(); c++) {
+            if (chunks[c].track_ == track) {
+                clip.chunks_.push_back(c);
+            }
+        }
+        std::sort(clip.chunks_.begin(), clip.chunks_.end(),
+                  [&chunks](size_t a, size_t b) {
+                      return chunks[a].first_ < chunks[b].first_;
+                  });
+        std::vector<Stsc::Entry> stsc;
+        for (size_t n = 0; n < clip.chunks_.size(); n++) {
+            const auto &chunk = chunks[clip.chunks_[n]];
+            if (stsc.empty() ||
+                stsc.back().samples_per_chunk_ != chunk.count_ ||
+                stsc.back().sample_description_index_ != chunk.description_) {
+                stsc.push_back(Stsc::Entry{static_cast<uint32_t>(n + 1),
+                                           chunk.count_, chunk.description_});
+            }
+        }
+        stbl.child<Stsc>()->setEntries(std::move(stsc));
+
+        auto mdia = clip.trak_->child<Mdia>();
+        if (auto mdhd = mdia->child<Mdhd>()) {
+            mdhd->setDuration(duration);
+        }
+        auto movie_duration =
+            rescale(duration, index.timescale(), movie_timescale);
+        if (auto tkhd = clip.trak_->child<Tkhd>()) {
+            tkhd->setDuration(movie_duration);
+        }
+        while (auto edts = clip.trak_->findChild(Box::str2BoxType("edts"))) {
+            clip.trak_->removeChild(edts);
+        }
+        return movie_duration;
+    }
+};
+
+}  // namespace mov